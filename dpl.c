@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // SEEK_DATA / SEEK_HOLE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -8,186 +9,5442 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <sys/sysmacros.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/inotify.h>
+#include <sys/fanotify.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <getopt.h>
+#include <signal.h>
+#include <time.h>
+#include <limits.h>
+#include <math.h>
+#include <stdatomic.h>
+#include "md5-lib/global.h"
+#include "md5-lib/md5.h"
+#include "dpl_index.h"
+#include "dpl_digest.h"
 
-#define MAX_FILES 4096
 #define MAX_PATH 1024
+#define MAX_DEVICES 64 // Sistemas de archivos distintos dentro de un recorrido
+#define AUTO_MAX_WORKERS 64 // Tope de hilos de hashing por dispositivo con -t auto
+#define AUTO_INTERVAL_MS 500 // Periodo de medición del controlador de -t auto
+#define AUTO_REPROBE_INTERVALS 6 // Intervalos estables antes de volver a probar
+#define DEDUPE_BATCH 16 // Destinos por llamada a FIDEDUPERANGE
+#define DEDUPE_CHUNK (16 * 1024 * 1024) // Bytes por llamada (límite de btrfs)
+#define DEFAULT_MAX_INDEX (4 * 1024 * 1024) // Entradas del índice del modo --watch
+#define PARTIAL_SIZE 4096 // Bytes del comienzo del archivo que cubre el hash parcial
+#define FAST_PARTIAL_SIZE 16384 // Con -m x: bytes del comienzo y del final que cubre el hash rápido
+#define MERGE_FANIN 64 // Corridas que se mezclan a la vez en el modo --mem-limit
+#define DEFAULT_TABLE_SLOTS (1 << 22) // Slots de cada tabla compartida de --procs
+#define DEFAULT_SOCKET "/tmp/dpl-hash.sock" // Socket de --serve y de -m d
+#define SERVE_CACHE_BUCKETS 65536
+#define SHARD_POLL_MS 100 // Cada cuánto revisa el padre si murió algún proceso
+#define DEFAULT_CHECKPOINT_INTERVAL 60 // Segundos entre puntos de control
+#define ESTIMATE_CALIBRATION_MS 250 // Duración de la medición de MD5 de --estimate
+#define ESTIMATE_PROBE_BYTES (32 * 1024 * 1024) // Tope de la lectura de prueba por dispositivo
+#define ESTIMATE_PROBE_FILES 32 // Archivos abiertos para medir el costo por archivo
+#define BUDGET_SIGNAL_MS 100 // Cada cuánto se reenvía la señal a los hilos tras agotar --time-budget
+#define BUCKET_SLEEP_MS 100 // Tramo máximo que duerme un hilo en deuda antes de revisar los límites
+#define CHECKPOINT_MAGIC "DPLCKPT3"
+#define CHECKPOINT_WALK 1 // Fase guardada: recorrido pendiente
+#define CHECKPOINT_HASH 2 // Fase guardada: recorrido terminado, faltan hashes
+#define DIR_ENTRY_FILE 'f' // Tipo de entrada en el digest de un directorio
+#define DIR_ENTRY_DIR 'd'
 #define HASH_SIZE 33 // 32 caracteres + 1 para el terminador nulo
+#define READ_BUF_SIZE (64 * 1024) // Tamaño de cada lectura al calcular el hash
+#define BLAKE3_SEGMENT (4 * 1024 * 1024) // Con -m b, bytes del subárbol que calcula cada hilo
+#define BLAKE3_PARALLEL_MIN (64 * 1024 * 1024) // Con -m b, tamaño desde el que un archivo se reparte entre hilos
+#define CHUNK_BUF_SIZE (1024 * 1024) // Buffer de lectura de --chunks; al menos 2 * DPL_CDC_MAX
+#define CHUNK_PAIR_LIMIT 16 // Archivos con un mismo bloque hasta los que se cuentan todos los pares
 
+// Valores de ioprio_set(2); no todas las versiones de glibc exportan linux/ioprio.h
+#ifndef IOPRIO_WHO_PROCESS
+#define IOPRIO_WHO_PROCESS 1
+#endif
+#ifndef IOPRIO_CLASS_IDLE
+#define IOPRIO_CLASS_IDLE 3
+#endif
+#ifndef IOPRIO_CLASS_SHIFT
+#define IOPRIO_CLASS_SHIFT 13
+#endif
+
+#define FILE_HASHED 1    // digest contiene el MD5 del archivo
+#define FILE_CANDIDATE 2 // Otro archivo tiene el mismo tamaño
+#define FILE_PREFILTERED 4 // Con -m x: digest contiene el hash rápido del comienzo y el final
+
+// Pila de rutas pendientes de visitar. Las rutas se guardan una tras otra en
+// un solo bloque que crece según haga falta. Con --mem-limit, cuando la
+// parte en memoria supera su cuota, la mitad de abajo se vuelca a un archivo
+// como un bloque más y se recarga cuando la de memoria se vacía; el orden de
+// la pila se conserva.
 typedef struct {
-    char path[MAX_PATH];
-} FileNode;
+    char *paths;         // Rutas terminadas en '\0', apiladas
+    size_t used, capacity;
+    size_t *offsets;     // Comienzo de cada ruta en memoria
+    int resident, slots; // Rutas en memoria y capacidad de offsets
+    int count;           // Rutas pendientes, en memoria y en disco
+    size_t limit;        // Bytes en memoria antes de volcar (0 = sin límite)
+    FILE *spill;
+    off_t spill_size;
+    off_t *block_start;  // Comienzo de cada bloque volcado, el último arriba
+    int *block_entries;
+    int block_count, block_capacity;
+} FileList;
 
+// Catálogo de archivos regulares guardado por columnas (struct of arrays).
+// Cada etapa recorre sólo las columnas que necesita, y las rutas viven en un
+// único bloque de texto al que apunta path_id. Los índices de archivo que
+// usan las colas y los grupos son posiciones en estas columnas.
 typedef struct {
-    FileNode files[MAX_FILES];
+    off_t *size;
+    dev_t *dev;
+    ino_t *ino;
+    time_t *mtime;
+    size_t *path_id;
+    unsigned char (*digest)[16];
+    unsigned long long *phys; // Offset físico del primer extent (orden de lectura)
+    unsigned char *flags;     // FILE_HASHED | FILE_CANDIDATE | FILE_PREFILTERED
+    int *shared_with;         // Índice del archivo con el que ya comparte extents, o -1
+    unsigned char (*sha256)[32]; // Sólo con --digests sha256
+    uint32_t *crc32c;            // Sólo con --digests crc32c
     int count;
-} FileList;
+    int capacity;
+    char *paths;
+    size_t paths_size;
+    size_t paths_capacity;
+} Catalog;
+
+// Digests que se calculan en una misma pasada sobre cada buffer leído
+typedef struct {
+    int set; // DPL_DIGEST_*
+    MD5_CTX md5;
+    DplSha256 sha256;
+    uint32_t crc32c;
+    DplBlake3 blake3;
+} DigestContext;
+
+// Un bloque de contenido de --chunks: el índice de bloques es un arreglo de
+// estos registros ordenado por digest
+typedef struct {
+    unsigned char digest[16]; // Primeros 16 bytes de BLAKE3 del bloque
+    uint32_t size;
+    int file;
+} ChunkRecord;
+
+// Archivo grande que se reparte entre hilos con -m b: cada segmento completo
+// de BLAKE3_SEGMENT bytes es un subárbol independiente
+typedef struct {
+    int fd;
+    int sparse;     // Hay huecos: cada segmento los busca con SEEK_DATA
+    off_t segments; // Segmentos que se reparten; el resto lo lee quien llamó
+    off_t next;     // Siguiente segmento a entregar
+    unsigned char (*cvs)[32];
+    int failed;
+    pthread_mutex_t lock;
+} Blake3Job;
+
+// Miembro de un grupo de tamaño con --shared-extents: se ordenan por
+// (dispositivo, extents, inodo) para que los que comparten datos queden juntos
+typedef struct {
+    int node;
+    int order; // Posición en el grupo, que sigue el orden de visita
+    struct fiemap *extents;
+} ExtentKey;
+
+// Clave de ordenamiento del radix sort: 24 bytes de clave más el índice
+typedef struct {
+    unsigned long long size;
+    unsigned char digest[16];
+    int index;
+    int pad;
+} SortKey;
+
+// Estado compartido por los hilos de una ordenación radix LSD paralela
+typedef struct {
+    SortKey *src;
+    SortKey *dst;
+    int count;
+    int threads;
+    int first_digit; // 0 ordena por (tamaño, hash); 16 sólo por tamaño
+    size_t (*offsets)[256]; // Histograma y luego posición de destino, por hilo
+    int skip;        // 1 si todas las claves comparten el dígito actual
+    pthread_barrier_t barrier;
+} RadixJob;
+
+typedef struct {
+    RadixJob *job;
+    int id;
+} RadixWorkerArg;
+
+// Cola de hashing de un dispositivo (st_dev). Cada dispositivo tiene sus
+// propios hilos, de modo que un disco lento no frena a uno rápido y las
+// lecturas de un disco rotacional no se mezclan con las de otro.
+typedef struct {
+    dev_t dev;
+    int rotational; // 1 si /sys/.../queue/rotational lo indica
+    int *files;     // Índices en el catálogo, en el orden en que se leerán
+    int count;
+    int next;       // Siguiente índice a entregar
+    int workers;    // Profundidad de cola: lecturas simultáneas en el dispositivo
+    int active;     // Hilos habilitados para leer (menor que workers con -t auto)
+    int peak;       // Máximo de hilos habilitados durante la etapa
+    unsigned long long bytes_done; // Contadores que muestrea el controlador
+    unsigned long long files_done;
+    pthread_mutex_t lock;
+    pthread_cond_t wake; // Despierta a los hilos en espera cuando cambia active
+} DeviceQueue;
+
+// Entrada del índice del modo --watch: un archivo representativo por cada
+// (tamaño, hash). Las rutas se guardan en un único bloque de texto para que
+// cada entrada ocupe unas decenas de bytes y no MAX_PATH.
+typedef struct {
+    off_t size;
+    time_t mtime;
+    unsigned char digest[16];
+    size_t path;  // Offset de la ruta en index_blob
+    int next;     // Siguiente entrada del mismo balde (o de la lista libre), -1 al final
+    int hashed;   // 0 si todavía no hizo falta leer el archivo
+} IndexEntry;
+
+// Registro compacto del modo --mem-limit. Las rutas no viajan en el registro:
+// file_id es su offset en el archivo de rutas.
+typedef struct {
+    unsigned long long size;
+    unsigned char digest[16]; // Vacío en la primera pasada, luego parcial y por último completo
+    unsigned long long file_id;
+} SpillRecord;
+
+// Mezcla de k corridas ordenadas con un montículo de mínimos
+typedef struct {
+    FILE **files;
+    SpillRecord *heads; // Registro actual de cada corrida
+    int *heap;          // Índices de corrida ordenados por su registro actual
+    int heap_count;
+    int *runs;          // Identificadores de las corridas (para borrarlas al cerrar)
+    int count;
+} MergeState;
+
+// Grupo de archivos verificados con el mismo tamaño y hash
+typedef struct {
+    int *members; // Índices en el catálogo, en orden de visita (apuntan a group_members)
+    int count;
+} DupGroup;
+
+// Directorio del árbol reconstruido a partir de las rutas del catálogo para
+// --dirs. Su digest es el MD5 de sus entradas ordenadas por nombre (tipo,
+// nombre y digest de cada una), así que dos directorios con el mismo digest
+// tienen el mismo contenido en todo su subárbol.
+typedef struct {
+    const char *path; // Prefijo de la ruta de uno de sus archivos (sin terminador)
+    int length;
+    int parent;       // Índice del directorio padre, -1 para el inicial
+    int depth;
+    unsigned char digest[16];
+    unsigned long long bytes;
+    int files;
+    int incomplete;   // 1 si algún archivo del subárbol no tiene hash
+    int group;        // Grupo de directorios idénticos, o -1
+    int fold;         // Directorio al que se reduce tras las copias informadas, o -1 si aún no se calculó
+} DirNode;
+
+// Entrada de un directorio: un archivo del catálogo o un subdirectorio
+typedef struct {
+    int parent;
+    const char *name;
+    int name_length;
+    int is_dir;
+    int index; // Índice en el catálogo o en dir_nodes
+} DirEntry;
+
+// Tablas compartidas del modo --procs, en una región memfd que heredan los
+// procesos hijos. Son de direccionamiento abierto y sin locks: un slot se
+// reclama con compare-and-swap y nunca se libera.
+typedef struct {
+    _Atomic unsigned long long size; // 0 = libre (no se registran archivos vacíos)
+    _Atomic unsigned int count;      // Archivos con este tamaño en todos los fragmentos
+    unsigned int pad;
+} SizeSlot;
+
+typedef struct {
+    _Atomic unsigned int state; // SLOT_FREE, SLOT_WRITING o SLOT_READY
+    unsigned int shard;
+    unsigned long long size;
+    unsigned char digest[16];
+    unsigned long long path_id; // Offset de la ruta en el bloque de rutas del fragmento
+} DigestSlot;
+
+#define SLOT_FREE 0
+#define SLOT_WRITING 1
+#define SLOT_READY 2
+
+// Cabecera de la región compartida. Los hijos marcan shard_arrived, avisan
+// en arrived al terminar la primera ronda (tamaños) y esperan go; el padre
+// hace de barrera y sólo espera a los que siguen vivos, así un fragmento que
+// falla no bloquea a los demás.
+typedef struct {
+    sem_t arrived;
+    sem_t go;
+    unsigned long long size_slots;   // Potencias de 2
+    unsigned long long digest_slots;
+    char pad[64];
+} ShardShared;
+
+// Trabajo de hashing del servicio (--serve). Hay a lo sumo uno por inodo en
+// curso: los pedidos simultáneos del mismo archivo esperan al mismo trabajo.
+typedef struct HashJob {
+    dev_t dev;
+    ino_t ino;
+    char path[MAX_PATH];       // Ruta del primer pedido
+    int done;
+    int ok;
+    char hash[HASH_SIZE];
+    int waiters;               // Pedidos que todavía no leyeron el resultado
+    struct HashJob *next;      // Siguiente en la cola de lectura
+    struct HashJob *next_busy; // Siguiente en la lista de trabajos en curso
+} HashJob;
+
+// Digest ya calculado por el servicio, válido mientras el inodo conserve
+// su tamaño y su fecha de modificación
+typedef struct CacheEntry {
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    char hash[HASH_SIZE];
+    struct CacheEntry *next;
+} CacheEntry;
+
+typedef struct {
+    DeviceQueue *queue;
+    int id; // Posición del hilo en su grupo: sólo lee si id < queue->active
+} HashWorkerArg;
 
+// Cabecera del punto de control (--checkpoint). Le siguen las rutas
+// pendientes de to_visit terminadas en '\0', las columnas del catálogo
+// (size, dev, ino, mtime, path_id, flags, digest y, según --digests, sha256
+// y crc32c) y el bloque de rutas.
+typedef struct {
+    char magic[8];
+    unsigned int phase;    // CHECKPOINT_WALK o CHECKPOINT_HASH
+    unsigned int frontier; // Entradas pendientes
+    unsigned int digests;  // digest_set del escaneo
+    unsigned int blake3;   // 1 si los hashes guardados son de -m b
+    unsigned long long file_count;
+    unsigned long long paths_size;
+    char start_dir[MAX_PATH];
+} CheckpointHeader;
+
+// Estado del controlador de -t auto para un dispositivo. Es una búsqueda
+// por escalada: se agrega o quita un hilo y se conserva el cambio sólo si
+// mejora el rendimiento medido en el intervalo siguiente.
+typedef struct {
+    unsigned long long last_bytes;
+    unsigned long long last_files;
+    double base_bytes; // Rendimiento de referencia antes de la prueba
+    double base_files;
+    int probe;         // +1 o -1 mientras se evalúa un cambio, 0 si estable
+    int next_probe;    // Dirección de la próxima prueba
+    int wait;          // Intervalos restantes antes de probar de nuevo
+} AutoTuner;
 
+// Limitador tipo token bucket compartido por todos los hilos. Los tokens
+// pueden quedar en negativo: quien los deja en deuda duerme hasta saldarla.
 typedef struct {
-    char file1[MAX_PATH];
-    char file2[MAX_PATH];
-} DuplicatePair;
+    double rate;             // Tokens por segundo (0 = sin límite)
+    double tokens;           // Tokens disponibles
+    struct timespec last;    // Última recarga
+    unsigned int generation; // Cambia con cada bucket_set_rate
+    pthread_mutex_t lock;
+} TokenBucket;
 
 FileList to_visit;
-FileList visited;
-DuplicatePair duplicates[MAX_FILES]; // Para almacenar pares de duplicados
-int duplicate_count = 0; // Contador de duplicados
+Catalog catalog;
+long long duplicate_count = 0; // Contador de pares de duplicados
+
+DeviceQueue devices[MAX_DEVICES];
+int device_count = 0;
 
 sem_t mutex;
 sem_t sem_to_visit;
-sem_t sem_visited;
-pthread_cond_t cond_to_visit;
+sem_t sem_visited; // Protege el catálogo durante el recorrido
+int num_walkers = 0;    // Hilos que recorren directorios
+int active_walkers = 0; // Hilos procesando una entrada (protegido por mutex)
+int rotational_depth = 1; // Lecturas simultáneas en un disco rotacional
+int auto_threads = 0; // 1 con -t auto: el número de hilos se ajusta midiendo
+int check_shared_extents = 0; // 1 con --shared-extents
+
+DupGroup *groups = NULL; // Grupos de duplicados, construidos por find_duplicates
+int group_count = 0;
+int *group_members = NULL;
+int sort_threads = 1; // Hilos del radix sort (los mismos que -t)
+
+// Directorios duplicados (--dirs)
+int dir_mode = 0;
+DirNode *dir_nodes = NULL;
+int dir_count = 0, dir_capacity = 0;
+int *dir_table = NULL; // Tabla hash de rutas de directorio a índices en dir_nodes
+int dir_table_size = 0;
+int dir_group_count = 0;
+int *dir_group_members = NULL; // Miembros de cada grupo, contiguos y en orden de creación
+int *dir_group_start = NULL;   // Inicio de cada grupo en dir_group_members (más uno al final)
+int *file_cover = NULL; // Directorio duplicado más cercano que contiene cada archivo, o -1
+
+// Orden de la etapa 2: primero los grupos de tamaño con más bytes recuperables
+unsigned long long *file_yield = NULL; // size × (archivos del mismo tamaño − 1), por archivo
+double *hash_done_at = NULL; // Segundos desde scan_start en que terminó la lectura de cada archivo
+struct timespec scan_start;
+
+// Consulta puntual (--of): sólo se buscan copias de un archivo
+const char *query_path = NULL;
+struct stat query_stat;
+unsigned char query_partial[16];
+unsigned char query_digest[16];
+int query_hashed = 0; // -1 si no se pudo leer el archivo consultado
+pthread_once_t query_once = PTHREAD_ONCE_INIT;
+int max_matches = 0; // --max-matches; 0 = todas
+int query_matches = 0, query_checked = 0; // Protegidos por query_lock
+volatile int query_stop = 0; // 1 al alcanzar max_matches: el recorrido termina
+pthread_mutex_t query_lock = PTHREAD_MUTEX_INITIALIZER;
+
+const char *export_path = NULL; // --export-index: todos los archivos se leen y se exportan
+const char *export_host = NULL; // --host; por defecto gethostname()
+
+// Modo multiproceso (--procs)
+int procs = 0;
+unsigned long long table_slots = DEFAULT_TABLE_SLOTS; // --table-slots
+ShardShared *shard_shared = NULL;
+SizeSlot *size_table = NULL;
+DigestSlot *digest_table = NULL;
+_Atomic int *shard_arrived = NULL; // 1 cuando el hijo terminó la ronda de tamaños
+
+// Servicio de hashing (--serve) y su cliente (-m d)
+const char *socket_path = DEFAULT_SOCKET;
+HashJob *job_head = NULL, *job_tail = NULL; // Cola única para todos los clientes
+HashJob *busy_jobs = NULL;
+CacheEntry *cache_buckets[SERVE_CACHE_BUCKETS];
+int cache_count = 0;
+unsigned long long served_cached = 0, served_shared = 0, served_read = 0;
+pthread_mutex_t serve_lock = PTHREAD_MUTEX_INITIALIZER; // Protege cola, trabajos y caché
+pthread_cond_t job_ready = PTHREAD_COND_INITIALIZER;    // Hay trabajo en la cola
+pthread_cond_t job_done = PTHREAD_COND_INITIALIZER;     // Terminó algún trabajo
+volatile sig_atomic_t serve_stop = 0;
+__thread int daemon_fd = -1; // Conexión de cada hilo con el servicio
+
+// Puntos de control (--checkpoint, --resume)
+const char *checkpoint_path = NULL;
+const char *checkpoint_dir = NULL; // Directorio de inicio que se guarda en la cabecera
+int checkpoint_interval = DEFAULT_CHECKPOINT_INTERVAL;
+int scan_phase = CHECKPOINT_WALK;
+int checkpoint_done = 0; // 1 cuando termina la etapa 2: el hilo sale
+// Los hilos del recorrido y del hashing lo toman para leer mientras procesan
+// una entrada; el punto de control lo toma para escribir y ve un estado en
+// el que cada entrada está pendiente o terminada, nunca a medias
+pthread_rwlock_t checkpoint_lock;
+pthread_mutex_t checkpoint_wait_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t checkpoint_wake = PTHREAD_COND_INITIALIZER;
+
+// Presupuesto de tiempo (--time-budget). Al agotarse, los hilos dejan de
+// tomar trabajo y los que están bloqueados en una lectura reciben SIGUSR1,
+// instalada sin SA_RESTART, para que la llamada vuelva con EINTR.
+double time_budget = 0; // Segundos; 0 = sin límite
+volatile sig_atomic_t budget_expired = 0;
+int budget_done = 0; // 1 cuando termina la etapa 2 (protegido por budget_lock)
+pthread_t *budget_threads = NULL; // Hilos registrados que pueden bloquearse en E/S
+int budget_thread_count = 0, budget_thread_capacity = 0;
+pthread_mutex_t budget_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t budget_wake = PTHREAD_COND_INITIALIZER;
+
+// Etapa de acción (--dedupe)
+int dedupe_enabled = 0;
+int hardlink_fallback = 0; // --hardlink: reemplazar por hardlinks si no hay FIDEDUPERANGE
+int dry_run = 0;
+FILE *journal = NULL; // --journal: registro de cada acción antes y después de aplicarla
+pthread_mutex_t action_lock = PTHREAD_MUTEX_INITIALIZER; // Protege journal, next_group y contadores
+int next_group = 0;
+int deduped_files = 0, linked_files = 0, failed_files = 0;
+unsigned long long deduped_bytes = 0;
+
+// Bloques compartidos entre archivos distintos (--chunks)
+int chunks_enabled = 0;
+ChunkRecord *chunk_records = NULL;
+size_t chunk_count = 0, chunk_capacity = 0;
+unsigned char *chunk_skip = NULL; // 1 si el archivo no se parte (copia exacta de otro ya informada)
+int chunk_next_file = 0;
+unsigned long long chunk_files = 0; // Archivos partidos completos
+pthread_mutex_t chunk_lock = PTHREAD_MUTEX_INITIALIZER; // Protege todo lo anterior
+unsigned long long *pair_keys = NULL; // Tabla (archivo, archivo) -> bytes compartidos
+unsigned long long *pair_bytes = NULL;
+size_t pair_slots = 0, pair_used = 0;
+
+// Modo continuo (--watch)
+int watch_mode = 0;
+int watch_fd = -1;
+int watch_fanotify = 0; // 1 si se usa fanotify sobre el montaje en lugar de inotify
+char watch_root[MAX_PATH]; // Ruta real de start_dir, para filtrar eventos de fanotify
+char **watch_paths = NULL; // Ruta de cada descriptor de inotify, indexado por wd
+int watch_capacity = 0;
+int watch_count = 0;
+int max_watches = 0; // --max-watches; 0 = según /proc/sys/fs/inotify/max_user_watches
+pthread_mutex_t watch_lock = PTHREAD_MUTEX_INITIALIZER;
 
-void *check_duplicates(void *arg);
+IndexEntry *index_entries = NULL;
+int index_count = 0;        // Entradas usadas (incluye las de la lista libre)
+int index_capacity = 0;
+int index_free = -1;        // Lista de entradas liberadas, enlazadas por next
+int index_live = 0;
+int max_index = DEFAULT_MAX_INDEX;
+int *index_buckets = NULL;  // Cabeza de cada balde, por tamaño
+int index_bucket_count = 0;
+char *index_blob = NULL;
+size_t index_blob_size = 0, index_blob_capacity = 0, index_blob_live = 0;
+
+// Modo de memoria acotada (--mem-limit)
+unsigned long long mem_limit = 0;
+const char *tmp_base = NULL; // --tmp-dir; por defecto $TMPDIR o /tmp
+char spill_dir[MAX_PATH];
+FILE *paths_file = NULL; // Rutas terminadas en '\0', una tras otra
+unsigned long long paths_size = 0;
+SpillRecord *spill_buffer = NULL;
+size_t spill_capacity = 0, spill_count = 0;
+int *spill_runs = NULL; // Corridas ordenadas pendientes de mezclar
+int spill_run_count = 0, spill_run_capacity = 0, spill_next_run = 0;
+pthread_mutex_t spill_lock = PTHREAD_MUTEX_INITIALIZER;
+volatile int hash_stage_done = 0;
+char hash_mode = 0; // 'e', 'l', 'x', 'b' o 'd'
+int blake3_threads = 1; // Hilos por archivo grande con -m b
+// Hilos auxiliares de segmentos libres, compartidos por todos los hilos de
+// hash: acota los hilos y buffers extra a uno por CPU en todo el proceso
+int blake3_free_helpers = 0;
+pthread_mutex_t blake3_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+int prefilter_stage = 0; // 1 mientras los hilos de la etapa 2 calculan el hash rápido
+int digest_set = DPL_DIGEST_MD5; // --digests; MD5 siempre, porque agrupa
+
+TokenBucket bytes_bucket; // Bytes leídos por segundo
+TokenBucket files_bucket; // Archivos abiertos por segundo
+int idle_io = 0; // Si es 1, cada hilo pasa a la clase de E/S idle
+const char *limits_file = NULL; // Archivo de control releído con SIGHUP
+volatile sig_atomic_t reload_limits = 0;
+pthread_mutex_t limits_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Bloque de ceros con el que se alimenta MD5 en los huecos de archivos dispersos
+static const unsigned char zero_block[READ_BUF_SIZE];
+
+void *walk_directories(void *arg);
+void visit_entry(const char *current_file);
 void add_to_visit(const char *path);
-void add_to_visited(const char *path);
-int is_duplicate(const char *file1, const char *file2, char mode); // Modificado para incluir el modo
+int file_list_push(FileList *list, const char *path);
+int file_list_pop(FileList *list, char *path);
+const char *file_list_get(const FileList *list, int i);
+int file_list_grow(FileList *list, size_t bytes, int entries);
+void file_list_spill(FileList *list);
+int file_list_reload(FileList *list);
+int load_candidates(const char *path);
+int query_init(const char *path);
+void query_hash_probe(void);
+void query_check_file(const char *path, const struct stat *statbuf);
+int export_index(const char *path);
+int run_estimate(int num_threads);
+double estimate_hash_rate(void);
+unsigned long long prefilter_read_size(off_t size);
+void probe_device(const DeviceQueue *queue, double *read_rate, double *file_seconds);
+int save_checkpoint(void);
+int load_checkpoint(const char *path, const char *start_dir);
+void *checkpoint_thread(void *arg);
+int run_merge(int argc, char *argv[]);
+int run_sharded(const char *start_dir, int num_threads);
+void shard_child(int shard, const char *start_dir, char **names, const int *name_shards, int name_count,
+                 int num_threads, int paths_fd);
+int size_table_add(unsigned long long size);
+unsigned int size_table_count(unsigned long long size);
+int digest_table_add(unsigned int shard, unsigned long long size, const unsigned char digest[16],
+                     unsigned long long path_id);
+unsigned long long mix_size(unsigned long long x);
+int compare_shard_member(const void *a, const void *b);
+int run_daemon(const char *path, int num_threads);
+void *serve_client(void *arg);
+void *serve_worker(void *arg);
+HashJob *serve_submit(const char *path, const struct stat *statbuf, char *hash_output);
+int serve_cache_lookup(const struct stat *statbuf, char *hash_output);
+void serve_cache_store(const struct stat *before, const struct stat *after, const char *hash);
+void handle_serve_stop(int sig);
+int get_md5_hash_daemon(const char *filename, char *hash_output);
+void merge_sift_down(const DplIndex *indexes, const uint64_t *positions, int *heap, int heap_count, int pos);
+int merge_less(const DplIndex *indexes, const uint64_t *positions, int a, int b);
+void add_to_visited(const char *path, const struct stat *statbuf);
+const char *file_path(int index);
+void catalog_grow(void);
+void catalog_free(void);
+SortKey *sorted_keys(int use_digest, int *count);
+void radix_sort(SortKey *keys, int count, int use_digest);
+void *radix_worker(void *arg);
+int build_device_queues(void);
+DeviceQueue *find_device_queue(dev_t dev);
+int is_rotational(dev_t dev);
+unsigned long long physical_offset(const char *path, ino_t ino);
+int compare_physical(const void *a, const void *b);
+int compare_yield(const void *a, const void *b);
+int yield_class(unsigned long long yield);
+double seconds_since(const struct timespec *start);
+double first_result_time(void);
+void *hash_worker(void *arg);
+void run_hash_stage(int num_threads);
+void *auto_controller(void *arg);
+void auto_step(DeviceQueue *queue, AutoTuner *tuner, double seconds);
+void set_active_workers(DeviceQueue *queue, int active);
+void find_duplicates(void);
+void mark_size_candidates(void);
+void find_duplicate_directories(const char *start_dir);
+int dir_lookup(const char *path, int length, int root_length);
+unsigned int dir_hash(const char *path, int length);
+void dir_table_grow(void);
+int dir_find(const char *path, int length);
+int dir_base(int d);
+int dir_fold(int d);
+int compare_dir_entry(const void *a, const void *b);
+int compare_dir_depth(const void *a, const void *b);
+int pair_collapsed(int a, int b);
+void report_duplicate_directories(void);
+struct fiemap *get_extents(const char *path);
+int same_extents(const struct fiemap *a, const struct fiemap *b);
+void mark_shared_extents(const SortKey *keys, int group);
+int compare_extent_key(const void *a, const void *b);
+void run_dedupe_stage(int num_threads);
+void run_chunk_stage(int num_threads);
+void *chunk_worker(void *arg);
+int chunk_file(int file, unsigned char *buffer, ChunkRecord **records, size_t *count, size_t *capacity);
+int compare_chunk(const void *a, const void *b);
+int compare_pair_bytes(const void *a, const void *b);
+void pair_add(int a, int b, unsigned long long bytes);
+void report_chunks(void);
+void *dedupe_worker(void *arg);
+void dedupe_group(const DupGroup *group);
+int dedupe_batch(int keeper, const int *members, int count);
+int replace_with_hardlink(int keeper, int member);
+int dedupe_remainder(int src_fd, int dest_fd, off_t start, off_t end, const char **reason);
+int files_identical(const char *path1, const char *path2);
+void journal_entry(const char *state, const char *action, int keeper, int member, const char *detail);
+int hash_file(const char *path, char *hash_output);
+int hex_to_digest(const char *hex, unsigned char digest[16]);
+int watch_init(const char *start_dir);
+void watch_directory(const char *path);
+void watch_scan_directory(const char *path);
+void run_watch_loop(void);
+void watch_process_file(const char *path);
+void build_watch_index(void);
+int index_insert(const char *path, off_t size, time_t mtime, const unsigned char *digest);
+void index_set_path(IndexEntry *entry, const char *path);
+int index_refresh(IndexEntry *entry);
+void index_grow_buckets(void);
+unsigned int index_bucket(off_t size);
+int spill_init(void);
+void spill_add_file(const char *path, off_t size);
+void spill_push(const SpillRecord *record);
+void spill_flush(void);
+int compare_record(const void *a, const void *b);
+void run_file_name(int run, char *name, size_t len);
+MergeState *merge_open(int *runs, int count);
+int merge_next(MergeState *state, SpillRecord *record);
+void merge_close(MergeState *state);
+void heap_sift_down(MergeState *state, int pos);
+void reduce_runs(void);
+int read_spilled_path(unsigned long long file_id, char *path);
+void external_pass(int full, int num_threads);
+void *external_hash_worker(void *arg);
+void external_report(void);
+void spill_cleanup(void);
+int partial_digest(const char *path, unsigned char digest[16]);
+int fast_partial_digest(const char *path, unsigned char digest[16]);
+void drop_prefilter_unique(void);
 int get_md5_hash_executable(const char *filename, char *hash_output);
 int get_md5_hash_library(const char *filename, char *hash_output); // Nueva función para la biblioteca
-void process_directory(const char *dir_path);
+int get_blake3_hash(const char *filename, char *hash_output);
+int blake3_parallel(int fd, const struct stat *statbuf, DigestContext *context);
+int blake3_reserve_helpers(int wanted);
+void blake3_release_helpers(int count);
+int read_segment(int fd, unsigned char *buffer, off_t start, int sparse);
+void *blake3_segment_worker(void *arg);
+void digest_init(DigestContext *context, int set);
+void digest_update(DigestContext *context, const unsigned char *data, size_t len);
+void digest_final(DigestContext *context, unsigned char digest[16]);
+int digest_update_fd(DigestContext *context, int fd);
+int digest_update_range(DigestContext *context, int fd, off_t start, off_t end);
+int check_size_unchanged(int fd, off_t size);
+void digest_update_zeros(DigestContext *context, off_t len);
+int hash_file_digests(int file);
+void bucket_init(TokenBucket *bucket, double rate);
+void bucket_set_rate(TokenBucket *bucket, double rate);
+void bucket_take(TokenBucket *bucket, double amount);
+double parse_rate(const char *text);
+int load_limits_file(const char *path);
+void check_limits_reload(void);
+void handle_sighup(int sig);
+void handle_budget_signal(int sig);
+void *budget_thread(void *arg);
+void budget_register(void);
+void budget_unregister(void);
+void lock_sem(sem_t *sem);
+double parse_duration(const char *text);
+void set_idle_io_priority(void);
+void usage(const char *prog);
 
 int main(int argc, char *argv[]) {
-    if (argc != 7 || strcmp(argv[1], "-t") != 0 || strcmp(argv[3], "-d") != 0 || strcmp(argv[5], "-m") != 0) {
-        fprintf(stderr, "Uso: %s -t <numero de threads> -d <directorio de inicio> -m <e | l>\n", argv[0]);
+    if (argc > 1 && strcmp(argv[1], "merge") == 0) {
+        return run_merge(argc - 1, argv + 1);
+    }
+
+    static struct option long_options[] = {
+        {"bwlimit", required_argument, NULL, 'B'},
+        {"files-per-sec", required_argument, NULL, 'F'},
+        {"idle-io", no_argument, NULL, 'I'},
+        {"limits-file", required_argument, NULL, 'L'},
+        {"rotational-depth", required_argument, NULL, 'R'},
+        {"shared-extents", no_argument, NULL, 'S'},
+        {"dedupe", no_argument, NULL, 'D'},
+        {"hardlink", no_argument, NULL, 'H'},
+        {"dry-run", no_argument, NULL, 'N'},
+        {"journal", required_argument, NULL, 'J'},
+        {"watch", no_argument, NULL, 'W'},
+        {"max-watches", required_argument, NULL, 'X'},
+        {"max-index", required_argument, NULL, 'Y'},
+        {"mem-limit", required_argument, NULL, 'M'},
+        {"tmp-dir", required_argument, NULL, 'T'},
+        {"dirs", no_argument, NULL, 'G'},
+        {"candidates", required_argument, NULL, 'C'},
+        {"of", required_argument, NULL, 'O'},
+        {"max-matches", required_argument, NULL, 'K'},
+        {"export-index", required_argument, NULL, 'E'},
+        {"host", required_argument, NULL, 'A'},
+        {"procs", required_argument, NULL, 'P'},
+        {"table-slots", required_argument, NULL, 'Q'},
+        {"serve", no_argument, NULL, 'V'},
+        {"socket", required_argument, NULL, 'U'},
+        {"checkpoint", required_argument, NULL, 'Z'},
+        {"checkpoint-interval", required_argument, NULL, 'z'},
+        {"resume", no_argument, NULL, 'r'},
+        {"time-budget", required_argument, NULL, 'b'},
+        {"estimate", no_argument, NULL, 'e'},
+        {"digests", required_argument, NULL, 'x'},
+        {"chunks", no_argument, NULL, 'c'},
+        {NULL, 0, NULL, 0}
+    };
+    int num_threads = 0;
+    const char *start_dir = NULL;
+    char mode = 0; // 'e', 'l', 'x', 'b' o 'd'
+    double bytes_rate = 0, files_rate = 0;
+    const char *journal_path = NULL;
+    const char *candidates_path = NULL;
+    int serve = 0;
+    int resume = 0;
+    int estimate = 0;
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "t:d:m:", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 't':
+            if (strcmp(optarg, "auto") == 0) {
+                auto_threads = 1;
+                num_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+                if (num_threads <= 0) {
+                    num_threads = 1;
+                }
+            } else {
+                num_threads = atoi(optarg);
+            }
+            break;
+        case 'd': start_dir = optarg; break;
+        case 'm': mode = optarg[0]; break;
+        case 'B': bytes_rate = parse_rate(optarg); break;
+        case 'F': files_rate = parse_rate(optarg); break;
+        case 'I': idle_io = 1; break;
+        case 'L': limits_file = optarg; break;
+        case 'R': rotational_depth = atoi(optarg); break;
+        case 'S': check_shared_extents = 1; break;
+        case 'D': dedupe_enabled = 1; break;
+        case 'H': hardlink_fallback = 1; break;
+        case 'N': dry_run = 1; break;
+        case 'J': journal_path = optarg; break;
+        case 'W': watch_mode = 1; break;
+        case 'X': max_watches = atoi(optarg); break;
+        case 'Y': max_index = atoi(optarg); break;
+        case 'M': {
+            double limit = parse_rate(optarg);
+            mem_limit = limit > 0 ? (unsigned long long)limit : 0;
+            if (limit < 1024 * 1024) {
+                fprintf(stderr, "--mem-limit debe ser de al menos 1M\n");
+                return EXIT_FAILURE;
+            }
+            break;
+        }
+        case 'T': tmp_base = optarg; break;
+        case 'G': dir_mode = 1; break;
+        case 'C': candidates_path = optarg; break;
+        case 'O': query_path = optarg; break;
+        case 'K': max_matches = atoi(optarg); break;
+        case 'E': export_path = optarg; break;
+        case 'A': export_host = optarg; break;
+        case 'P': procs = atoi(optarg); break;
+        case 'Q': table_slots = (unsigned long long)parse_rate(optarg); break;
+        case 'V': serve = 1; break;
+        case 'U': socket_path = optarg; break;
+        case 'Z': checkpoint_path = optarg; break;
+        case 'z': checkpoint_interval = atoi(optarg); break;
+        case 'r': resume = 1; break;
+        case 'e': estimate = 1; break;
+        case 'c': chunks_enabled = 1; break;
+        case 'x':
+            digest_set = dpl_digest_parse(optarg);
+            if (digest_set == -1) {
+                fprintf(stderr, "--digests inválido: %s (admite md5, sha256 y crc32c)\n", optarg);
+                return EXIT_FAILURE;
+            }
+            digest_set |= DPL_DIGEST_MD5;
+            break;
+        case 'b':
+            time_budget = parse_duration(optarg);
+            if (time_budget <= 0) {
+                fprintf(stderr, "--time-budget inválido: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        default: usage(argv[0]); return EXIT_FAILURE;
+        }
+    }
+    if (optind != argc || num_threads <= 0 ||
+        (!serve && ((start_dir == NULL) == (candidates_path == NULL) || (mode != 'e' && mode != 'l' && mode != 'x' && mode != 'b' && mode != 'd'))) ||
+        bytes_rate < 0 || files_rate < 0 || rotational_depth <= 0 || max_watches < 0 || max_index <= 0 || max_matches < 0 ||
+        procs < 0 || table_slots < 16 || checkpoint_interval <= 0) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    // Limitadores de E/S; el archivo de control, si existe, tiene prioridad
+    bucket_init(&bytes_bucket, bytes_rate);
+    bucket_init(&files_bucket, files_rate);
+    if (limits_file != NULL) {
+        if (load_limits_file(limits_file) == -1) {
+            return EXIT_FAILURE;
+        }
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = handle_sighup;
+        sigemptyset(&sa.sa_mask);
+        sa.sa_flags = SA_RESTART;
+        sigaction(SIGHUP, &sa, NULL);
+    }
+    // Modo servicio: sólo calcula hashes para otros procesos
+    if (serve) {
+        return run_daemon(socket_path, num_threads);
+    }
+    if (mem_limit > 0 && (watch_mode || dedupe_enabled || check_shared_extents || dir_mode || export_path != NULL)) {
+        fprintf(stderr, "--mem-limit no es compatible con --watch, --dedupe, --shared-extents, --dirs ni --export-index\n");
+        return EXIT_FAILURE;
+    }
+    if (procs > 0 && (start_dir == NULL || watch_mode || dir_mode || dedupe_enabled || mem_limit > 0 ||
+                      query_path != NULL || export_path != NULL || check_shared_extents)) {
+        fprintf(stderr, "--procs necesita -d y no es compatible con --watch, --dirs, --dedupe, --mem-limit, --of, "
+                        "--export-index ni --shared-extents\n");
+        return EXIT_FAILURE;
+    }
+    if (query_path != NULL && (watch_mode || dir_mode || dedupe_enabled || mem_limit > 0 ||
+                               export_path != NULL || check_shared_extents)) {
+        fprintf(stderr, "--of no es compatible con --watch, --dirs, --dedupe, --mem-limit, --export-index "
+                        "ni --shared-extents\n");
+        return EXIT_FAILURE;
+    }
+    if (query_path != NULL && query_init(query_path) == -1) {
+        return EXIT_FAILURE;
+    }
+    if (resume && checkpoint_path == NULL) {
+        fprintf(stderr, "--resume necesita --checkpoint\n");
+        return EXIT_FAILURE;
+    }
+    if (checkpoint_path != NULL && (start_dir == NULL || watch_mode || mem_limit > 0 || procs > 0 || query_path != NULL)) {
+        fprintf(stderr, "--checkpoint necesita -d y no es compatible con --watch, --mem-limit, --procs ni --of\n");
+        return EXIT_FAILURE;
+    }
+    if (digest_set != DPL_DIGEST_MD5 && (export_path == NULL || mode != 'l' || procs > 0 || mem_limit > 0)) {
+        fprintf(stderr, "--digests necesita --export-index y -m l, y no es compatible con --procs ni --mem-limit\n");
+        return EXIT_FAILURE;
+    }
+    if (mode == 'b' && export_path != NULL) {
+        fprintf(stderr, "--export-index guarda MD5: no es compatible con -m b\n");
+        return EXIT_FAILURE;
+    }
+    dpl_digest_init();
+    if (estimate && (watch_mode || mem_limit > 0 || procs > 0 || query_path != NULL || checkpoint_path != NULL)) {
+        fprintf(stderr, "--estimate no es compatible con --watch, --mem-limit, --procs, --of ni --checkpoint\n");
+        return EXIT_FAILURE;
+    }
+    if (chunks_enabled && (watch_mode || mem_limit > 0 || procs > 0 || query_path != NULL || estimate)) {
+        fprintf(stderr, "--chunks no es compatible con --watch, --mem-limit, --procs, --of ni --estimate\n");
+        return EXIT_FAILURE;
+    }
+    if (time_budget > 0 && (watch_mode || mem_limit > 0 || procs > 0 || query_path != NULL)) {
+        fprintf(stderr, "--time-budget no es compatible con --watch, --mem-limit, --procs ni --of\n");
+        return EXIT_FAILURE;
+    }
+    if (candidates_path != NULL && (watch_mode || dir_mode)) {
+        fprintf(stderr, "--candidates no es compatible con --watch ni --dirs\n");
+        return EXIT_FAILURE;
+    }
+    if (mem_limit > 0 && spill_init() == -1) {
         return EXIT_FAILURE;
     }
+    if (journal_path != NULL && !dry_run) {
+        journal = fopen(journal_path, "a");
+        if (journal == NULL) {
+            perror("fopen");
+            return EXIT_FAILURE;
+        }
+    }
 
-    int num_threads = atoi(argv[2]);
-    const char *start_dir = argv[4];
-    char mode = argv[6][0]; // 'e' o 'l'
-	
 	duplicate_count = 0; // Reiniciar contador de duplicados
+    hash_mode = mode;
+    sort_threads = num_threads;
+    blake3_threads = num_threads;
+    blake3_free_helpers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    clock_gettime(CLOCK_MONOTONIC, &scan_start);
     // Inicializar listas y semáforos
     to_visit.count = 0;
-    visited.count = 0;
+    memset(&catalog, 0, sizeof(catalog));
     sem_init(&mutex, 0, 1);
     sem_init(&sem_to_visit, 0, 0);
     sem_init(&sem_visited, 0, 1);
-    pthread_cond_init(&cond_to_visit, NULL);
+    pthread_rwlockattr_t lock_attr;
+    pthread_rwlockattr_init(&lock_attr);
+    // Con preferencia de lectura el punto de control podría no llegar nunca
+    pthread_rwlockattr_setkind_np(&lock_attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&checkpoint_lock, &lock_attr);
+    pthread_rwlockattr_destroy(&lock_attr);
+
+    if (procs > 0) {
+        return run_sharded(start_dir, num_threads);
+    }
 
-    // Agregar el directorio inicial a la lista de archivos a visitar
-    add_to_visit(start_dir);
+    // Las marcas se ponen antes del recorrido para no perder los cambios que
+    // ocurran mientras dura el escaneo inicial
+    if (watch_mode && watch_init(start_dir) == -1) {
+        return EXIT_FAILURE;
+    }
 
-    // Crear hilos
-    pthread_t threads[num_threads];
-    for (int i = 0; i < num_threads; i++) {
-        pthread_create(&threads[i], NULL, check_duplicates, (void *)&mode);
+    // El presupuesto cubre el recorrido y la etapa 2
+    pthread_t budget_timer;
+    if (time_budget > 0) {
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = handle_budget_signal;
+        sigemptyset(&sa.sa_mask);
+        sa.sa_flags = 0; // Sin SA_RESTART: las lecturas bloqueadas vuelven con EINTR
+        sigaction(SIGUSR1, &sa, NULL);
+        pthread_create(&budget_timer, NULL, budget_thread, NULL);
     }
 
-    // Esperar a que los hilos terminen
-    for (int i = 0; i < num_threads; i++) {
-        pthread_join(threads[i], NULL);
+    // Con --resume el catálogo y los directorios pendientes vienen del último
+    // punto de control; si no hay ninguno se empieza desde cero
+    int resumed = 0;
+    pthread_t checkpointer;
+    if (checkpoint_path != NULL) {
+        checkpoint_dir = start_dir;
+        if (resume && (resumed = load_checkpoint(checkpoint_path, start_dir)) == -1) {
+            return EXIT_FAILURE;
+        }
+        pthread_create(&checkpointer, NULL, checkpoint_thread, NULL);
+    }
+
+    if (candidates_path != NULL) {
+        // Etapa 1 con --candidates: los archivos vienen de la lista, sin recorrido
+        if (load_candidates(candidates_path) == -1) {
+            return EXIT_FAILURE;
+        }
+    } else if (scan_phase == CHECKPOINT_WALK && (!resumed || to_visit.count > 0)) {
+        // Agregar el directorio inicial a la lista de archivos a visitar
+        if (!resumed) {
+            add_to_visit(start_dir);
+        }
+
+        // Etapa 1: recorrer el árbol y registrar los archivos regulares
+        num_walkers = num_threads;
+        pthread_t threads[num_threads];
+        for (int i = 0; i < num_threads; i++) {
+            pthread_create(&threads[i], NULL, walk_directories, NULL);
+        }
+
+        // Esperar a que los hilos terminen
+        for (int i = 0; i < num_threads; i++) {
+            pthread_join(threads[i], NULL);
+        }
     }
-    
+
+    // Con --of cada archivo ya se comparó durante el recorrido
+    if (query_path != NULL) {
+        printf("Se han encontrado %d copias de %s (%d archivos del mismo tamaño revisados).\n",
+               query_matches, query_path, query_checked);
+        return query_hashed == -1 ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+    // Con --mem-limit el resto del proceso trabaja sobre corridas en disco
+    if (mem_limit > 0) {
+        spill_flush();
+        fflush(paths_file);
+        external_pass(0, num_threads); // Hash parcial de los grupos por tamaño
+        external_pass(1, num_threads); // Hash completo de los grupos por (tamaño, parcial)
+        external_report();
+        spill_cleanup();
+        return EXIT_SUCCESS;
+    }
+
+    // Sólo se leen los archivos cuyo tamaño se repite y que no comparten
+    // ya sus extents con otro candidato. El cambio de fase excluye al punto
+    // de control, que a partir de aquí ya no guarda directorios pendientes.
+    // Si el presupuesto se agotó durante el recorrido no hay etapa 2.
+    int walk_complete = !budget_expired;
+    pthread_rwlock_wrlock(&checkpoint_lock);
+    mark_size_candidates();
+    if (walk_complete || estimate) {
+        if (build_device_queues() == -1) {
+            pthread_rwlock_unlock(&checkpoint_lock);
+            return EXIT_FAILURE;
+        }
+        scan_phase = CHECKPOINT_HASH;
+    }
+    if (checkpoint_path != NULL) {
+        save_checkpoint();
+    }
+    pthread_rwlock_unlock(&checkpoint_lock);
+
+    // Con --estimate no se lee ningún archivo completo: sólo se predice la etapa 2
+    if (estimate) {
+        return run_estimate(num_threads);
+    }
+
+    // Etapa 2: calcular los hashes con una cola por dispositivo. Con -m x
+    // antes se lee el comienzo y el final de cada candidato con el hash
+    // rápido y sólo los que siguen coincidiendo se leen completos con MD5.
+    // Para exportar el índice hace falta el MD5 de todos, así que ahí no
+    // hay nada que descartar.
+    if (walk_complete && hash_mode == 'x' && export_path == NULL) {
+        prefilter_stage = 1;
+        run_hash_stage(num_threads);
+        prefilter_stage = 0;
+        pthread_rwlock_wrlock(&checkpoint_lock);
+        drop_prefilter_unique();
+        pthread_rwlock_unlock(&checkpoint_lock);
+    }
+    if (walk_complete) {
+        run_hash_stage(num_threads);
+    }
+    if (time_budget > 0) {
+        pthread_mutex_lock(&budget_lock);
+        budget_done = 1;
+        pthread_cond_signal(&budget_wake);
+        pthread_mutex_unlock(&budget_lock);
+        pthread_join(budget_timer, NULL);
+    }
+    if (checkpoint_path != NULL) {
+        pthread_mutex_lock(&checkpoint_wait_lock);
+        checkpoint_done = 1;
+        pthread_cond_signal(&checkpoint_wake);
+        pthread_mutex_unlock(&checkpoint_wait_lock);
+        pthread_join(checkpointer, NULL);
+    }
+
+    // Etapa 3: agrupar por tamaño y hash
+    find_duplicates();
+    double first_result = first_result_time();
+
+    if (export_path != NULL && export_index(export_path) == -1) {
+        return EXIT_FAILURE;
+    }
+
+    // Con --dirs los subárboles idénticos se informan una sola vez y los
+    // pares de archivos que ya explican no se repiten
+    if (dir_mode) {
+        find_duplicate_directories(start_dir);
+        report_duplicate_directories();
+        for (int g = 0; g < group_count; g++) {
+            for (int i = 1; i < groups[g].count; i++) {
+                for (int j = 0; j < i; j++) {
+                    duplicate_count -= pair_collapsed(groups[g].members[i], groups[g].members[j]);
+                }
+            }
+        }
+    }
+
     // Imprimir estadísticas de duplicados
 
-    printf("Se han encontrado %d archivos duplicados.\n", duplicate_count);
+    printf("Se han encontrado %lld archivos duplicados.\n", duplicate_count);
+
+    // Dentro de cada grupo, cada archivo es duplicado de todos los anteriores
+    for (int g = 0; g < group_count; g++) {
+        for (int i = 1; i < groups[g].count; i++) {
+            for (int j = 0; j < i; j++) {
+                if (!pair_collapsed(groups[g].members[i], groups[g].members[j])) {
+                    printf("%s es duplicado de %s\n", file_path(groups[g].members[i]), file_path(groups[g].members[j]));
+                }
+            }
+        }
+    }
+
+    // Con el presupuesto agotado sólo se informan los grupos ya verificados:
+    // los archivos sin hash no pueden formar parte de ninguno
+    if (budget_expired) {
+        int unhashed = 0;
+        unsigned long long unhashed_bytes = 0;
+        for (int i = 0; i < catalog.count; i++) {
+            if ((catalog.flags[i] & FILE_CANDIDATE) && !(catalog.flags[i] & FILE_HASHED) && catalog.shared_with[i] < 0) {
+                unhashed++;
+                unhashed_bytes += catalog.size[i];
+            }
+        }
+        printf("Se agotó el presupuesto de tiempo: %d archivos candidatos (%llu bytes) quedaron sin leer.\n",
+               unhashed, unhashed_bytes);
+        if (!walk_complete) {
+            printf("El recorrido quedó incompleto: %d entradas sin visitar.\n", to_visit.count);
+        }
+    }
+
+    // El escaneo terminó y su resultado ya está impreso: no hay nada que
+    // reanudar, salvo que el presupuesto lo haya cortado
+    if (checkpoint_path != NULL && budget_expired) {
+        if (save_checkpoint() == 0) {
+            printf("El estado quedó en %s; se puede continuar con --resume.\n", checkpoint_path);
+        }
+    } else if (checkpoint_path != NULL && unlink(checkpoint_path) == -1 && errno != ENOENT) {
+        perror("unlink");
+    }
+
+    if (check_shared_extents) {
+        int shared_count = 0;
+        for (int i = 0; i < catalog.count; i++) {
+            shared_count += catalog.shared_with[i] >= 0;
+        }
+        printf("Se han encontrado %d archivos que ya comparten sus datos (ya deduplicados).\n", shared_count);
+        for (int i = 0; i < catalog.count; i++) {
+            if (catalog.shared_with[i] >= 0) {
+                printf("%s ya comparte sus datos con %s\n", file_path(i), file_path(catalog.shared_with[i]));
+            }
+        }
+    }
+
+    // Etapa 3b (opcional): partir los archivos en bloques de contenido e
+    // informar cuánto comparten los que no son idénticos
+    if (chunks_enabled && budget_expired) {
+        printf("No se buscan bloques compartidos: se agotó el presupuesto de tiempo.\n");
+    } else if (chunks_enabled) {
+        run_chunk_stage(num_threads);
+        report_chunks();
+    }
 
-    for (int i = 0; i < duplicate_count; i++) {
+    // Etapa 4 (opcional): deduplicar cada grupo contra un archivo conservado
+    if (dedupe_enabled && budget_expired) {
+        printf("No se deduplica: se agotó el presupuesto de tiempo.\n");
+    } else if (dedupe_enabled) {
+        run_dedupe_stage(num_threads);
+        printf("%s: %d archivos deduplicados (%llu bytes), %d reemplazados por hardlinks, %d errores\n",
+               dry_run ? "Simulación" : "Deduplicación", deduped_files, deduped_bytes, linked_files, failed_files);
+    }
 
-        printf("%s es duplicado de %s\n", duplicates[i].file1, duplicates[i].file2);
+    if (auto_threads) {
+        for (int i = 0; i < device_count; i++) {
+            printf("Dispositivo %u:%u: %d hilos de hashing elegidos (máximo %d)\n",
+                   major(devices[i].dev), minor(devices[i].dev), devices[i].active, devices[i].peak);
+        }
+    }
+    if (first_result >= 0) {
+        printf("Primer grupo de duplicados confirmado a los %.2f s del comienzo.\n", first_result);
+    }
 
+    // Modo continuo: el índice parte del escaneo y se actualiza con cada
+    // archivo creado o modificado
+    if (watch_mode) {
+        build_watch_index();
+        run_watch_loop();
     }
 
-    // Limpiar semáforos
+    // Limpiar semáforos y colas
     sem_destroy(&mutex);
     sem_destroy(&sem_to_visit);
     sem_destroy(&sem_visited);
-    pthread_cond_destroy(&cond_to_visit);
+    pthread_rwlock_destroy(&checkpoint_lock);
+    for (int i = 0; i < device_count; i++) {
+        free(devices[i].files);
+        pthread_mutex_destroy(&devices[i].lock);
+        pthread_cond_destroy(&devices[i].wake);
+    }
+    free(groups);
+    free(group_members);
+    free(dir_nodes);
+    free(dir_table);
+    free(dir_group_members);
+    free(dir_group_start);
+    free(file_cover);
+    free(file_yield);
+    free(hash_done_at);
+    free(chunk_records);
+    free(chunk_skip);
+    free(pair_keys);
+    free(pair_bytes);
+    catalog_free();
+    if (journal != NULL) {
+        fclose(journal);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+void usage(const char *prog) {
+    fprintf(stderr, "Uso: %s -t <numero de threads | auto> -d <directorio de inicio> -m <e | l | x | b> [opciones]\n", prog);
+    fprintf(stderr, "     %s -t <numero de threads | auto> --candidates <archivo> -m <e | l | x | b> [opciones]\n", prog);
+    fprintf(stderr, "     %s merge <indice> <indice>...\n", prog);
+    fprintf(stderr, "     %s --serve -t <numero de threads> [--socket <ruta>] [opciones de E/S]\n", prog);
+    dpl_digest_init();
+    fprintf(stderr, "  -m x                       como -m l, pero antes descarta candidatos con un hash rápido (%s)\n",
+            dpl_digest_backend(DPL_DIGEST_FAST128));
+    fprintf(stderr, "                             del comienzo y el final; sólo los que coinciden se leen con MD5\n");
+    fprintf(stderr, "  -m b                       usa BLAKE3 (%s) en lugar de MD5; los archivos desde %d MiB se\n",
+            dpl_digest_backend(DPL_DIGEST_BLAKE3), BLAKE3_PARALLEL_MIN / (1024 * 1024));
+    fprintf(stderr, "                             reparten entre los -t hilos\n");
+    fprintf(stderr, "  -m d                       pide los hashes al servicio de --serve\n");
+    fprintf(stderr, "  --bwlimit <bytes/s>        limita los bytes leídos por segundo (admite K, M, G)\n");
+    fprintf(stderr, "  --files-per-sec <n>        limita los archivos abiertos por segundo\n");
+    fprintf(stderr, "  --idle-io                  ejecuta la lectura en la clase de E/S idle\n");
+    fprintf(stderr, "  --limits-file <archivo>    lee los límites del archivo y lo relee con SIGHUP\n");
+    fprintf(stderr, "  --rotational-depth <n>     lecturas simultáneas por disco rotacional (por defecto 1)\n");
+    fprintf(stderr, "  --shared-extents           no lee archivos que ya comparten extents (reflinks)\n");
+    fprintf(stderr, "  --dedupe                   comparte los datos de cada grupo con FIDEDUPERANGE\n");
+    fprintf(stderr, "  --hardlink                 con --dedupe, usa hardlinks si el sistema no soporta FIDEDUPERANGE\n");
+    fprintf(stderr, "  --dry-run                  con --dedupe, sólo muestra lo que haría\n");
+    fprintf(stderr, "  --journal <archivo>        con --dedupe, registra cada acción antes y después de aplicarla\n");
+    fprintf(stderr, "  --watch                    tras el escaneo, vigila el árbol e informa nuevos duplicados\n");
+    fprintf(stderr, "  --max-watches <n>          con --watch, máximo de directorios vigilados con inotify\n");
+    fprintf(stderr, "  --max-index <n>            con --watch, máximo de entradas del índice (por defecto %d)\n", DEFAULT_MAX_INDEX);
+    fprintf(stderr, "  --mem-limit <bytes>        trabaja en memoria acotada con corridas ordenadas en disco\n");
+    fprintf(stderr, "  --tmp-dir <directorio>     con --mem-limit, dónde guardar las corridas\n");
+    fprintf(stderr, "  --dirs                     informa una sola vez los directorios con el mismo contenido\n");
+    fprintf(stderr, "  --candidates <archivo>     en lugar de recorrer -d, confirma los grupos de duply_find\n");
+    fprintf(stderr, "  --of <archivo>             sólo busca copias del archivo indicado\n");
+    fprintf(stderr, "  --max-matches <n>          con --of, termina después de n copias\n");
+    fprintf(stderr, "  --export-index <archivo>   lee todos los archivos y exporta el índice para dpl-lookup\n");
+    fprintf(stderr, "  --procs <n>                reparte el árbol entre n procesos por directorio de primer nivel\n");
+    fprintf(stderr, "  --table-slots <n>          con --procs, slots de cada tabla compartida (por defecto %d)\n", DEFAULT_TABLE_SLOTS);
+    fprintf(stderr, "  --serve                    atiende pedidos de hash por un socket Unix, con caché por inodo\n");
+    fprintf(stderr, "  --socket <ruta>            socket de --serve y de -m d (por defecto %s)\n", DEFAULT_SOCKET);
+    fprintf(stderr, "  --host <nombre>            con --export-index, nombre de la máquina (por defecto el del sistema)\n");
+    fprintf(stderr, "  --chunks                   parte los archivos en bloques de contenido (FastCDC) e informa los\n");
+    fprintf(stderr, "                             bytes que comparten archivos distintos y el ahorro posible\n");
+    fprintf(stderr, "  --digests <lista>          con --export-index y -m l, calcula en la misma lectura md5, sha256\n");
+    fprintf(stderr, "                             (%s) y crc32c (%s) y los guarda en el índice\n",
+            dpl_digest_backend(DPL_DIGEST_SHA256), dpl_digest_backend(DPL_DIGEST_CRC32C));
+    fprintf(stderr, "  --checkpoint <archivo>     guarda periódicamente el estado del escaneo en el archivo\n");
+    fprintf(stderr, "  --checkpoint-interval <s>  segundos entre puntos de control (por defecto %d)\n", DEFAULT_CHECKPOINT_INTERVAL);
+    fprintf(stderr, "  --resume                   con --checkpoint, continúa desde el último punto de control\n");
+    fprintf(stderr, "  --estimate                 sólo recorre los metadatos y predice la duración y los bytes a leer\n");
+    fprintf(stderr, "  --time-budget <duración>   deja de leer al cumplirse el plazo (admite s, m, h) e informa lo verificado\n");
+}
+
+void *walk_directories(void *arg) {
+    (void)arg;
+
+    budget_register();
+    while (1) {
+        // Esperar a que haya archivos a visitar
+        if (sem_wait(&sem_to_visit) == -1 && !budget_expired) {
+            continue; // Interrumpido por una señal
+        }
+
+        // Bloquear acceso a la lista de archivos a visitar
+        pthread_rwlock_rdlock(&checkpoint_lock);
+        lock_sem(&mutex);
+        if (to_visit.count == 0 || query_stop || budget_expired) {
+            sem_post(&mutex);
+            pthread_rwlock_unlock(&checkpoint_lock);
+            break; // El recorrido terminó y otro hilo nos despertó para salir
+        }
+        // Obtener el siguiente archivo a visitar
+        char current_file[MAX_PATH];
+        if (file_list_pop(&to_visit, current_file) == -1) {
+            sem_post(&mutex);
+            pthread_rwlock_unlock(&checkpoint_lock);
+            continue; // El bloque volcado no se pudo releer
+        }
+        active_walkers++;
+        sem_post(&mutex);
+
+        visit_entry(current_file);
+
+        // Si no queda nada pendiente ni nadie que pueda agregar más entradas,
+        // el recorrido terminó: despertar a todos los hilos para que salgan
+        lock_sem(&mutex);
+        active_walkers--;
+        if (to_visit.count == 0 && active_walkers == 0) {
+            for (int i = 0; i < num_walkers; i++) {
+                sem_post(&sem_to_visit);
+            }
+        }
+        sem_post(&mutex);
+        pthread_rwlock_unlock(&checkpoint_lock);
+    }
+    budget_unregister();
+    return NULL;
+}
+
+void visit_entry(const char *current_file) {
+    // Verificar si el archivo es un directorio. Si la señal de --time-budget
+    // interrumpe la llamada, la entrada vuelve a la lista de pendientes.
+    struct stat statbuf;
+    if (stat(current_file, &statbuf) == -1) {
+        if (errno == EINTR) {
+            add_to_visit(current_file);
+            return;
+        }
+        perror("stat");
+        return;
+    }
+
+    if (S_ISDIR(statbuf.st_mode)) {
+        if (watch_mode && !watch_fanotify) {
+            watch_directory(current_file);
+        }
+
+        // Procesar el directorio
+        DIR *dir = opendir(current_file);
+        if (dir == NULL) {
+            if (errno == EINTR) {
+                add_to_visit(current_file);
+                return;
+            }
+            perror("opendir");
+            return;
+        }
+
+        // Un directorio ya abierto se termina de leer aunque se agote el
+        // presupuesto: así nunca queda a medias en un punto de control
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL && !query_stop) {
+            if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
+                char full_path[MAX_PATH];
+                snprintf(full_path, sizeof(full_path), "%s/%s", current_file, entry->d_name);
+                // Los archivos regulares se registran aquí mismo: la lista sólo
+                // guarda lo que hay que abrir después, y no se llena con
+                // directorios de miles de archivos
+                if (entry->d_type == DT_REG) {
+                    visit_entry(full_path);
+                } else {
+                    add_to_visit(full_path); // Agregar archivos encontrados a la lista
+                }
+            }
+        }
+        closedir(dir);
+    } else if (S_ISREG(statbuf.st_mode) && statbuf.st_size > 0) {
+        // El hash se calcula después, agrupado por dispositivo
+        if (query_path != NULL) {
+            query_check_file(current_file, &statbuf);
+        } else if (mem_limit > 0) {
+            spill_add_file(current_file, statbuf.st_size);
+        } else {
+            add_to_visited(current_file, &statbuf);
+        }
+    }
+}
+
+// Lee la lista de posibles duplicados que genera duply_find: una ruta por
+// línea; las líneas vacías y las que empiezan con '#' separan los grupos.
+// Sólo se leerán los archivos de la lista, y como después se agrupan por
+// tamaño y hash, un grupo cuyo contenido no coincide no se informa.
+int load_candidates(const char *path) {
+    FILE *list = fopen(path, "r");
+    if (list == NULL) {
+        perror("fopen");
+        return -1;
+    }
+
+    char line[MAX_PATH];
+    while (fgets(line, sizeof(line), list) != NULL) {
+        line[strcspn(line, "\n")] = '\0';
+        if (line[0] == '\0' || line[0] == '#') {
+            continue;
+        }
+        struct stat statbuf;
+        if (stat(line, &statbuf) == -1) {
+            perror("stat");
+        } else if (S_ISREG(statbuf.st_mode)) {
+            visit_entry(line);
+        }
+    }
+    fclose(list);
+    return 0;
+}
+
+int query_init(const char *path) {
+    if (stat(path, &query_stat) == -1) {
+        perror("stat");
+        return -1;
+    }
+    if (!S_ISREG(query_stat.st_mode) || query_stat.st_size == 0) {
+        fprintf(stderr, "%s no es un archivo regular con datos\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+// El archivo consultado se lee una sola vez, cuando aparece el primer
+// archivo de su mismo tamaño
+void query_hash_probe(void) {
+    char hash[HASH_SIZE];
+
+    if (partial_digest(query_path, query_partial) == -1 || !hash_file(query_path, hash) ||
+        hex_to_digest(hash, query_digest) == -1) {
+        fprintf(stderr, "No se pudo leer %s\n", query_path);
+        query_hashed = -1;
+        query_stop = 1;
+        return;
+    }
+    query_hashed = 1;
+}
+
+// Compara un archivo del recorrido con el consultado: primero el tamaño,
+// luego el hash parcial del comienzo y sólo si coincide el hash completo
+void query_check_file(const char *path, const struct stat *statbuf) {
+    unsigned char digest[16];
+    char hash[HASH_SIZE];
+
+    if (statbuf->st_size != query_stat.st_size ||
+        (statbuf->st_dev == query_stat.st_dev && statbuf->st_ino == query_stat.st_ino)) {
+        return; // Otro tamaño, o el mismo archivo (o un hardlink suyo)
+    }
+    pthread_once(&query_once, query_hash_probe);
+    if (query_hashed != 1 || query_stop) {
+        return;
+    }
+    pthread_mutex_lock(&query_lock);
+    query_checked++;
+    pthread_mutex_unlock(&query_lock);
+
+    if (partial_digest(path, digest) == -1 || memcmp(digest, query_partial, 16) != 0) {
+        return;
+    }
+    if (!hash_file(path, hash) || hex_to_digest(hash, digest) == -1 || memcmp(digest, query_digest, 16) != 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&query_lock);
+    if (!query_stop) {
+        printf("%s es duplicado de %s\n", path, query_path);
+        fflush(stdout);
+        query_matches++;
+        if (max_matches > 0 && query_matches >= max_matches) {
+            // Despertar a los hilos que esperan trabajo para que terminen
+            query_stop = 1;
+            for (int i = 0; i < num_walkers; i++) {
+                sem_post(&sem_to_visit);
+            }
+        }
+    }
+    pthread_mutex_unlock(&query_lock);
+}
+
+void add_to_visit(const char *path) {
+    lock_sem(&mutex);
+    if (file_list_push(&to_visit, path) == -1) {
+        sem_post(&mutex);
+        fprintf(stderr, "Sin memoria para la lista de archivos a visitar, se omite %s\n", path);
+        return;
+    }
+    sem_post(&mutex);
+    sem_post(&sem_to_visit);
+}
+
+// Quien llama a las funciones de FileList debe tener el lock de la lista
+int file_list_push(FileList *list, const char *path) {
+    size_t len = strlen(path) + 1;
+
+    if (list->limit > 0 && list->resident > 1 &&
+        list->used + len + sizeof(size_t) * (list->resident + 1) > list->limit) {
+        file_list_spill(list);
+    }
+    if (file_list_grow(list, list->used + len, list->resident + 1) == -1) {
+        return -1;
+    }
+    list->offsets[list->resident++] = list->used;
+    memcpy(list->paths + list->used, path, len);
+    list->used += len;
+    list->count++;
+    return 0;
+}
+
+// Saca la última ruta; si la memoria quedó vacía, antes recarga el último
+// bloque volcado. Devuelve -1 si ese bloque no se pudo leer.
+int file_list_pop(FileList *list, char *path) {
+    if (list->resident == 0 && file_list_reload(list) == -1) {
+        return -1;
+    }
+    list->resident--;
+    list->count--;
+    list->used = list->offsets[list->resident];
+    strcpy(path, list->paths + list->used);
+    return 0;
+}
+
+// Ruta i de las que están en memoria (la 0 es la más antigua)
+const char *file_list_get(const FileList *list, int i) {
+    return list->paths + list->offsets[i];
+}
+
+int file_list_grow(FileList *list, size_t bytes, int entries) {
+    if (bytes > list->capacity) {
+        size_t capacity = list->capacity > 0 ? list->capacity : 64 * 1024;
+        while (capacity < bytes) {
+            capacity *= 2;
+        }
+        char *paths = realloc(list->paths, capacity);
+        if (paths == NULL) {
+            return -1;
+        }
+        list->paths = paths;
+        list->capacity = capacity;
+    }
+    if (entries > list->slots) {
+        int slots = list->slots > 0 ? list->slots * 2 : 1024;
+        while (slots < entries) {
+            slots *= 2;
+        }
+        size_t *offsets = realloc(list->offsets, sizeof(size_t) * slots);
+        if (offsets == NULL) {
+            return -1;
+        }
+        list->offsets = offsets;
+        list->slots = slots;
+    }
+    return 0;
+}
+
+// Vuelca la mitad más antigua de lo que está en memoria al final del
+// archivo de la lista. Si la escritura falla, las rutas siguen en memoria.
+void file_list_spill(FileList *list) {
+    int moved = list->resident / 2;
+    size_t bytes = list->offsets[moved];
+
+    if (list->spill == NULL) {
+        return;
+    }
+    if (list->block_count == list->block_capacity) {
+        int capacity = list->block_capacity > 0 ? list->block_capacity * 2 : 64;
+        off_t *start = realloc(list->block_start, sizeof(off_t) * capacity);
+        if (start == NULL) {
+            return;
+        }
+        list->block_start = start;
+        int *entries = realloc(list->block_entries, sizeof(int) * capacity);
+        if (entries == NULL) {
+            return;
+        }
+        list->block_entries = entries;
+        list->block_capacity = capacity;
+    }
+    if (fseeko(list->spill, list->spill_size, SEEK_SET) == -1 ||
+        fwrite(list->paths, 1, bytes, list->spill) != bytes || fflush(list->spill) != 0) {
+        perror("fwrite");
+        return;
+    }
+    list->block_start[list->block_count] = list->spill_size;
+    list->block_entries[list->block_count++] = moved;
+    list->spill_size += bytes;
+
+    memmove(list->paths, list->paths + bytes, list->used - bytes);
+    for (int i = moved; i < list->resident; i++) {
+        list->offsets[i - moved] = list->offsets[i] - bytes;
+    }
+    list->resident -= moved;
+    list->used -= bytes;
+}
+
+// Trae a memoria el último bloque volcado, que queda debajo de nada: la
+// memoria está vacía cuando se llama
+int file_list_reload(FileList *list) {
+    if (list->block_count == 0) {
+        return -1;
+    }
+    int block = --list->block_count;
+    size_t bytes = (size_t)(list->spill_size - list->block_start[block]);
+    int entries = list->block_entries[block];
+
+    list->spill_size = list->block_start[block];
+    if (file_list_grow(list, bytes, entries) == -1 ||
+        fseeko(list->spill, list->block_start[block], SEEK_SET) == -1 ||
+        fread(list->paths, 1, bytes, list->spill) != bytes) {
+        perror("fread");
+        list->count -= entries;
+        fprintf(stderr, "Se pierden %d entradas pendientes del recorrido\n", entries);
+        return -1;
+    }
+    list->used = 0;
+    for (int i = 0; i < entries; i++) {
+        list->offsets[i] = list->used;
+        list->used += strlen(list->paths + list->used) + 1;
+    }
+    list->resident = entries;
+    return 0;
+}
+
+void add_to_visited(const char *path, const struct stat *statbuf) {
+    size_t len = strlen(path) + 1;
+
+    lock_sem(&sem_visited);
+    if (catalog.count == catalog.capacity) {
+        catalog_grow();
+    }
+    if (catalog.paths_size + len > catalog.paths_capacity) {
+        catalog.paths_capacity = catalog.paths_capacity > 0 ? catalog.paths_capacity * 2 : 64 * 1024;
+        catalog.paths = realloc(catalog.paths, catalog.paths_capacity);
+    }
+    int i = catalog.count++;
+    memcpy(catalog.paths + catalog.paths_size, path, len);
+    catalog.path_id[i] = catalog.paths_size;
+    catalog.paths_size += len;
+    catalog.size[i] = statbuf->st_size;
+    catalog.dev[i] = statbuf->st_dev;
+    catalog.ino[i] = statbuf->st_ino;
+    catalog.mtime[i] = statbuf->st_mtime;
+    catalog.phys[i] = 0;
+    catalog.flags[i] = 0;
+    catalog.shared_with[i] = -1;
+    sem_post(&sem_visited);
+}
+
+// El bloque de rutas puede moverse mientras el recorrido agrega archivos;
+// después de la etapa 1 los punteros devueltos son estables
+const char *file_path(int index) {
+    return catalog.paths + catalog.path_id[index];
+}
+
+void catalog_grow(void) {
+    int capacity = catalog.capacity > 0 ? catalog.capacity * 2 : 4096;
+
+    catalog.size = realloc(catalog.size, sizeof(*catalog.size) * capacity);
+    catalog.dev = realloc(catalog.dev, sizeof(*catalog.dev) * capacity);
+    catalog.ino = realloc(catalog.ino, sizeof(*catalog.ino) * capacity);
+    catalog.mtime = realloc(catalog.mtime, sizeof(*catalog.mtime) * capacity);
+    catalog.path_id = realloc(catalog.path_id, sizeof(*catalog.path_id) * capacity);
+    catalog.digest = realloc(catalog.digest, sizeof(*catalog.digest) * capacity);
+    catalog.phys = realloc(catalog.phys, sizeof(*catalog.phys) * capacity);
+    catalog.flags = realloc(catalog.flags, sizeof(*catalog.flags) * capacity);
+    catalog.shared_with = realloc(catalog.shared_with, sizeof(*catalog.shared_with) * capacity);
+    if (digest_set & DPL_DIGEST_SHA256) {
+        catalog.sha256 = realloc(catalog.sha256, sizeof(*catalog.sha256) * capacity);
+        if (catalog.sha256 == NULL) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (digest_set & DPL_DIGEST_CRC32C) {
+        catalog.crc32c = realloc(catalog.crc32c, sizeof(*catalog.crc32c) * capacity);
+        if (catalog.crc32c == NULL) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (catalog.size == NULL || catalog.dev == NULL || catalog.ino == NULL || catalog.mtime == NULL ||
+        catalog.path_id == NULL || catalog.digest == NULL || catalog.phys == NULL || catalog.flags == NULL ||
+        catalog.shared_with == NULL) {
+        perror("realloc");
+        exit(EXIT_FAILURE);
+    }
+    catalog.capacity = capacity;
+}
+
+void catalog_free(void) {
+    free(catalog.size);
+    free(catalog.dev);
+    free(catalog.ino);
+    free(catalog.mtime);
+    free(catalog.path_id);
+    free(catalog.digest);
+    free(catalog.phys);
+    free(catalog.flags);
+    free(catalog.shared_with);
+    free(catalog.sha256);
+    free(catalog.crc32c);
+    free(catalog.paths);
+    memset(&catalog, 0, sizeof(catalog));
+}
+
+// Copia las claves (tamaño y, si use_digest, hash) de los archivos que
+// participan en la agrupación y las ordena. Se recorren sólo las columnas
+// de la clave, en orden de índice, así que el orden final es estable.
+SortKey *sorted_keys(int use_digest, int *count) {
+    SortKey *keys = malloc(sizeof(SortKey) * (catalog.count > 0 ? catalog.count : 1));
+    int n = 0;
+
+    for (int i = 0; i < catalog.count; i++) {
+        if (use_digest && !(catalog.flags[i] & (FILE_HASHED | FILE_PREFILTERED))) {
+            continue;
+        }
+        keys[n].size = (unsigned long long)catalog.size[i];
+        if (use_digest) {
+            memcpy(keys[n].digest, catalog.digest[i], 16);
+        } else {
+            memset(keys[n].digest, 0, 16);
+        }
+        keys[n].index = i;
+        keys[n].pad = 0;
+        n++;
+    }
+    radix_sort(keys, n, use_digest);
+    *count = n;
+    return keys;
+}
+
+// Radix sort LSD con dígitos de 8 bits. El dígito d (0..23) es el byte 15-d
+// del hash si d < 16, o el byte d-16 del tamaño; así el orden final es por
+// tamaño y después por hash (como memcmp). Cada hilo cuenta y reparte su
+// tramo del arreglo, y las pasadas en las que todas las claves comparten el
+// dígito (los bytes altos del tamaño, casi siempre) se saltan.
+void radix_sort(SortKey *keys, int count, int use_digest) {
+    RadixJob job;
+    int threads = sort_threads;
+
+    if (count < 2) {
+        return;
+    }
+    if (threads > count / 4096 + 1) {
+        threads = count / 4096 + 1; // Con pocas claves no compensa repartir
+    }
+    job.src = keys;
+    job.dst = malloc(sizeof(SortKey) * count);
+    job.count = count;
+    job.threads = threads;
+    job.first_digit = use_digest ? 0 : 16;
+    job.offsets = calloc(threads, sizeof(*job.offsets));
+    pthread_barrier_init(&job.barrier, NULL, threads);
+
+    pthread_t workers[threads];
+    RadixWorkerArg args[threads];
+    for (int t = 0; t < threads; t++) {
+        args[t].job = &job;
+        args[t].id = t;
+        if (t > 0) {
+            pthread_create(&workers[t], NULL, radix_worker, &args[t]);
+        }
+    }
+    radix_worker(&args[0]);
+    for (int t = 1; t < threads; t++) {
+        pthread_join(workers[t], NULL);
+    }
+
+    if (job.src != keys) {
+        memcpy(keys, job.src, sizeof(SortKey) * count);
+        free(job.src);
+    } else {
+        free(job.dst);
+    }
+    free(job.offsets);
+    pthread_barrier_destroy(&job.barrier);
+}
+
+void *radix_worker(void *arg) {
+    RadixWorkerArg *worker = (RadixWorkerArg *)arg;
+    RadixJob *job = worker->job;
+    int lo = (int)((long long)job->count * worker->id / job->threads);
+    int hi = (int)((long long)job->count * (worker->id + 1) / job->threads);
+
+    for (int digit = job->first_digit; digit < 24; digit++) {
+        size_t *mine = job->offsets[worker->id];
+        memset(mine, 0, sizeof(job->offsets[0]));
+        for (int i = lo; i < hi; i++) {
+            const SortKey *key = &job->src[i];
+            unsigned int byte = digit < 16 ? key->digest[15 - digit] : (unsigned int)(key->size >> (8 * (digit - 16))) & 0xff;
+            mine[byte]++;
+        }
+        pthread_barrier_wait(&job->barrier);
+
+        // Un solo hilo convierte los histogramas en posiciones de destino:
+        // balde por balde y, dentro de cada balde, hilo por hilo
+        if (worker->id == 0) {
+            size_t position = 0;
+            job->skip = 0;
+            for (int byte = 0; byte < 256; byte++) {
+                size_t total = 0;
+                for (int t = 0; t < job->threads; t++) {
+                    size_t c = job->offsets[t][byte];
+                    job->offsets[t][byte] = position;
+                    position += c;
+                    total += c;
+                }
+                if (total == (size_t)job->count) {
+                    job->skip = 1;
+                }
+            }
+        }
+        pthread_barrier_wait(&job->barrier);
+
+        if (!job->skip) {
+            for (int i = lo; i < hi; i++) {
+                const SortKey *key = &job->src[i];
+                unsigned int byte = digit < 16 ? key->digest[15 - digit] : (unsigned int)(key->size >> (8 * (digit - 16))) & 0xff;
+                job->dst[mine[byte]++] = *key;
+            }
+        }
+        pthread_barrier_wait(&job->barrier);
+
+        if (worker->id == 0 && !job->skip) {
+            SortKey *tmp = job->src;
+            job->src = job->dst;
+            job->dst = tmp;
+        }
+        pthread_barrier_wait(&job->barrier);
+    }
+    return NULL;
+}
+
+DeviceQueue *find_device_queue(dev_t dev) {
+    for (int i = 0; i < device_count; i++) {
+        if (devices[i].dev == dev) {
+            return &devices[i];
+        }
+    }
+    return NULL;
+}
+
+// Reparte los archivos visitados en una cola por st_dev y ordena cada cola
+// para que los grupos de tamaño con más bytes recuperables se lean primero:
+// si el escaneo se corta, lo ya encontrado es lo que más vale. En los discos
+// rotacionales el orden es por clase de rendimiento (potencia de 2) y dentro
+// de cada clase por offset físico (o por inodo si FIEMAP no está
+// disponible), para que las lecturas sigan siendo casi secuenciales.
+// Devuelve -1 si no hay memoria para las colas.
+int build_device_queues(void) {
+    int warned = 0;
+
+    device_count = 0;
+    free(hash_done_at);
+    hash_done_at = calloc(catalog.count + 1, sizeof(double));
+    for (int i = 0; i < catalog.count; i++) {
+        if (!(catalog.flags[i] & FILE_CANDIDATE) || catalog.shared_with[i] >= 0 || (catalog.flags[i] & FILE_HASHED)) {
+            continue; // Nada con qué compararlo, ya se sabe que es una copia o ya se leyó
+        }
+        DeviceQueue *queue = find_device_queue(catalog.dev[i]);
+        if (queue == NULL) {
+            if (device_count >= MAX_DEVICES) {
+                queue = &devices[device_count - 1]; // Sin espacio: compartir la última cola
+                if (!warned) {
+                    fprintf(stderr, "Aviso: más de %d dispositivos; los restantes comparten la cola de %u:%u\n",
+                            MAX_DEVICES, major(queue->dev), minor(queue->dev));
+                    warned = 1;
+                }
+            } else {
+                queue = &devices[device_count];
+                memset(queue, 0, sizeof(*queue));
+                queue->files = malloc(sizeof(int) * catalog.count);
+                if (queue->files == NULL) {
+                    perror("malloc");
+                    return -1;
+                }
+                device_count++;
+                queue->dev = catalog.dev[i];
+                queue->rotational = is_rotational(queue->dev);
+                pthread_mutex_init(&queue->lock, NULL);
+                pthread_cond_init(&queue->wake, NULL);
+            }
+        }
+        queue->files[queue->count++] = i;
+    }
+
+    for (int d = 0; d < device_count; d++) {
+        DeviceQueue *queue = &devices[d];
+        if (!queue->rotational) {
+            qsort(queue->files, queue->count, sizeof(int), compare_yield);
+            continue;
+        }
+        for (int i = 0; i < queue->count; i++) {
+            int file = queue->files[i];
+            catalog.phys[file] = physical_offset(file_path(file), catalog.ino[file]);
+        }
+        qsort(queue->files, queue->count, sizeof(int), compare_physical);
+    }
+    return 0;
+}
+
+// Busca /sys/dev/block/<major>:<minor>/queue/rotational; si st_dev es una
+// partición la cola está en el directorio del disco padre. Los sistemas sin
+// dispositivo de bloque (tmpfs, NFS, ...) se tratan como no rotacionales.
+int is_rotational(dev_t dev) {
+    char path[MAX_PATH];
+    const char *candidates[] = {"queue/rotational", "../queue/rotational"};
+
+    for (int i = 0; i < 2; i++) {
+        snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/%s", major(dev), minor(dev), candidates[i]);
+        FILE *file = fopen(path, "r");
+        if (file != NULL) {
+            int value = 0;
+            if (fscanf(file, "%d", &value) != 1) {
+                value = 0;
+            }
+            fclose(file);
+            return value == 1;
+        }
+    }
+    return 0;
+}
+
+// Offset físico del primer extent según FIEMAP. Si el sistema de archivos no
+// lo soporta se usa el número de inodo, que en ext4/XFS sigue de cerca la
+// ubicación en disco.
+unsigned long long physical_offset(const char *path, ino_t ino) {
+    struct {
+        struct fiemap map;
+        struct fiemap_extent extent;
+    } request;
+
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return (unsigned long long)ino;
+    }
+    memset(&request, 0, sizeof(request));
+    request.map.fm_start = 0;
+    request.map.fm_length = FIEMAP_MAX_OFFSET;
+    request.map.fm_extent_count = 1;
+    int ok = ioctl(fd, FS_IOC_FIEMAP, &request.map) == 0 && request.map.fm_mapped_extents > 0;
+    close(fd);
+    return ok ? request.extent.fe_physical : (unsigned long long)ino;
+}
+
+// Cola rotacional: clase de rendimiento descendente y luego offset físico.
+// Si la cola es compartida, los offsets sólo se comparan dentro de un mismo
+// dispositivo.
+int compare_physical(const void *a, const void *b) {
+    int ca = yield_class(file_yield[*(const int *)a]);
+    int cb = yield_class(file_yield[*(const int *)b]);
+    if (ca != cb) {
+        return cb - ca;
+    }
+    dev_t da = catalog.dev[*(const int *)a], db = catalog.dev[*(const int *)b];
+    if (da != db) {
+        return da < db ? -1 : 1;
+    }
+    unsigned long long pa = catalog.phys[*(const int *)a];
+    unsigned long long pb = catalog.phys[*(const int *)b];
+    return (pa > pb) - (pa < pb);
+}
+
+// Cola no rotacional: rendimiento descendente. A igual rendimiento se
+// desempata por tamaño para que los miembros de un grupo se lean juntos y
+// el grupo quede confirmado cuanto antes.
+int compare_yield(const void *a, const void *b) {
+    int fa = *(const int *)a, fb = *(const int *)b;
+    if (file_yield[fa] != file_yield[fb]) {
+        return file_yield[fa] < file_yield[fb] ? 1 : -1;
+    }
+    if (catalog.size[fa] != catalog.size[fb]) {
+        return catalog.size[fa] < catalog.size[fb] ? 1 : -1;
+    }
+    return fa - fb;
+}
+
+int yield_class(unsigned long long yield) {
+    return yield > 0 ? 64 - __builtin_clzll(yield) : 0;
+}
+
+double seconds_since(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// Un grupo queda confirmado cuando termina la lectura de su segundo miembro;
+// devuelve el primero de esos momentos, o -1 si no hay grupos. Los archivos
+// leídos antes de un --resume cuentan como leídos al comienzo.
+double first_result_time(void) {
+    double first = -1;
+    if (hash_done_at == NULL) {
+        return -1; // No hubo etapa 2
+    }
+    for (int g = 0; g < group_count; g++) {
+        double t1 = -1, t2 = -1; // Los dos menores tiempos del grupo
+        for (int i = 0; i < groups[g].count; i++) {
+            double t = hash_done_at[groups[g].members[i]];
+            if (t1 < 0 || t < t1) {
+                t2 = t1;
+                t1 = t;
+            } else if (t2 < 0 || t < t2) {
+                t2 = t;
+            }
+        }
+        if (first < 0 || t2 < first) {
+            first = t2;
+        }
+    }
+    return first;
+}
+
+void *hash_worker(void *arg) {
+    HashWorkerArg *worker = (HashWorkerArg *)arg;
+    DeviceQueue *queue = worker->queue;
+
+    if (idle_io) {
+        set_idle_io_priority();
+    }
+
+    budget_register();
+    while (1) {
+        pthread_mutex_lock(&queue->lock);
+        // Con -t auto los hilos sobrantes esperan hasta que el controlador los habilite
+        while (worker->id >= queue->active && queue->next < queue->count && !budget_expired) {
+            pthread_cond_wait(&queue->wake, &queue->lock);
+        }
+        if (queue->next >= queue->count || budget_expired) {
+            pthread_cond_broadcast(&queue->wake); // Que los hilos en espera también salgan
+            pthread_mutex_unlock(&queue->lock);
+            break;
+        }
+        int file = queue->files[queue->next++];
+        pthread_mutex_unlock(&queue->lock);
+
+        char hash[HASH_SIZE];
+        pthread_rwlock_rdlock(&checkpoint_lock);
+        if (prefilter_stage) {
+            if (partial_digest(file_path(file), catalog.digest[file]) == 0) {
+                catalog.flags[file] |= FILE_PREFILTERED;
+            }
+        } else if (digest_set != DPL_DIGEST_MD5) {
+            if (hash_file_digests(file)) {
+                catalog.flags[file] |= FILE_HASHED;
+            }
+        } else if (hash_file(file_path(file), hash) && hex_to_digest(hash, catalog.digest[file]) == 0) {
+            catalog.flags[file] |= FILE_HASHED;
+        }
+        if (!prefilter_stage) {
+            hash_done_at[file] = seconds_since(&scan_start);
+        }
+        pthread_rwlock_unlock(&checkpoint_lock);
+
+        pthread_mutex_lock(&queue->lock);
+        queue->bytes_done += prefilter_stage && catalog.size[file] > 2 * FAST_PARTIAL_SIZE ? 2 * FAST_PARTIAL_SIZE
+                                                                                        : catalog.size[file];
+        queue->files_done++;
+        pthread_mutex_unlock(&queue->lock);
+    }
+    budget_unregister();
+    return NULL;
+}
+
+// Lanza todos los grupos de hilos a la vez: num_threads por dispositivo no
+// rotacional y rotational_depth por disco rotacional. Con -t auto se crean
+// AUTO_MAX_WORKERS hilos por dispositivo pero al principio sólo uno lee.
+void run_hash_stage(int num_threads) {
+    int total = 0;
+    for (int d = 0; d < device_count; d++) {
+        if (auto_threads) {
+            devices[d].workers = AUTO_MAX_WORKERS;
+        } else {
+            devices[d].workers = devices[d].rotational ? rotational_depth : num_threads;
+        }
+        if (devices[d].workers > devices[d].count) {
+            devices[d].workers = devices[d].count;
+        }
+        devices[d].active = auto_threads ? 1 : devices[d].workers;
+        devices[d].peak = devices[d].active;
+        total += devices[d].workers;
+    }
+
+    pthread_t *threads = malloc(sizeof(pthread_t) * (total > 0 ? total : 1));
+    HashWorkerArg *args = malloc(sizeof(HashWorkerArg) * (total > 0 ? total : 1));
+    int created = 0;
+    for (int d = 0; d < device_count; d++) {
+        for (int i = 0; i < devices[d].workers; i++) {
+            args[created].queue = &devices[d];
+            args[created].id = i;
+            if (pthread_create(&threads[created], NULL, hash_worker, &args[created]) == 0) {
+                created++;
+            }
+        }
+    }
+
+    pthread_t controller;
+    int has_controller = 0;
+    hash_stage_done = 0;
+    if (auto_threads) {
+        has_controller = pthread_create(&controller, NULL, auto_controller, NULL) == 0;
+    }
+
+    for (int i = 0; i < created; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    hash_stage_done = 1;
+    if (has_controller) {
+        pthread_join(controller, NULL);
+    }
+    free(threads);
+    free(args);
+}
+
+void *auto_controller(void *arg) {
+    (void)arg;
+    AutoTuner tuners[MAX_DEVICES];
+    struct timespec interval = {AUTO_INTERVAL_MS / 1000, (AUTO_INTERVAL_MS % 1000) * 1000000L};
+    struct timespec last, now;
+
+    memset(tuners, 0, sizeof(tuners));
+    for (int d = 0; d < device_count; d++) {
+        tuners[d].wait = 1; // Tomar una medición con un hilo y luego empezar a crecer
+        tuners[d].next_probe = 1;
+    }
+
+    budget_register(); // Para que --time-budget corte también la espera
+    clock_gettime(CLOCK_MONOTONIC, &last);
+    while (!hash_stage_done) {
+        nanosleep(&interval, NULL);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        double seconds = (now.tv_sec - last.tv_sec) + (now.tv_nsec - last.tv_nsec) / 1e9;
+        last = now;
+        for (int d = 0; d < device_count; d++) {
+            auto_step(&devices[d], &tuners[d], seconds);
+            if (budget_expired) {
+                // Los hilos que esperan ser habilitados también deben salir
+                pthread_mutex_lock(&devices[d].lock);
+                pthread_cond_broadcast(&devices[d].wake);
+                pthread_mutex_unlock(&devices[d].lock);
+            }
+        }
+    }
+    budget_unregister();
+    return NULL;
+}
+
+// Un paso del controlador: mide MB/s y archivos/s del último intervalo y
+// decide si conservar, deshacer o iniciar un cambio en el número de hilos.
+// Basta con que mejore una de las dos medidas: con archivos pequeños manda
+// archivos/s y con archivos grandes manda MB/s.
+void auto_step(DeviceQueue *queue, AutoTuner *tuner, double seconds) {
+    pthread_mutex_lock(&queue->lock);
+    unsigned long long bytes = queue->bytes_done;
+    unsigned long long files = queue->files_done;
+    int pending = queue->next < queue->count;
+    int active = queue->active;
+    int workers = queue->workers;
+    pthread_mutex_unlock(&queue->lock);
+
+    double rate_bytes = (bytes - tuner->last_bytes) / seconds;
+    double rate_files = (files - tuner->last_files) / seconds;
+    tuner->last_bytes = bytes;
+    tuner->last_files = files;
+    if (!pending) {
+        return;
+    }
+
+    if (tuner->probe != 0) {
+        int better = rate_bytes > tuner->base_bytes * 1.05 || rate_files > tuner->base_files * 1.05;
+        int no_worse = rate_bytes >= tuner->base_bytes * 0.95 && rate_files >= tuner->base_files * 0.95;
+        if (tuner->probe > 0 && better) {
+            // Agregar un hilo ayudó: seguir creciendo
+            tuner->base_bytes = rate_bytes;
+            tuner->base_files = rate_files;
+            if (active < workers) {
+                set_active_workers(queue, active + 1);
+                return;
+            }
+            tuner->next_probe = -1;
+        } else if (tuner->probe < 0 && no_worse) {
+            // Quitar un hilo no costó rendimiento: conservar el recorte
+            tuner->base_bytes = rate_bytes;
+            tuner->base_files = rate_files;
+            tuner->next_probe = -1;
+        } else {
+            // Meseta: deshacer el último cambio y probar en la otra dirección
+            set_active_workers(queue, active - tuner->probe);
+            tuner->next_probe = -tuner->probe;
+        }
+        tuner->probe = 0;
+        tuner->wait = AUTO_REPROBE_INTERVALS;
+        return;
+    }
+
+    if (--tuner->wait > 0) {
+        return;
+    }
+    // Volver a probar por si la carga cambió (p. ej. de caché a disco)
+    int target = active + tuner->next_probe;
+    if (target < 1 || target > workers) {
+        tuner->next_probe = -tuner->next_probe;
+        target = active + tuner->next_probe;
+    }
+    if (target < 1 || target > workers) {
+        tuner->wait = AUTO_REPROBE_INTERVALS;
+        return;
+    }
+    tuner->base_bytes = rate_bytes;
+    tuner->base_files = rate_files;
+    tuner->probe = tuner->next_probe;
+    set_active_workers(queue, target);
+}
+
+void set_active_workers(DeviceQueue *queue, int active) {
+    pthread_mutex_lock(&queue->lock);
+    queue->active = active;
+    if (active > queue->peak) {
+        queue->peak = active;
+    }
+    pthread_cond_broadcast(&queue->wake);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+// Marca como candidatos los archivos cuyo tamaño se repite: un archivo de
+// tamaño único no puede tener duplicados y no hace falta leerlo. Con
+// --shared-extents, además, dentro de cada grupo de igual tamaño se comparan
+// las listas de extents (FIEMAP): dos archivos con los mismos extents físicos
+// (reflinks en btrfs/XFS, o hardlinks) ya están deduplicados y se informan
+// aparte sin leer su contenido.
+void mark_size_candidates(void) {
+    int count;
+    SortKey *keys = sorted_keys(0, &count);
+
+    free(file_yield);
+    file_yield = malloc(sizeof(*file_yield) * (catalog.count + 1));
+    for (int start = 0; start < count;) {
+        int end = start + 1;
+        while (end < count && keys[end].size == keys[start].size) {
+            end++;
+        }
+        for (int i = start; i < end; i++) {
+            file_yield[keys[i].index] = keys[start].size * (unsigned long long)(end - start - 1);
+        }
+        // Para exportar el índice hace falta el hash de todos los archivos
+        if (end - start > 1 || export_path != NULL) {
+            for (int i = start; i < end; i++) {
+                catalog.flags[keys[i].index] |= FILE_CANDIDATE;
+            }
+        }
+
+        if (check_shared_extents && end - start > 1) {
+            mark_shared_extents(&keys[start], end - start);
+        }
+        start = end;
+    }
+    free(keys);
+}
+
+// Ordena el grupo de modo que dos archivos del mismo inodo, o con la misma
+// lista de extents, queden contiguos; así basta comparar cada uno con el
+// anterior. Cada tramo de archivos iguales apunta al primero visitado. Si
+// quedan menos de dos sin compartir, el que queda no necesita leerse.
+void mark_shared_extents(const SortKey *keys, int group) {
+    ExtentKey *members = malloc(sizeof(ExtentKey) * group);
+    for (int i = 0; i < group; i++) {
+        members[i].node = keys[i].index;
+        members[i].order = i;
+        members[i].extents = get_extents(file_path(keys[i].index));
+    }
+    qsort(members, group, sizeof(ExtentKey), compare_extent_key);
+
+    int unshared = 0;
+    for (int run = 0; run < group;) {
+        int first = run; // El primero visitado del tramo
+        int end = run + 1;
+        while (end < group) {
+            int node = members[end].node, prev = members[end - 1].node;
+            if (catalog.dev[node] != catalog.dev[prev] ||
+                (catalog.ino[node] != catalog.ino[prev] &&
+                 !same_extents(members[end].extents, members[end - 1].extents))) {
+                break;
+            }
+            if (members[end].order < members[first].order) {
+                first = end;
+            }
+            end++;
+        }
+        for (int i = run; i < end; i++) {
+            if (i != first) {
+                catalog.shared_with[members[i].node] = members[first].node;
+            }
+        }
+        unshared++;
+        run = end;
+    }
+
+    // Para exportar el índice hace falta el hash de todos los archivos
+    if (unshared < 2 && export_path == NULL) {
+        for (int i = 0; i < group; i++) {
+            catalog.flags[members[i].node] &= ~FILE_CANDIDATE;
+        }
+    }
+    for (int i = 0; i < group; i++) {
+        free(members[i].extents);
+    }
+    free(members);
+}
+
+// Dispositivo, luego la lista de extents extent por extent (los archivos sin
+// lista primero) y por último el inodo, para que los hardlinks sin extents
+// fiables también queden juntos
+int compare_extent_key(const void *a, const void *b) {
+    const ExtentKey *ka = (const ExtentKey *)a, *kb = (const ExtentKey *)b;
+    if (catalog.dev[ka->node] != catalog.dev[kb->node]) {
+        return catalog.dev[ka->node] < catalog.dev[kb->node] ? -1 : 1;
+    }
+    unsigned int na = ka->extents != NULL ? ka->extents->fm_mapped_extents : 0;
+    unsigned int nb = kb->extents != NULL ? kb->extents->fm_mapped_extents : 0;
+    if (na != nb) {
+        return na < nb ? -1 : 1;
+    }
+    for (unsigned int i = 0; i < na; i++) {
+        const struct fiemap_extent *ea = &ka->extents->fm_extents[i];
+        const struct fiemap_extent *eb = &kb->extents->fm_extents[i];
+        if (ea->fe_physical != eb->fe_physical) {
+            return ea->fe_physical < eb->fe_physical ? -1 : 1;
+        }
+        if (ea->fe_logical != eb->fe_logical) {
+            return ea->fe_logical < eb->fe_logical ? -1 : 1;
+        }
+        if (ea->fe_length != eb->fe_length) {
+            return ea->fe_length < eb->fe_length ? -1 : 1;
+        }
+    }
+    if (catalog.ino[ka->node] != catalog.ino[kb->node]) {
+        return catalog.ino[ka->node] < catalog.ino[kb->node] ? -1 : 1;
+    }
+    return ka->order - kb->order;
+}
+
+// Después del hash rápido de -m x: un candidato cuyo (tamaño, hash rápido)
+// no se repite no puede tener copias y no se lee completo. Un grupo de
+// tamaño con algún MD5 ya calculado (de un punto de control) se deja
+// entero, porque ese hash no se puede comparar con el rápido. Las colas se
+// compactan sin perder el orden en que se iban a leer.
+void drop_prefilter_unique(void) {
+    int count;
+    SortKey *keys = sorted_keys(1, &count);
+
+    for (int start = 0; start < count;) {
+        int end = start + 1;
+        int has_md5 = catalog.flags[keys[start].index] & FILE_HASHED;
+        while (end < count && keys[end].size == keys[start].size) {
+            has_md5 |= catalog.flags[keys[end].index] & FILE_HASHED;
+            end++;
+        }
+        for (int i = start; i < end && !has_md5;) {
+            int same = i + 1;
+            while (same < end && memcmp(keys[same].digest, keys[i].digest, 16) == 0) {
+                same++;
+            }
+            if (same - i == 1) {
+                catalog.flags[keys[i].index] &= ~FILE_CANDIDATE;
+            }
+            i = same;
+        }
+        start = end;
+    }
+    free(keys);
+
+    for (int d = 0; d < device_count; d++) {
+        DeviceQueue *queue = &devices[d];
+        int kept = 0;
+        for (int i = 0; i < queue->count; i++) {
+            int file = queue->files[i];
+            catalog.flags[file] &= ~FILE_PREFILTERED;
+            if (catalog.flags[file] & FILE_CANDIDATE) {
+                queue->files[kept++] = file;
+            }
+        }
+        queue->count = kept;
+        queue->next = 0;
+        queue->bytes_done = 0;
+        queue->files_done = 0;
+    }
+}
+
+// Devuelve la lista completa de extents del archivo (liberar con free), o
+// NULL si el sistema de archivos no soporta FIEMAP
+struct fiemap *get_extents(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return NULL;
+    }
+
+    // Primera llamada sin espacio para extents: sólo devuelve cuántos hay
+    struct fiemap probe;
+    memset(&probe, 0, sizeof(probe));
+    probe.fm_length = FIEMAP_MAX_OFFSET;
+    if (ioctl(fd, FS_IOC_FIEMAP, &probe) == -1) {
+        close(fd);
+        return NULL;
+    }
+
+    unsigned int count = probe.fm_mapped_extents;
+    struct fiemap *map = calloc(1, sizeof(struct fiemap) + count * sizeof(struct fiemap_extent));
+    map->fm_length = FIEMAP_MAX_OFFSET;
+    map->fm_extent_count = count;
+    if (ioctl(fd, FS_IOC_FIEMAP, map) == -1 || map->fm_mapped_extents != count) {
+        free(map); // Falló o el archivo cambió entre las dos llamadas
+        map = NULL;
+    }
+    close(fd);
+    return map;
+}
+
+// Dos listas de extents describen los mismos datos si coinciden extent por
+// extent. Los extents sin ubicación física fiable (datos en línea, todavía
+// sin asignar o desconocidos) nunca se consideran compartidos.
+int same_extents(const struct fiemap *a, const struct fiemap *b) {
+    const unsigned int unreliable = FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DELALLOC |
+                                    FIEMAP_EXTENT_DATA_INLINE | FIEMAP_EXTENT_NOT_ALIGNED;
+
+    if (a == NULL || b == NULL || a->fm_mapped_extents == 0 || a->fm_mapped_extents != b->fm_mapped_extents) {
+        return 0;
+    }
+    for (unsigned int i = 0; i < a->fm_mapped_extents; i++) {
+        const struct fiemap_extent *ea = &a->fm_extents[i];
+        const struct fiemap_extent *eb = &b->fm_extents[i];
+        if ((ea->fe_flags & unreliable) || (eb->fe_flags & unreliable) ||
+            ea->fe_logical != eb->fe_logical || ea->fe_physical != eb->fe_physical ||
+            ea->fe_length != eb->fe_length) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Agrupa los archivos con hash por (tamaño, hash) con un radix sort sobre
+// las columnas del catálogo. Los miembros de cada grupo quedan en orden de
+// visita, así que el primero es el que se encontró antes.
+void find_duplicates(void) {
+    int count;
+    SortKey *keys = sorted_keys(1, &count);
+
+    group_members = malloc(sizeof(int) * (count > 0 ? count : 1));
+    groups = malloc(sizeof(DupGroup) * (count / 2 + 1));
+    group_count = 0;
+    int used = 0;
+    for (int start = 0; start < count;) {
+        int end = start + 1;
+        while (end < count && keys[end].size == keys[start].size &&
+               memcmp(keys[end].digest, keys[start].digest, 16) == 0) {
+            end++;
+        }
+        if (end - start > 1) {
+            DupGroup *group = &groups[group_count++];
+            group->members = &group_members[used];
+            group->count = end - start;
+            for (int i = start; i < end; i++) {
+                group_members[used++] = keys[i].index;
+            }
+            duplicate_count += (long long)group->count * (group->count - 1) / 2;
+        }
+        start = end;
+    }
+    free(keys);
+}
+
+// Reconstruye el árbol de directorios a partir de las rutas del catálogo y
+// calcula el digest de cada directorio en orden posterior (primero los más
+// profundos). Un directorio con algún archivo sin hash (de tamaño único, ya
+// compartido o ilegible) no puede ser idéntico a otro y queda incompleto.
+// Sólo se consideran los archivos regulares no vacíos, que son los que
+// registra el recorrido.
+void find_duplicate_directories(const char *start_dir) {
+    int root_length = (int)strlen(start_dir);
+    DirEntry *entries = malloc(sizeof(DirEntry) * (catalog.count > 0 ? catalog.count : 1));
+    int entry_count = 0;
+
+    dir_count = 0;
+    dir_lookup(start_dir, root_length, root_length);
+    for (int i = 0; i < catalog.count; i++) {
+        const char *path = file_path(i);
+        const char *slash = strrchr(path, '/');
+        DirEntry *entry = &entries[entry_count++];
+        entry->parent = dir_lookup(path, (int)(slash - path), root_length);
+        entry->name = slash + 1;
+        entry->name_length = (int)strlen(slash + 1);
+        entry->is_dir = 0;
+        entry->index = i;
+    }
+
+    // Cada directorio, salvo el inicial, es también una entrada de su padre
+    entries = realloc(entries, sizeof(DirEntry) * (entry_count + dir_count));
+    for (int d = 1; d < dir_count; d++) {
+        DirEntry *entry = &entries[entry_count++];
+        DirNode *node = &dir_nodes[d];
+        entry->parent = node->parent;
+        entry->name = node->path + dir_nodes[node->parent].length + 1;
+        entry->name_length = node->length - dir_nodes[node->parent].length - 1;
+        entry->is_dir = 1;
+        entry->index = d;
+    }
+    qsort(entries, entry_count, sizeof(DirEntry), compare_dir_entry);
+
+    int *first = malloc(sizeof(int) * (dir_count + 1)); // Primera entrada de cada directorio
+    for (int d = 0, e = 0; d <= dir_count; d++) {
+        while (e < entry_count && entries[e].parent < d) {
+            e++;
+        }
+        first[d] = e;
+    }
+
+    int *order = malloc(sizeof(int) * (dir_count + 1));
+    for (int d = 0; d < dir_count; d++) {
+        order[d] = d;
+    }
+    qsort(order, dir_count, sizeof(int), compare_dir_depth);
+
+    for (int k = 0; k < dir_count; k++) {
+        DirNode *node = &dir_nodes[order[k]];
+        MD5_CTX context;
+        MD5Init(&context);
+        for (int e = first[order[k]]; e < first[order[k] + 1]; e++) {
+            const DirEntry *entry = &entries[e];
+            unsigned char type = entry->is_dir ? DIR_ENTRY_DIR : DIR_ENTRY_FILE;
+            const unsigned char *digest;
+            if (entry->is_dir) {
+                DirNode *child = &dir_nodes[entry->index];
+                node->incomplete |= child->incomplete;
+                node->bytes += child->bytes;
+                node->files += child->files;
+                digest = child->digest;
+            } else {
+                if (!(catalog.flags[entry->index] & FILE_HASHED)) {
+                    node->incomplete = 1;
+                }
+                node->bytes += (unsigned long long)catalog.size[entry->index];
+                node->files++;
+                digest = catalog.digest[entry->index];
+            }
+            MD5Update(&context, &type, 1);
+            MD5Update(&context, (unsigned char *)entry->name, entry->name_length + 1);
+            MD5Update(&context, (unsigned char *)digest, 16);
+        }
+        MD5Final(node->digest, &context);
+    }
+
+    // Los directorios completos se agrupan por (bytes, digest) igual que los archivos
+    SortKey *keys = malloc(sizeof(SortKey) * dir_count);
+    int key_count = 0;
+    for (int d = 0; d < dir_count; d++) {
+        if (!dir_nodes[d].incomplete && dir_nodes[d].files > 0) {
+            keys[key_count].size = dir_nodes[d].bytes;
+            memcpy(keys[key_count].digest, dir_nodes[d].digest, 16);
+            keys[key_count].index = d;
+            keys[key_count].pad = 0;
+            key_count++;
+        }
+    }
+    radix_sort(keys, key_count, 1);
+    dir_group_members = malloc(sizeof(int) * (key_count > 0 ? key_count : 1));
+    dir_group_start = malloc(sizeof(int) * (key_count / 2 + 1));
+    dir_group_count = 0;
+    int used = 0;
+    for (int start = 0; start < key_count;) {
+        int end = start + 1;
+        while (end < key_count && keys[end].size == keys[start].size &&
+               memcmp(keys[end].digest, keys[start].digest, 16) == 0) {
+            end++;
+        }
+        if (end - start > 1) {
+            dir_group_start[dir_group_count] = used;
+            for (int i = start; i < end; i++) {
+                dir_nodes[keys[i].index].group = dir_group_count;
+                dir_group_members[used++] = keys[i].index;
+            }
+            dir_group_count++;
+        }
+        start = end;
+    }
+    dir_group_start[dir_group_count] = used;
+
+    // Para cada archivo, el directorio duplicado más cercano que lo contiene
+    file_cover = malloc(sizeof(int) * (catalog.count > 0 ? catalog.count : 1));
+    for (int e = 0; e < entry_count; e++) {
+        if (!entries[e].is_dir) {
+            int d = entries[e].parent;
+            while (d != -1 && dir_nodes[d].group == -1) {
+                d = dir_nodes[d].parent;
+            }
+            file_cover[entries[e].index] = d;
+        }
+    }
+
+    free(keys);
+    free(order);
+    free(first);
+    free(entries);
+}
+
+// Devuelve el índice del directorio, creándolo junto con sus ancestros
+// hasta el directorio inicial si todavía no existe
+int dir_lookup(const char *path, int length, int root_length) {
+    if (dir_count * 2 >= dir_table_size) {
+        dir_table_grow();
+    }
+    unsigned int slot = dir_hash(path, length) & (dir_table_size - 1);
+    while (dir_table[slot] != -1) {
+        DirNode *node = &dir_nodes[dir_table[slot]];
+        if (node->length == length && memcmp(node->path, path, length) == 0) {
+            return dir_table[slot];
+        }
+        slot = (slot + 1) & (dir_table_size - 1);
+    }
+
+    int parent = -1;
+    if (length > root_length) {
+        const char *slash = path + length - 1;
+        while (*slash != '/') {
+            slash--;
+        }
+        parent = dir_lookup(path, (int)(slash - path), root_length);
+        // La tabla pudo crecer mientras se creaban los ancestros
+        slot = dir_hash(path, length) & (dir_table_size - 1);
+        while (dir_table[slot] != -1) {
+            slot = (slot + 1) & (dir_table_size - 1);
+        }
+    }
+
+    if (dir_count == dir_capacity) {
+        dir_capacity = dir_capacity > 0 ? dir_capacity * 2 : 1024;
+        dir_nodes = realloc(dir_nodes, sizeof(DirNode) * dir_capacity);
+    }
+    DirNode *node = &dir_nodes[dir_count];
+    memset(node, 0, sizeof(DirNode));
+    node->path = path;
+    node->length = length;
+    node->parent = parent;
+    node->depth = parent == -1 ? 0 : dir_nodes[parent].depth + 1;
+    node->group = -1;
+    node->fold = -1;
+    dir_table[slot] = dir_count;
+    return dir_count++;
+}
+
+// Como dir_lookup, pero sin crear nada: -1 si el directorio no existe
+int dir_find(const char *path, int length) {
+    unsigned int slot = dir_hash(path, length) & (dir_table_size - 1);
+    while (dir_table[slot] != -1) {
+        DirNode *node = &dir_nodes[dir_table[slot]];
+        if (node->length == length && memcmp(node->path, path, length) == 0) {
+            return dir_table[slot];
+        }
+        slot = (slot + 1) & (dir_table_size - 1);
+    }
+    return -1;
+}
+
+// El directorio que ocupa el lugar de d cuando su padre se reduce a la copia
+// que lo representa. Si el padre no se reduce a otro, d se representa a sí
+// mismo.
+int dir_base(int d) {
+    int parent = dir_nodes[d].parent;
+    if (parent == -1) {
+        return d;
+    }
+    int folded = dir_fold(parent);
+    if (folded == parent) {
+        return d;
+    }
+    char path[MAX_PATH];
+    int suffix = dir_nodes[d].length - dir_nodes[parent].length;
+    int length = dir_nodes[folded].length + suffix;
+    if (length >= MAX_PATH) {
+        return d;
+    }
+    memcpy(path, dir_nodes[folded].path, dir_nodes[folded].length);
+    memcpy(path + dir_nodes[folded].length, dir_nodes[d].path + dir_nodes[parent].length, suffix);
+    int found = dir_find(path, length);
+    return found != -1 ? found : d;
+}
+
+// Un directorio duplicado se reduce a la base del primer miembro de su grupo
+// (al que se comparan todas las copias informadas); uno sin grupo, a su base
+int dir_fold(int d) {
+    if (dir_nodes[d].fold == -1) {
+        int group = dir_nodes[d].group;
+        dir_nodes[d].fold = group != -1 ? dir_base(dir_group_members[dir_group_start[group]]) : dir_base(d);
+    }
+    return dir_nodes[d].fold;
+}
+
+// FNV-1a sobre los bytes de la ruta
+unsigned int dir_hash(const char *path, int length) {
+    unsigned int hash = 2166136261u;
+    for (int i = 0; i < length; i++) {
+        hash = (hash ^ (unsigned char)path[i]) * 16777619u;
+    }
+    return hash;
+}
+
+void dir_table_grow(void) {
+    dir_table_size = dir_table_size > 0 ? dir_table_size * 2 : 4096;
+    free(dir_table);
+    dir_table = malloc(sizeof(int) * dir_table_size);
+    for (int i = 0; i < dir_table_size; i++) {
+        dir_table[i] = -1;
+    }
+    for (int d = 0; d < dir_count; d++) {
+        unsigned int slot = dir_hash(dir_nodes[d].path, dir_nodes[d].length) & (dir_table_size - 1);
+        while (dir_table[slot] != -1) {
+            slot = (slot + 1) & (dir_table_size - 1);
+        }
+        dir_table[slot] = d;
+    }
+}
+
+// Ordena las entradas por directorio y, dentro de cada uno, por nombre
+int compare_dir_entry(const void *a, const void *b) {
+    const DirEntry *ea = (const DirEntry *)a;
+    const DirEntry *eb = (const DirEntry *)b;
+    if (ea->parent != eb->parent) {
+        return ea->parent < eb->parent ? -1 : 1;
+    }
+    int length = ea->name_length < eb->name_length ? ea->name_length : eb->name_length;
+    int cmp = memcmp(ea->name, eb->name, length);
+    if (cmp != 0) {
+        return cmp;
+    }
+    return ea->name_length - eb->name_length;
+}
+
+// Los directorios más profundos primero, para que cada hijo esté listo antes que su padre
+int compare_dir_depth(const void *a, const void *b) {
+    return dir_nodes[*(const int *)b].depth - dir_nodes[*(const int *)a].depth;
+}
+
+// Un par de archivos ya queda explicado si ambos están en la misma posición
+// dentro de dos directorios del mismo grupo y esos directorios son una sola
+// copia informada: tienen la misma base (la copia de un antecesor los
+// explica) o uno de los dos tiene como base el original del grupo
+int pair_collapsed(int a, int b) {
+    if (!dir_mode || file_cover[a] == -1 || file_cover[b] == -1) {
+        return 0;
+    }
+    int da = file_cover[a], db = file_cover[b];
+    if (dir_nodes[da].group != dir_nodes[db].group ||
+        strcmp(file_path(a) + dir_nodes[da].length, file_path(b) + dir_nodes[db].length) != 0) {
+        return 0;
+    }
+    int original = dir_fold(da);
+    int base_a = dir_base(da), base_b = dir_base(db);
+    return base_a == base_b || base_a == original || base_b == original;
+}
+
+// Cada grupo se informa contra su primer miembro. Un miembro cuyo padre se
+// reduce a otra copia ya informada queda cubierto por esa copia: sólo se
+// informan las bases distintas del grupo, la primera como original. Así un
+// duplicado anidado dentro de un árbol duplicado se informa una vez, y un
+// grupo cuyas bases coinciden todas ya está explicado por sus padres.
+void report_duplicate_directories(void) {
+    int *bases = malloc(sizeof(int) * (dir_count > 0 ? dir_count : 1));
+    int *seen = calloc(dir_count > 0 ? dir_count : 1, sizeof(int)); // Grupo + 1 en el que ya se vio cada base
+    int reported = 0;
+
+    for (int pass = 0; pass < 2; pass++) {
+        if (pass == 1) {
+            printf("Se han encontrado %d directorios duplicados.\n", reported);
+            memset(seen, 0, sizeof(int) * dir_count);
+        }
+        for (int g = 0; g < dir_group_count; g++) {
+            int base_count = 0;
+            for (int i = dir_group_start[g]; i < dir_group_start[g + 1]; i++) {
+                int base = dir_base(dir_group_members[i]);
+                if (seen[base] != g + 1) {
+                    seen[base] = g + 1;
+                    bases[base_count++] = base;
+                }
+            }
+            for (int i = 1; i < base_count; i++) {
+                const DirNode *copy = &dir_nodes[bases[i]];
+                const DirNode *original = &dir_nodes[bases[0]];
+                if (pass == 0) {
+                    reported++;
+                } else {
+                    printf("El directorio %.*s es duplicado de %.*s (%d archivos, %llu bytes)\n",
+                           copy->length, copy->path, original->length, original->path,
+                           original->files, original->bytes);
+                }
+            }
+        }
+    }
+    free(seen);
+    free(bases);
+}
+
+// --estimate: con el recorrido y la agrupación por tamaño ya hechos, calcula
+// cuánto habría que leer y predice la duración de la etapa 2 a partir de una
+// calibración del hash en memoria y de una lectura de prueba por dispositivo.
+// Nada de esto lee más de ESTIMATE_PROBE_BYTES por dispositivo. Con -m x
+// se suma el prefiltro y se supone que ningún candidato se descarta, así
+// que la cifra es una cota superior.
+int run_estimate(int num_threads) {
+    double walk_seconds = seconds_since(&scan_start);
+    int candidates = 0;
+    unsigned long long prefilter_bytes = 0, full_bytes = 0;
+    for (int i = 0; i < catalog.count; i++) {
+        if ((catalog.flags[i] & FILE_CANDIDATE) && catalog.shared_with[i] < 0 && !(catalog.flags[i] & FILE_HASHED)) {
+            candidates++;
+            prefilter_bytes += prefilter_read_size(catalog.size[i]);
+            full_bytes += catalog.size[i];
+        }
+    }
+    double hash_rate = estimate_hash_rate();
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    printf("Estimación (sólo metadatos):\n");
+    printf("  Recorrido: %d archivos registrados en %.2f s%s\n", catalog.count, walk_seconds,
+           budget_expired ? " (incompleto: se agotó el presupuesto de tiempo)" : "");
+    printf("  A leer: %d archivos con tamaño repetido\n", candidates);
+    if (hash_mode == 'x') {
+        printf("  Prefiltro (primeros y últimos %d bytes): %llu bytes\n", FAST_PARTIAL_SIZE, prefilter_bytes);
+    } else {
+        printf("  Prefiltro: ninguno con -m %c\n", hash_mode);
+    }
+    printf("  Hash completo: %llu bytes\n", full_bytes);
+    printf("  %s en memoria: %.1f MB/s por hilo (%ld CPU)\n", hash_mode == 'b' ? "BLAKE3" : "MD5",
+           hash_rate / (1024 * 1024), cpus > 0 ? cpus : 1);
+
+    // Los dispositivos se leen en paralelo: manda el más lento, salvo que
+    // la CPU no alcance para calcular el MD5 de todo lo leído
+    double slowest = 0;
+    int total_threads = 0;
+    for (int d = 0; d < device_count; d++) {
+        DeviceQueue *queue = &devices[d];
+        unsigned long long bytes = 0;
+        for (int i = 0; i < queue->count; i++) {
+            bytes += catalog.size[queue->files[i]] + prefilter_read_size(catalog.size[queue->files[i]]);
+        }
+        int workers = queue->rotational ? rotational_depth : num_threads;
+        if (workers > queue->count) {
+            workers = queue->count;
+        }
+        total_threads += workers;
+
+        double read_rate, file_seconds;
+        probe_device(queue, &read_rate, &file_seconds);
+        if (bytes_bucket.rate > 0 && bytes_bucket.rate < read_rate) {
+            read_rate = bytes_bucket.rate;
+        }
+        if (files_bucket.rate > 0 && 1 / files_bucket.rate > file_seconds) {
+            file_seconds = 1 / files_bucket.rate;
+        }
+        // La prueba usa un solo hilo: en un disco rotacional más lecturas
+        // simultáneas no suman ancho de banda, en uno sin partes móviles sí
+        // reducen la latencia por archivo
+        double rate = queue->rotational ? read_rate : read_rate * workers;
+        double cpu_rate = hash_rate * workers;
+        double seconds = bytes / (rate < cpu_rate ? rate : cpu_rate) + queue->count * file_seconds / workers;
+        if (seconds > slowest) {
+            slowest = seconds;
+        }
+        printf("  Dispositivo %u:%u (%s): %d archivos, %llu bytes, %.1f MB/s, %.2f ms por archivo, %d hilos: ~%.1f s\n",
+               major(queue->dev), minor(queue->dev), queue->rotational ? "rotacional" : "no rotacional", queue->count,
+               bytes, read_rate / (1024 * 1024), file_seconds * 1000, workers, seconds);
+    }
+    int cpu_threads = total_threads < cpus || cpus <= 0 ? total_threads : (int)cpus;
+    // El hash rápido del prefiltro es mucho más barato: sólo cuenta su E/S
+    double cpu_seconds = cpu_threads > 0 ? full_bytes / (hash_rate * cpu_threads) : 0;
+    if (cpu_seconds > slowest) {
+        slowest = cpu_seconds;
+    }
+    printf("Tiempo estimado: ~%.1f s (recorrido %.1f s + hashing %.1f s), %llu bytes leídos con -t %d\n",
+           walk_seconds + slowest, walk_seconds, slowest, full_bytes + prefilter_bytes, num_threads);
+    return EXIT_SUCCESS;
+}
+
+// Bytes que lee el prefiltro de -m x de un archivo de size bytes: el
+// comienzo y el final, o el archivo entero si es más corto
+unsigned long long prefilter_read_size(off_t size) {
+    if (hash_mode != 'x') {
+        return 0;
+    }
+    return size > 2 * FAST_PARTIAL_SIZE ? 2 * FAST_PARTIAL_SIZE : (unsigned long long)size;
+}
+
+// Bytes por segundo que procesa el hash (MD5, o BLAKE3 con -m b) en un
+// hilo, medidos durante ESTIMATE_CALIBRATION_MS sobre un bloque en memoria
+double estimate_hash_rate(void) {
+    static unsigned char block[READ_BUF_SIZE];
+    DigestContext context;
+    unsigned char digest[16];
+    struct timespec start;
+    unsigned long long bytes = 0;
+    double seconds;
+
+    for (size_t i = 0; i < sizeof(block); i++) {
+        block[i] = (unsigned char)(i * 2654435761u >> 13);
+    }
+    digest_init(&context, hash_mode == 'b' ? DPL_DIGEST_BLAKE3 : DPL_DIGEST_MD5);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    do {
+        for (int i = 0; i < 16; i++) {
+            digest_update(&context, block, sizeof(block));
+        }
+        bytes += 16 * sizeof(block);
+        seconds = seconds_since(&start);
+    } while (seconds < ESTIMATE_CALIBRATION_MS / 1000.0);
+    digest_final(&context, digest);
+    return bytes / seconds;
+}
+
+// Lectura de prueba en un dispositivo: el ancho de banda se mide leyendo los
+// primeros archivos de la cola (los más grandes, por el orden de la etapa 2)
+// y el costo por archivo abriendo y leyendo el comienzo de los últimos.
+// Antes de leer se pide al kernel que descarte las páginas en caché, para
+// no medir la memoria en lugar del disco.
+void probe_device(const DeviceQueue *queue, double *read_rate, double *file_seconds) {
+    static unsigned char buffer[READ_BUF_SIZE];
+    struct timespec start;
+    unsigned long long bytes = 0;
+    double seconds = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < queue->count && bytes < ESTIMATE_PROBE_BYTES && seconds < 1; i++) {
+        int fd = open(file_path(queue->files[i]), O_RDONLY);
+        if (fd == -1) {
+            continue;
+        }
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        ssize_t n;
+        off_t pos = 0;
+        while (bytes < ESTIMATE_PROBE_BYTES && (n = pread(fd, buffer, sizeof(buffer), pos)) > 0) {
+            bytes += n;
+            pos += n;
+        }
+        close(fd);
+        seconds = seconds_since(&start);
+    }
+    *read_rate = bytes > 0 && seconds > 0 ? bytes / seconds : 1e12;
+
+    int opened = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = queue->count - 1; i >= 0 && opened < ESTIMATE_PROBE_FILES; i--) {
+        int fd = open(file_path(queue->files[i]), O_RDONLY);
+        if (fd == -1) {
+            continue;
+        }
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        if (pread(fd, buffer, PARTIAL_SIZE, 0) >= 0) {
+            opened++;
+        }
+        close(fd);
+    }
+    // El costo por archivo no incluye la transferencia, que ya cuenta el ancho de banda
+    *file_seconds = opened > 0 ? seconds_since(&start) / opened - PARTIAL_SIZE / *read_rate : 0;
+    if (*file_seconds < 0) {
+        *file_seconds = 0;
+    }
+}
+
+// Exporta un archivo por cada (tamaño, hash) al índice de dpl_index.h
+int export_index(const char *path) {
+    DplIndexEntry *entries = malloc(sizeof(DplIndexEntry) * (catalog.count > 0 ? catalog.count : 1));
+    size_t count = 0;
+
+    for (int i = 0; i < catalog.count; i++) {
+        if (catalog.flags[i] & FILE_HASHED) {
+            entries[count].size = (uint64_t)catalog.size[i];
+            memcpy(entries[count].digest, catalog.digest[i], 16);
+            if (digest_set & DPL_DIGEST_SHA256) {
+                memcpy(entries[count].sha256, catalog.sha256[i], 32);
+            }
+            entries[count].crc32c = digest_set & DPL_DIGEST_CRC32C ? catalog.crc32c[i] : 0;
+            entries[count].path = file_path(i);
+            count++;
+        }
+    }
+    char host[DPL_HOST_SIZE];
+    if (export_host != NULL) {
+        snprintf(host, sizeof(host), "%s", export_host);
+    } else if (gethostname(host, sizeof(host)) == -1) {
+        strcpy(host, "localhost");
+    }
+    host[sizeof(host) - 1] = '\0';
+
+    int result = dpl_index_write(path, host, digest_set, entries, count);
+    if (result == -1) {
+        perror(path);
+    }
+    free(entries);
+    return result;
+}
+
+// Guarda el estado del escaneo en un temporal y lo renombra: si el proceso
+// muere a mitad de la escritura queda el punto de control anterior. Se llama
+// con checkpoint_lock tomado para escribir, así que ningún hilo tiene una
+// entrada a medio procesar.
+int save_checkpoint(void) {
+    char tmp_path[MAX_PATH + 8];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", checkpoint_path);
+    FILE *out = fopen(tmp_path, "w");
+    if (out == NULL) {
+        perror("fopen");
+        return -1;
+    }
+
+    CheckpointHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+    header.phase = scan_phase;
+    header.frontier = scan_phase == CHECKPOINT_WALK ? to_visit.count : 0;
+    header.digests = digest_set;
+    header.blake3 = hash_mode == 'b';
+    header.file_count = catalog.count;
+    header.paths_size = catalog.paths_size;
+    snprintf(header.start_dir, sizeof(header.start_dir), "%s", checkpoint_dir);
+
+    size_t n = catalog.count;
+    int failed = fwrite(&header, sizeof(header), 1, out) != 1;
+    for (unsigned int i = 0; i < header.frontier; i++) {
+        const char *entry = file_list_get(&to_visit, (int)i);
+        failed |= fwrite(entry, strlen(entry) + 1, 1, out) != 1;
+    }
+    failed |= fwrite(catalog.size, sizeof(*catalog.size), n, out) != n;
+    failed |= fwrite(catalog.dev, sizeof(*catalog.dev), n, out) != n;
+    failed |= fwrite(catalog.ino, sizeof(*catalog.ino), n, out) != n;
+    failed |= fwrite(catalog.mtime, sizeof(*catalog.mtime), n, out) != n;
+    failed |= fwrite(catalog.path_id, sizeof(*catalog.path_id), n, out) != n;
+    failed |= fwrite(catalog.flags, sizeof(*catalog.flags), n, out) != n;
+    failed |= fwrite(catalog.digest, sizeof(*catalog.digest), n, out) != n;
+    if (digest_set & DPL_DIGEST_SHA256) {
+        failed |= fwrite(catalog.sha256, sizeof(*catalog.sha256), n, out) != n;
+    }
+    if (digest_set & DPL_DIGEST_CRC32C) {
+        failed |= fwrite(catalog.crc32c, sizeof(*catalog.crc32c), n, out) != n;
+    }
+    failed |= fwrite(catalog.paths, 1, catalog.paths_size, out) != catalog.paths_size;
+
+    if (fflush(out) != 0 || fsync(fileno(out)) == -1) {
+        failed = 1;
+    }
+    if (fclose(out) != 0 || failed || rename(tmp_path, checkpoint_path) == -1) {
+        perror(checkpoint_path);
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+// Carga el catálogo y los directorios pendientes del punto de control.
+// Los archivos ya leídos conservan su digest si siguen teniendo el mismo
+// inodo, tamaño y fecha de modificación; los que cambiaron se vuelven a leer
+// y los que ya no existen se descartan. Devuelve 1 si se cargó, 0 si el
+// archivo no existe o -1 ante un error.
+int load_checkpoint(const char *path, const char *start_dir) {
+    FILE *in = fopen(path, "r");
+    if (in == NULL) {
+        if (errno == ENOENT) {
+            fprintf(stderr, "No hay punto de control en %s: se empieza desde cero\n", path);
+            return 0;
+        }
+        perror("fopen");
+        return -1;
+    }
+
+    CheckpointHeader header;
+    if (fread(&header, sizeof(header), 1, in) != 1 || memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic)) != 0 ||
+        (header.phase != CHECKPOINT_WALK && header.phase != CHECKPOINT_HASH) ||
+        header.frontier > INT_MAX || header.file_count > INT_MAX) {
+        fprintf(stderr, "%s no es un punto de control válido\n", path);
+        fclose(in);
+        return -1;
+    }
+    header.start_dir[MAX_PATH - 1] = '\0';
+    if (strcmp(header.start_dir, start_dir) != 0) {
+        fprintf(stderr, "%s corresponde a otro directorio de inicio (%s)\n", path, header.start_dir);
+        fclose(in);
+        return -1;
+    }
+    if ((int)header.digests != digest_set) {
+        fprintf(stderr, "%s se hizo con otros --digests\n", path);
+        fclose(in);
+        return -1;
+    }
+    if (header.blake3 != (hash_mode == 'b')) {
+        fprintf(stderr, "%s se hizo con %s; hay que reanudar con el mismo algoritmo\n", path,
+                header.blake3 ? "-m b" : "MD5");
+        fclose(in);
+        return -1;
+    }
+
+    int failed = 0;
+    char entry[MAX_PATH];
+    for (unsigned int i = 0; i < header.frontier && !failed; i++) {
+        int len = 0, c;
+        while ((c = getc(in)) != EOF && c != '\0' && len < MAX_PATH - 1) {
+            entry[len++] = (char)c;
+        }
+        entry[len] = '\0';
+        failed = c != '\0';
+        if (!failed) {
+            add_to_visit(entry);
+        }
+    }
+
+    size_t n = header.file_count;
+    do {
+        catalog_grow();
+    } while ((size_t)catalog.capacity < n);
+    catalog.paths_capacity = header.paths_size > 0 ? header.paths_size : 1;
+    catalog.paths = malloc(catalog.paths_capacity);
+    if (catalog.paths == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    failed |= fread(catalog.size, sizeof(*catalog.size), n, in) != n;
+    failed |= fread(catalog.dev, sizeof(*catalog.dev), n, in) != n;
+    failed |= fread(catalog.ino, sizeof(*catalog.ino), n, in) != n;
+    failed |= fread(catalog.mtime, sizeof(*catalog.mtime), n, in) != n;
+    failed |= fread(catalog.path_id, sizeof(*catalog.path_id), n, in) != n;
+    failed |= fread(catalog.flags, sizeof(*catalog.flags), n, in) != n;
+    failed |= fread(catalog.digest, sizeof(*catalog.digest), n, in) != n;
+    if (digest_set & DPL_DIGEST_SHA256) {
+        failed |= fread(catalog.sha256, sizeof(*catalog.sha256), n, in) != n;
+    }
+    if (digest_set & DPL_DIGEST_CRC32C) {
+        failed |= fread(catalog.crc32c, sizeof(*catalog.crc32c), n, in) != n;
+    }
+    failed |= fread(catalog.paths, 1, header.paths_size, in) != header.paths_size;
+    fclose(in);
+    if (failed || (header.paths_size > 0 && catalog.paths[header.paths_size - 1] != '\0')) {
+        fprintf(stderr, "%s está incompleto\n", path);
+        return -1;
+    }
+    catalog.paths_size = header.paths_size;
+
+    int kept = 0, hashed = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (catalog.path_id[i] >= catalog.paths_size) {
+            fprintf(stderr, "%s está dañado\n", path);
+            return -1;
+        }
+        unsigned char flags = catalog.flags[i] & FILE_HASHED; // Los candidatos se recalculan
+        if (flags) {
+            struct stat statbuf;
+            if (stat(catalog.paths + catalog.path_id[i], &statbuf) == -1 || !S_ISREG(statbuf.st_mode) ||
+                statbuf.st_size == 0) {
+                continue;
+            }
+            if (statbuf.st_dev != catalog.dev[i] || statbuf.st_ino != catalog.ino[i] ||
+                statbuf.st_size != catalog.size[i] || statbuf.st_mtime != catalog.mtime[i]) {
+                catalog.size[i] = statbuf.st_size;
+                catalog.dev[i] = statbuf.st_dev;
+                catalog.ino[i] = statbuf.st_ino;
+                catalog.mtime[i] = statbuf.st_mtime;
+                flags = 0;
+            }
+        }
+        catalog.size[kept] = catalog.size[i];
+        catalog.dev[kept] = catalog.dev[i];
+        catalog.ino[kept] = catalog.ino[i];
+        catalog.mtime[kept] = catalog.mtime[i];
+        catalog.path_id[kept] = catalog.path_id[i];
+        memcpy(catalog.digest[kept], catalog.digest[i], 16);
+        if (digest_set & DPL_DIGEST_SHA256) {
+            memcpy(catalog.sha256[kept], catalog.sha256[i], 32);
+        }
+        if (digest_set & DPL_DIGEST_CRC32C) {
+            catalog.crc32c[kept] = catalog.crc32c[i];
+        }
+        catalog.flags[kept] = flags;
+        catalog.phys[kept] = 0;
+        catalog.shared_with[kept] = -1;
+        hashed += flags != 0;
+        kept++;
+    }
+    catalog.count = kept;
+    scan_phase = header.phase;
+
+    fprintf(stderr, "Reanudando desde %s: %d archivos registrados (%d ya leídos), %u entradas pendientes\n",
+            path, kept, hashed, header.frontier);
+    return 1;
+}
+
+// Guarda un punto de control cada checkpoint_interval segundos hasta que
+// termina la etapa 2
+void *checkpoint_thread(void *arg) {
+    (void)arg;
+
+    pthread_mutex_lock(&checkpoint_wait_lock);
+    while (!checkpoint_done) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += checkpoint_interval;
+        while (!checkpoint_done &&
+               pthread_cond_timedwait(&checkpoint_wake, &checkpoint_wait_lock, &deadline) != ETIMEDOUT) {
+        }
+        if (checkpoint_done) {
+            break;
+        }
+        pthread_mutex_unlock(&checkpoint_wait_lock);
+        pthread_rwlock_wrlock(&checkpoint_lock);
+        save_checkpoint();
+        pthread_rwlock_unlock(&checkpoint_lock);
+        pthread_mutex_lock(&checkpoint_wait_lock);
+    }
+    pthread_mutex_unlock(&checkpoint_wait_lock);
+    return NULL;
+}
+
+// dpl merge: mezcla las secciones ordenadas de varios índices con un
+// montículo de mínimos y escribe cada (tamaño, digest) que aparece en más de
+// un índice. Cada índice guarda un solo archivo por contenido, así que un
+// grupo nunca tiene más miembros que índices. La memoria usada depende sólo
+// del número de índices: los registros se leen del mapeo, en orden.
+int run_merge(int argc, char *argv[]) {
+    int count = argc - 1;
+    if (count < 2) {
+        fprintf(stderr, "Uso: dpl merge <indice> <indice>...\n");
+        return EXIT_FAILURE;
+    }
+
+    DplIndex *indexes = calloc(count, sizeof(DplIndex));
+    const DplIndexRecord **records = calloc(count, sizeof(DplIndexRecord *));
+    uint64_t *positions = calloc(count, sizeof(uint64_t));
+    int *heap = malloc(sizeof(int) * count);
+    int *members = malloc(sizeof(int) * count);
+    int heap_count = 0;
+    for (int i = 0; i < count; i++) {
+        if (dpl_index_open(&indexes[i], argv[i + 1]) == -1) {
+            perror(argv[i + 1]);
+            for (int j = 0; j < i; j++) {
+                dpl_index_close(&indexes[j]);
+            }
+            return EXIT_FAILURE;
+        }
+        records[i] = dpl_index_records(&indexes[i]);
+        if (indexes[i].header->entry_count > 0) {
+            heap[heap_count++] = i;
+        }
+    }
+    for (int pos = heap_count / 2 - 1; pos >= 0; pos--) {
+        merge_sift_down(indexes, positions, heap, heap_count, pos);
+    }
+
+    unsigned long long group_total = 0, file_total = 0, byte_total = 0;
+    while (heap_count > 0) {
+        // Sacar del montículo todas las cabezas iguales a la mínima
+        DplIndexRecord key = records[heap[0]][positions[heap[0]]];
+        int member_count = 0;
+        while (heap_count > 0 && dpl_index_compare_records(&records[heap[0]][positions[heap[0]]], &key) == 0) {
+            int i = heap[0];
+            members[member_count++] = i;
+            if (++positions[i] == indexes[i].header->entry_count) {
+                heap[0] = heap[--heap_count];
+            }
+            merge_sift_down(indexes, positions, heap, heap_count, 0);
+        }
+        if (member_count < 2) {
+            continue;
+        }
+
+        printf("# %d copias de %llu bytes (", member_count, (unsigned long long)key.size);
+        for (int b = 0; b < 16; b++) {
+            printf("%02x", key.digest[b]);
+        }
+        printf(")\n");
+        for (int m = 0; m < member_count; m++) {
+            int i = members[m];
+            const DplIndexRecord *record = &records[i][positions[i] - 1];
+            printf("%s:%s\n", indexes[i].header->host, indexes[i].paths + record->path);
+        }
+        printf("\n");
+        group_total++;
+        file_total += member_count;
+        byte_total += (unsigned long long)key.size * (member_count - 1);
+    }
+    fprintf(stderr, "Se han encontrado %llu grupos de duplicados entre índices (%llu archivos, %llu bytes repetidos).\n",
+            group_total, file_total, byte_total);
+
+    for (int i = 0; i < count; i++) {
+        dpl_index_close(&indexes[i]);
+    }
+    free(indexes);
+    free(records);
+    free(positions);
+    free(heap);
+    free(members);
+    return EXIT_SUCCESS;
+}
+
+int merge_less(const DplIndex *indexes, const uint64_t *positions, int a, int b) {
+    int cmp = dpl_index_compare_records(&indexes[a].records[positions[a]], &indexes[b].records[positions[b]]);
+    return cmp < 0 || (cmp == 0 && a < b); // A igual clave, el orden de los argumentos
+}
+
+void merge_sift_down(const DplIndex *indexes, const uint64_t *positions, int *heap, int heap_count, int pos) {
+    while (1) {
+        int smallest = pos;
+        int left = 2 * pos + 1, right = 2 * pos + 2;
+        if (left < heap_count && merge_less(indexes, positions, heap[left], heap[smallest])) {
+            smallest = left;
+        }
+        if (right < heap_count && merge_less(indexes, positions, heap[right], heap[smallest])) {
+            smallest = right;
+        }
+        if (smallest == pos) {
+            return;
+        }
+        int tmp = heap[pos];
+        heap[pos] = heap[smallest];
+        heap[smallest] = tmp;
+        pos = smallest;
+    }
+}
+
+// Modo --procs: las entradas del directorio inicial se reparten entre procs
+// procesos según el hash de su nombre. Cada hijo recorre y lee sólo lo suyo
+// con sus propios hilos, descriptores y memoria, y publica en las tablas
+// compartidas; el padre no lee archivos, sólo agrupa lo publicado. Si un
+// hijo muere, sus archivos quedan fuera y los demás terminan igual.
+int run_sharded(const char *start_dir, int num_threads) {
+    unsigned long long slots = 16;
+    while (slots < table_slots) {
+        slots *= 2;
+    }
+    size_t region = sizeof(ShardShared) + slots * sizeof(SizeSlot) + slots * sizeof(DigestSlot) +
+                    procs * sizeof(*shard_arrived);
+
+    int region_fd = memfd_create("dpl-shards", 0);
+    if (region_fd == -1) {
+        perror("memfd_create");
+        return EXIT_FAILURE;
+    }
+    if (ftruncate(region_fd, region) == -1) {
+        perror("ftruncate");
+        return EXIT_FAILURE;
+    }
+    // Las páginas de la región se asignan a medida que se tocan
+    void *base = mmap(NULL, region, PROT_READ | PROT_WRITE, MAP_SHARED, region_fd, 0);
+    close(region_fd);
+    if (base == MAP_FAILED) {
+        perror("mmap");
+        return EXIT_FAILURE;
+    }
+    shard_shared = (ShardShared *)base;
+    size_table = (SizeSlot *)((char *)base + sizeof(ShardShared));
+    digest_table = (DigestSlot *)((char *)size_table + slots * sizeof(SizeSlot));
+    shard_arrived = (_Atomic int *)((char *)digest_table + slots * sizeof(DigestSlot));
+    shard_shared->size_slots = slots;
+    shard_shared->digest_slots = slots;
+    sem_init(&shard_shared->arrived, 1, 0);
+    sem_init(&shard_shared->go, 1, 0);
+
+    // Entradas de primer nivel y el fragmento de cada una
+    DIR *dir = opendir(start_dir);
+    if (dir == NULL) {
+        perror("opendir");
+        return EXIT_FAILURE;
+    }
+    char **names = NULL;
+    int *name_shards = NULL;
+    int name_count = 0;
+    size_t name_capacity = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        if ((size_t)name_count == name_capacity) {
+            name_capacity = name_capacity > 0 ? name_capacity * 2 : 256;
+            names = realloc(names, sizeof(char *) * name_capacity);
+            name_shards = realloc(name_shards, sizeof(int) * name_capacity);
+        }
+        names[name_count] = strdup(entry->d_name);
+        name_shards[name_count] = dir_hash(entry->d_name, (int)strlen(entry->d_name)) % procs;
+        name_count++;
+    }
+    closedir(dir);
+
+    pid_t *pids = calloc(procs, sizeof(pid_t));
+    int *paths_fds = calloc(procs, sizeof(int));
+    int *failed = calloc(procs, sizeof(int));
+    char **blobs = calloc(procs, sizeof(char *));
+    size_t *blob_sizes = calloc(procs, sizeof(size_t));
+    fflush(stdout);
+    for (int p = 0; p < procs; p++) {
+        // El bloque de rutas de cada hijo vuelve al padre por este memfd
+        paths_fds[p] = memfd_create("dpl-paths", 0);
+        if (paths_fds[p] == -1) {
+            perror("memfd_create");
+            return EXIT_FAILURE;
+        }
+        pids[p] = fork();
+        if (pids[p] == -1) {
+            perror("fork");
+            failed[p] = 1;
+        } else if (pids[p] == 0) {
+            shard_child(p, start_dir, names, name_shards, name_count, num_threads, paths_fds[p]);
+        }
+    }
+
+    // Barrera entre la ronda de tamaños y la de hashes: se espera a que cada
+    // hijo haya llegado o haya muerto
+    while (1) {
+        int pending = 0, arrived = 0;
+        int status;
+        pid_t pid;
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            for (int p = 0; p < procs; p++) {
+                if (pids[p] == pid) {
+                    failed[p] = 1;
+                    pids[p] = 0;
+                }
+            }
+        }
+        for (int p = 0; p < procs; p++) {
+            if (atomic_load(&shard_arrived[p])) {
+                arrived++;
+            } else if (!failed[p]) {
+                pending++;
+            }
+        }
+        if (pending == 0) {
+            for (int i = 0; i < arrived; i++) {
+                sem_post(&shard_shared->go);
+            }
+            break;
+        }
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += SHARD_POLL_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        sem_timedwait(&shard_shared->arrived, &deadline);
+    }
+
+    for (int p = 0; p < procs; p++) {
+        int status;
+        if (pids[p] > 0 && (waitpid(pids[p], &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)) {
+            failed[p] = 1;
+        }
+        if (failed[p]) {
+            fprintf(stderr, "El proceso del fragmento %d falló; sus archivos no se compararon\n", p);
+        }
+    }
+
+    // Rutas de cada fragmento
+    for (int p = 0; p < procs; p++) {
+        struct stat statbuf;
+        if (!failed[p] && fstat(paths_fds[p], &statbuf) == 0 && statbuf.st_size > 0) {
+            blobs[p] = mmap(NULL, statbuf.st_size, PROT_READ, MAP_SHARED, paths_fds[p], 0);
+            blob_sizes[p] = statbuf.st_size;
+            if (blobs[p] == MAP_FAILED) {
+                blobs[p] = NULL;
+                failed[p] = 1;
+            }
+        }
+        close(paths_fds[p]);
+    }
+
+    // Agrupación final con el mismo radix sort que el modo normal
+    int key_count = 0, key_capacity = 1024;
+    SortKey *keys = malloc(sizeof(SortKey) * key_capacity);
+    for (unsigned long long slot = 0; slot < slots; slot++) {
+        DigestSlot *published = &digest_table[slot];
+        if (atomic_load(&published->state) != SLOT_READY || failed[published->shard]) {
+            continue;
+        }
+        if (key_count == key_capacity) {
+            key_capacity *= 2;
+            keys = realloc(keys, sizeof(SortKey) * key_capacity);
+        }
+        keys[key_count].size = published->size;
+        memcpy(keys[key_count].digest, published->digest, 16);
+        keys[key_count].index = (int)slot;
+        keys[key_count].pad = 0;
+        key_count++;
+    }
+    radix_sort(keys, key_count, 1);
+
+    for (int pass = 0; pass < 2; pass++) {
+        if (pass == 1) {
+            printf("Se han encontrado %lld archivos duplicados.\n", duplicate_count);
+        }
+        for (int start = 0; start < key_count;) {
+            int end = start + 1;
+            while (end < key_count && keys[end].size == keys[start].size &&
+                   memcmp(keys[end].digest, keys[start].digest, 16) == 0) {
+                end++;
+            }
+            int members = end - start;
+            if (pass == 0) {
+                duplicate_count += (long long)members * (members - 1) / 2;
+            } else if (members > 1) {
+                // Orden de salida estable: por fragmento y por orden de visita
+                qsort(&keys[start], members, sizeof(SortKey), compare_shard_member);
+                for (int i = start + 1; i < end; i++) {
+                    for (int j = start; j < i; j++) {
+                        const DigestSlot *a = &digest_table[keys[i].index];
+                        const DigestSlot *b = &digest_table[keys[j].index];
+                        printf("%s es duplicado de %s\n", blobs[a->shard] + a->path_id, blobs[b->shard] + b->path_id);
+                    }
+                }
+            }
+            start = end;
+        }
+    }
+
+    int any_failed = 0;
+    for (int p = 0; p < procs; p++) {
+        if (blobs[p] != NULL) {
+            munmap(blobs[p], blob_sizes[p]);
+        }
+        any_failed |= failed[p];
+    }
+    for (int i = 0; i < name_count; i++) {
+        free(names[i]);
+    }
+    free(names);
+    free(name_shards);
+    free(keys);
+    free(blobs);
+    free(blob_sizes);
+    free(pids);
+    free(paths_fds);
+    free(failed);
+    sem_destroy(&shard_shared->arrived);
+    sem_destroy(&shard_shared->go);
+    munmap(base, region);
+    return any_failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+// Proceso hijo de un fragmento: el mismo recorrido y la misma etapa de
+// hashing del modo normal, pero los candidatos salen de la tabla compartida
+// de tamaños, que cubre todos los fragmentos
+void shard_child(int shard, const char *start_dir, char **names, const int *name_shards, int name_count,
+                 int num_threads, int paths_fd) {
+    for (int i = 0; i < name_count; i++) {
+        if (name_shards[i] != shard) {
+            continue;
+        }
+        char full_path[MAX_PATH];
+        struct stat statbuf;
+        snprintf(full_path, sizeof(full_path), "%s/%s", start_dir, names[i]);
+        if (stat(full_path, &statbuf) == -1) {
+            perror("stat");
+        } else if (S_ISDIR(statbuf.st_mode)) {
+            add_to_visit(full_path);
+        } else {
+            visit_entry(full_path);
+        }
+    }
+    if (to_visit.count > 0) {
+        num_walkers = num_threads;
+        pthread_t threads[num_threads];
+        for (int i = 0; i < num_threads; i++) {
+            pthread_create(&threads[i], NULL, walk_directories, NULL);
+        }
+        for (int i = 0; i < num_threads; i++) {
+            pthread_join(threads[i], NULL);
+        }
+    }
+
+    // Ronda 1: tamaños
+    for (int i = 0; i < catalog.count; i++) {
+        if (size_table_add((unsigned long long)catalog.size[i]) == -1) {
+            fprintf(stderr, "Tabla de tamaños llena; aumente --table-slots\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    atomic_store(&shard_arrived[shard], 1);
+    sem_post(&shard_shared->arrived);
+    sem_wait(&shard_shared->go);
+
+    // Ronda 2: hashes de los archivos cuyo tamaño se repite en algún fragmento,
+    // con el rendimiento calculado sobre el total de archivos de ese tamaño
+    file_yield = malloc(sizeof(*file_yield) * (catalog.count + 1));
+    for (int i = 0; i < catalog.count; i++) {
+        unsigned int same_size = size_table_count((unsigned long long)catalog.size[i]);
+        file_yield[i] = (unsigned long long)catalog.size[i] * (same_size - 1);
+        if (same_size > 1) {
+            catalog.flags[i] |= FILE_CANDIDATE;
+        }
+    }
+    if (build_device_queues() == -1) {
+        exit(EXIT_FAILURE);
+    }
+    run_hash_stage(num_threads);
+    for (int i = 0; i < catalog.count; i++) {
+        if ((catalog.flags[i] & FILE_HASHED) &&
+            digest_table_add(shard, (unsigned long long)catalog.size[i], catalog.digest[i], catalog.path_id[i]) == -1) {
+            fprintf(stderr, "Tabla de hashes llena; aumente --table-slots\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    size_t written = 0;
+    while (written < catalog.paths_size) {
+        ssize_t n = write(paths_fd, catalog.paths + written, catalog.paths_size - written);
+        if (n <= 0) {
+            perror("write");
+            exit(EXIT_FAILURE);
+        }
+        written += n;
+    }
+    exit(EXIT_SUCCESS);
+}
+
+// Finalizador de splitmix64, para repartir tamaños parecidos entre slots
+unsigned long long mix_size(unsigned long long x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+int size_table_add(unsigned long long size) {
+    unsigned long long mask = shard_shared->size_slots - 1;
+    unsigned long long slot = mix_size(size) & mask;
+
+    for (unsigned long long probes = 0; probes <= mask; probes++, slot = (slot + 1) & mask) {
+        unsigned long long current = atomic_load(&size_table[slot].size);
+        if (current == 0) {
+            unsigned long long expected = 0;
+            if (atomic_compare_exchange_strong(&size_table[slot].size, &expected, size)) {
+                current = size;
+            } else {
+                current = expected; // Otro proceso ganó el slot; ver qué tamaño dejó
+            }
+        }
+        if (current == size) {
+            atomic_fetch_add(&size_table[slot].count, 1);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+unsigned int size_table_count(unsigned long long size) {
+    unsigned long long mask = shard_shared->size_slots - 1;
+    unsigned long long slot = mix_size(size) & mask;
+
+    for (unsigned long long probes = 0; probes <= mask; probes++, slot = (slot + 1) & mask) {
+        unsigned long long current = atomic_load(&size_table[slot].size);
+        if (current == 0) {
+            return 0;
+        }
+        if (current == size) {
+            return atomic_load(&size_table[slot].count);
+        }
+    }
+    return 0;
+}
+
+// Cada archivo ocupa su propio slot, a partir de la posición de su digest
+int digest_table_add(unsigned int shard, unsigned long long size, const unsigned char digest[16],
+                     unsigned long long path_id) {
+    unsigned long long mask = shard_shared->digest_slots - 1;
+    unsigned long long hash;
+    memcpy(&hash, digest, sizeof(hash));
+    unsigned long long slot = mix_size(hash ^ size) & mask;
+
+    for (unsigned long long probes = 0; probes <= mask; probes++, slot = (slot + 1) & mask) {
+        unsigned int expected = SLOT_FREE;
+        if (atomic_compare_exchange_strong(&digest_table[slot].state, &expected, SLOT_WRITING)) {
+            digest_table[slot].shard = shard;
+            digest_table[slot].size = size;
+            memcpy(digest_table[slot].digest, digest, 16);
+            digest_table[slot].path_id = path_id;
+            atomic_store(&digest_table[slot].state, SLOT_READY);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+int compare_shard_member(const void *a, const void *b) {
+    const DigestSlot *sa = &digest_table[((const SortKey *)a)->index];
+    const DigestSlot *sb = &digest_table[((const SortKey *)b)->index];
+    if (sa->shard != sb->shard) {
+        return sa->shard < sb->shard ? -1 : 1;
+    }
+    return sa->path_id < sb->path_id ? -1 : sa->path_id > sb->path_id;
+}
+
+// Servicio de hashing (--serve). Protocolo por el socket: el cliente envía
+// rutas absolutas terminadas en '\0' y cierra cada lote con una ruta vacía;
+// el servicio contesta una línea por ruta, en el mismo orden, con
+// "<md5> <ruta>" o "ERR <errno> <ruta>". Todas las lecturas pasan por una
+// única cola atendida por -t hilos, con los mismos limitadores de E/S.
+int run_daemon(const char *path, int num_threads) {
+    struct sockaddr_un address;
+
+    hash_mode = 'l'; // El servicio lee con md5-lib, nunca con el ejecutable
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Ruta de socket demasiado larga: %s\n", path);
+        return EXIT_FAILURE;
+    }
+    strcpy(address.sun_path, path);
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd == -1) {
+        perror("socket");
+        return EXIT_FAILURE;
+    }
+    unlink(path); // Un socket de una ejecución anterior
+    // El servicio responde por cualquier archivo que él pueda leer, así que
+    // sólo su dueño puede conectarse: el socket nace ya con permisos 0600
+    // (umask durante bind) para que no haya un momento en que otro usuario
+    // pueda conectarse y pedir el digest de archivos que no puede abrir
+    mode_t old_umask = umask(0077);
+    int bound = bind(listen_fd, (struct sockaddr *)&address, sizeof(address));
+    umask(old_umask);
+    if (bound == -1 || chmod(path, 0600) == -1 || listen(listen_fd, 64) == -1) {
+        perror("bind");
+        close(listen_fd);
+        return EXIT_FAILURE;
+    }
+
+    // Sin SA_RESTART, para que accept vuelva al recibir la señal
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_serve_stop;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    // writev no admite MSG_NOSIGNAL: un cliente que cierra no debe matar al servidor
+    sa.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &sa, NULL);
+
+    for (int i = 0; i < num_threads; i++) {
+        pthread_t worker;
+        pthread_create(&worker, NULL, serve_worker, NULL);
+        pthread_detach(worker);
+    }
+    fprintf(stderr, "Atendiendo pedidos de hash en %s con %d hilos de lectura\n", path, num_threads);
+
+    while (!serve_stop) {
+        int client_fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (client_fd == -1) {
+            if (errno != EINTR) {
+                perror("accept");
+            }
+            continue;
+        }
+        pthread_t client;
+        if (pthread_create(&client, NULL, serve_client, (void *)(long)client_fd) != 0) {
+            close(client_fd);
+            continue;
+        }
+        pthread_detach(client);
+    }
+
+    close(listen_fd);
+    unlink(path);
+    pthread_mutex_lock(&serve_lock);
+    fprintf(stderr, "Servicio terminado: %llu hashes de la caché, %llu compartidos con otro pedido, %llu leídos\n",
+            served_cached, served_shared, served_read);
+    pthread_mutex_unlock(&serve_lock);
+    return EXIT_SUCCESS;
+}
+
+void handle_serve_stop(int sig) {
+    (void)sig;
+    serve_stop = 1;
+}
+
+// Atiende los lotes de un cliente: primero encola todas las rutas del lote,
+// para que se lean en paralelo, y después contesta en orden
+void *serve_client(void *arg) {
+    int fd = (int)(long)arg;
+    char buffer[64 * 1024];
+    size_t used = 0;
+    char **batch = NULL;
+    HashJob **jobs = NULL;
+    char (*hashes)[HASH_SIZE] = NULL;
+    int *errors = NULL;
+    int batch_count = 0, batch_capacity = 0;
+
+    while (1) {
+        ssize_t n = read(fd, buffer + used, sizeof(buffer) - used);
+        if (n <= 0) {
+            break;
+        }
+        used += n;
+
+        size_t start = 0;
+        while (1) {
+            char *end = memchr(buffer + start, '\0', used - start);
+            if (end == NULL) {
+                break;
+            }
+            size_t length = end - (buffer + start);
+            if (length > 0) {
+                if (batch_count == batch_capacity) {
+                    batch_capacity = batch_capacity > 0 ? batch_capacity * 2 : 64;
+                    batch = realloc(batch, sizeof(char *) * batch_capacity);
+                    jobs = realloc(jobs, sizeof(HashJob *) * batch_capacity);
+                    hashes = realloc(hashes, sizeof(*hashes) * batch_capacity);
+                    errors = realloc(errors, sizeof(int) * batch_capacity);
+                }
+                int i = batch_count++;
+                struct stat statbuf;
+                batch[i] = strndup(buffer + start, length);
+                jobs[i] = NULL;
+                errors[i] = 0;
+                if (length >= MAX_PATH) {
+                    errors[i] = ENAMETOOLONG;
+                } else if (stat(batch[i], &statbuf) == -1) {
+                    errors[i] = errno;
+                } else if (!S_ISREG(statbuf.st_mode)) {
+                    errors[i] = EINVAL;
+                } else {
+                    jobs[i] = serve_submit(batch[i], &statbuf, hashes[i]);
+                }
+            } else {
+                // Fin del lote: esperar cada trabajo y contestar
+                for (int i = 0; i < batch_count; i++) {
+                    char head[64];
+                    if (jobs[i] != NULL) {
+                        pthread_mutex_lock(&serve_lock);
+                        while (!jobs[i]->done) {
+                            pthread_cond_wait(&job_done, &serve_lock);
+                        }
+                        if (jobs[i]->ok) {
+                            strcpy(hashes[i], jobs[i]->hash);
+                        } else {
+                            errors[i] = EIO;
+                        }
+                        if (--jobs[i]->waiters == 0) {
+                            free(jobs[i]);
+                        }
+                        pthread_mutex_unlock(&serve_lock);
+                    }
+                    if (errors[i] != 0) {
+                        snprintf(head, sizeof(head), "ERR %d ", errors[i]);
+                    } else {
+                        snprintf(head, sizeof(head), "%s ", hashes[i]);
+                    }
+                    struct iovec parts[3] = {
+                        {head, strlen(head)}, {batch[i], strlen(batch[i])}, {"\n", 1}
+                    };
+                    writev(fd, parts, 3);
+                    free(batch[i]);
+                }
+                batch_count = 0;
+            }
+            start += length + 1;
+        }
+        memmove(buffer, buffer + start, used - start);
+        used -= start;
+        if (used == sizeof(buffer)) {
+            break; // Una ruta sin terminar más larga que el buffer
+        }
+    }
+
+    // El cliente se fue a mitad de un lote: soltar los trabajos pendientes
+    for (int i = 0; i < batch_count; i++) {
+        if (jobs[i] != NULL) {
+            pthread_mutex_lock(&serve_lock);
+            while (!jobs[i]->done) {
+                pthread_cond_wait(&job_done, &serve_lock);
+            }
+            if (--jobs[i]->waiters == 0) {
+                free(jobs[i]);
+            }
+            pthread_mutex_unlock(&serve_lock);
+        }
+        free(batch[i]);
+    }
+    free(batch);
+    free(jobs);
+    free(hashes);
+    free(errors);
+    close(fd);
+    return NULL;
+}
+
+// Devuelve NULL si el digest estaba en la caché (y lo deja en hash_output),
+// o el trabajo que lo calculará: uno ya en curso para el mismo inodo o uno
+// nuevo al final de la cola
+HashJob *serve_submit(const char *path, const struct stat *statbuf, char *hash_output) {
+    pthread_mutex_lock(&serve_lock);
+    if (serve_cache_lookup(statbuf, hash_output)) {
+        served_cached++;
+        pthread_mutex_unlock(&serve_lock);
+        return NULL;
+    }
+    for (HashJob *job = busy_jobs; job != NULL; job = job->next_busy) {
+        if (job->dev == statbuf->st_dev && job->ino == statbuf->st_ino) {
+            job->waiters++;
+            served_shared++;
+            pthread_mutex_unlock(&serve_lock);
+            return job;
+        }
+    }
+
+    HashJob *job = calloc(1, sizeof(HashJob));
+    job->dev = statbuf->st_dev;
+    job->ino = statbuf->st_ino;
+    snprintf(job->path, sizeof(job->path), "%s", path);
+    job->waiters = 1;
+    job->next_busy = busy_jobs;
+    busy_jobs = job;
+    if (job_tail != NULL) {
+        job_tail->next = job;
+    } else {
+        job_head = job;
+    }
+    job_tail = job;
+    pthread_cond_signal(&job_ready);
+    pthread_mutex_unlock(&serve_lock);
+    return job;
+}
+
+void *serve_worker(void *arg) {
+    (void)arg;
+    if (idle_io) {
+        set_idle_io_priority();
+    }
+
+    while (1) {
+        pthread_mutex_lock(&serve_lock);
+        while (job_head == NULL) {
+            pthread_cond_wait(&job_ready, &serve_lock);
+        }
+        HashJob *job = job_head;
+        job_head = job->next;
+        if (job_head == NULL) {
+            job_tail = NULL;
+        }
+        pthread_mutex_unlock(&serve_lock);
+
+        // Si el archivo cambia mientras se lee, el resultado se entrega pero
+        // no se guarda en la caché
+        struct stat before, after;
+        check_limits_reload();
+        int ok = stat(job->path, &before) == 0 && hash_file(job->path, job->hash) &&
+                 stat(job->path, &after) == 0;
+
+        pthread_mutex_lock(&serve_lock);
+        job->ok = ok;
+        job->done = 1;
+        served_read++;
+        if (ok) {
+            serve_cache_store(&before, &after, job->hash);
+        }
+        for (HashJob **link = &busy_jobs; *link != NULL; link = &(*link)->next_busy) {
+            if (*link == job) {
+                *link = job->next_busy;
+                break;
+            }
+        }
+        pthread_cond_broadcast(&job_done);
+        pthread_mutex_unlock(&serve_lock);
+    }
+    return NULL;
+}
+
+// Se llaman con serve_lock tomado
+int serve_cache_lookup(const struct stat *statbuf, char *hash_output) {
+    unsigned int bucket = (unsigned int)(mix_size((unsigned long long)statbuf->st_ino ^
+                                                  ((unsigned long long)statbuf->st_dev << 32)) %
+                                         SERVE_CACHE_BUCKETS);
+    for (CacheEntry *entry = cache_buckets[bucket]; entry != NULL; entry = entry->next) {
+        if (entry->dev == statbuf->st_dev && entry->ino == statbuf->st_ino) {
+            if (entry->size != statbuf->st_size || entry->mtime.tv_sec != statbuf->st_mtim.tv_sec ||
+                entry->mtime.tv_nsec != statbuf->st_mtim.tv_nsec) {
+                return 0; // El archivo cambió: se vuelve a leer y se reemplaza
+            }
+            strcpy(hash_output, entry->hash);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void serve_cache_store(const struct stat *before, const struct stat *after, const char *hash) {
+    if (before->st_dev != after->st_dev || before->st_ino != after->st_ino || before->st_size != after->st_size ||
+        before->st_mtim.tv_sec != after->st_mtim.tv_sec || before->st_mtim.tv_nsec != after->st_mtim.tv_nsec) {
+        return;
+    }
+    unsigned int bucket = (unsigned int)(mix_size((unsigned long long)after->st_ino ^
+                                                  ((unsigned long long)after->st_dev << 32)) %
+                                         SERVE_CACHE_BUCKETS);
+    CacheEntry *entry;
+    for (entry = cache_buckets[bucket]; entry != NULL; entry = entry->next) {
+        if (entry->dev == after->st_dev && entry->ino == after->st_ino) {
+            break;
+        }
+    }
+    if (entry == NULL) {
+        if (cache_count >= max_index) {
+            return; // Caché llena: se siguen atendiendo pedidos, sin guardar
+        }
+        entry = malloc(sizeof(CacheEntry));
+        entry->dev = after->st_dev;
+        entry->ino = after->st_ino;
+        entry->next = cache_buckets[bucket];
+        cache_buckets[bucket] = entry;
+        cache_count++;
+    }
+    entry->size = after->st_size;
+    entry->mtime = after->st_mtim;
+    strcpy(entry->hash, hash);
+}
+
+// --chunks: se parten todos los archivos del recorrido salvo las copias
+// exactas ya informadas (de cada grupo sólo el primero) y los que ya
+// comparten extents. Cada hilo toma el siguiente archivo del catálogo y
+// agrega sus bloques al índice de una sola vez, al terminarlo.
+void run_chunk_stage(int num_threads) {
+    pthread_t threads[num_threads];
+    int created = 0;
+
+    chunk_skip = calloc(catalog.count + 1, 1);
+    for (int g = 0; g < group_count; g++) {
+        for (int i = 1; i < groups[g].count; i++) {
+            chunk_skip[groups[g].members[i]] = 1;
+        }
+    }
+    for (int i = 0; i < catalog.count; i++) {
+        chunk_skip[i] |= catalog.shared_with[i] >= 0;
+    }
+    chunk_next_file = 0;
+    for (int i = 0; i < num_threads; i++) {
+        if (pthread_create(&threads[created], NULL, chunk_worker, NULL) == 0) {
+            created++;
+        }
+    }
+    for (int i = 0; i < created; i++) {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+void *chunk_worker(void *arg) {
+    (void)arg;
+    unsigned char *buffer = malloc(CHUNK_BUF_SIZE);
+    ChunkRecord *records = NULL;
+    size_t count = 0, capacity = 0;
+
+    if (idle_io) {
+        set_idle_io_priority();
+    }
+    budget_register();
+    while (buffer != NULL && !budget_expired) {
+        pthread_mutex_lock(&chunk_lock);
+        while (chunk_next_file < catalog.count && chunk_skip[chunk_next_file]) {
+            chunk_next_file++;
+        }
+        int file = chunk_next_file < catalog.count ? chunk_next_file++ : -1;
+        pthread_mutex_unlock(&chunk_lock);
+        if (file == -1) {
+            break;
+        }
+
+        count = 0;
+        if (chunk_file(file, buffer, &records, &count, &capacity) == -1) {
+            continue; // Ilegible o interrumpido: el archivo no aporta bloques
+        }
+        pthread_mutex_lock(&chunk_lock);
+        if (chunk_count + count > chunk_capacity) {
+            chunk_capacity = chunk_capacity * 2 > chunk_count + count ? chunk_capacity * 2 : chunk_count + count;
+            chunk_records = realloc(chunk_records, sizeof(ChunkRecord) * chunk_capacity);
+            if (chunk_records == NULL) {
+                perror("realloc");
+                exit(EXIT_FAILURE);
+            }
+        }
+        memcpy(chunk_records + chunk_count, records, sizeof(ChunkRecord) * count);
+        chunk_count += count;
+        chunk_files++;
+        pthread_mutex_unlock(&chunk_lock);
+    }
+    budget_unregister();
+    free(records);
+    free(buffer);
+    return NULL;
+}
+
+// Lee el archivo con el mismo limitador que la etapa 2 y lo parte con
+// dpl_cdc_cut. El buffer se rellena cuando queda menos de un bloque máximo,
+// así que un corte sólo cae antes del final del buffer si es el del archivo.
+int chunk_file(int file, unsigned char *buffer, ChunkRecord **records, size_t *count, size_t *capacity) {
+    size_t filled = 0, pos = 0;
+    off_t offset = 0;
+    int eof = 0;
+
+    bucket_take(&files_bucket, 1);
+    int fd = open(file_path(file), O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+    while (1) {
+        if (!eof && filled - pos < DPL_CDC_MAX) {
+            memmove(buffer, buffer + pos, filled - pos);
+            filled -= pos;
+            pos = 0;
+            while (filled < CHUNK_BUF_SIZE && !eof) {
+                if (budget_expired) {
+                    close(fd);
+                    return -1;
+                }
+                ssize_t len = pread(fd, buffer + filled, CHUNK_BUF_SIZE - filled, offset);
+                if (len == -1) {
+                    close(fd);
+                    return -1;
+                }
+                bucket_take(&bytes_bucket, len);
+                eof = len == 0;
+                filled += len;
+                offset += len;
+            }
+        }
+        if (pos == filled) {
+            break;
+        }
+
+        size_t cut = dpl_cdc_cut(buffer + pos, filled - pos);
+        if (*count == *capacity) {
+            *capacity = *capacity > 0 ? *capacity * 2 : 1024;
+            *records = realloc(*records, sizeof(ChunkRecord) * *capacity);
+            if (*records == NULL) {
+                perror("realloc");
+                exit(EXIT_FAILURE);
+            }
+        }
+        ChunkRecord *record = &(*records)[(*count)++];
+        DplBlake3 context;
+        dpl_blake3_init(&context);
+        dpl_blake3_update(&context, buffer + pos, cut);
+        dpl_blake3_final(&context, record->digest, sizeof(record->digest));
+        record->size = (uint32_t)cut;
+        record->file = file;
+        pos += cut;
+    }
+    close(fd);
+    return 0;
+}
+
+// Por digest y, dentro de un mismo bloque, por archivo en orden de visita
+int compare_chunk(const void *a, const void *b) {
+    const ChunkRecord *ra = (const ChunkRecord *)a;
+    const ChunkRecord *rb = (const ChunkRecord *)b;
+    int order = memcmp(ra->digest, rb->digest, 16);
+    if (order != 0) {
+        return order;
+    }
+    return (ra->file > rb->file) - (ra->file < rb->file);
+}
+
+// Suma bytes al par (a, b) con a < b; la tabla usa direccionamiento abierto
+// y se duplica al llegar a 3/4
+void pair_add(int a, int b, unsigned long long bytes) {
+    if (pair_used * 4 >= pair_slots * 3) {
+        size_t old_slots = pair_slots;
+        unsigned long long *old_keys = pair_keys, *old_bytes = pair_bytes;
+        pair_slots = pair_slots > 0 ? pair_slots * 2 : 1024;
+        pair_keys = malloc(sizeof(*pair_keys) * pair_slots);
+        pair_bytes = calloc(pair_slots, sizeof(*pair_bytes));
+        if (pair_keys == NULL || pair_bytes == NULL) {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+        memset(pair_keys, 0xff, sizeof(*pair_keys) * pair_slots);
+        pair_used = 0;
+        for (size_t i = 0; i < old_slots; i++) {
+            if (old_keys[i] != ~0ULL) {
+                pair_add((int)(old_keys[i] >> 32), (int)(old_keys[i] & 0xffffffff), old_bytes[i]);
+            }
+        }
+        free(old_keys);
+        free(old_bytes);
+    }
+
+    unsigned long long key = (unsigned long long)a << 32 | (unsigned int)b;
+    size_t slot = mix_size(key) & (pair_slots - 1);
+    while (pair_keys[slot] != ~0ULL && pair_keys[slot] != key) {
+        slot = (slot + 1) & (pair_slots - 1);
+    }
+    if (pair_keys[slot] == ~0ULL) {
+        pair_keys[slot] = key;
+        pair_used++;
+    }
+    pair_bytes[slot] += bytes;
+}
+
+int compare_pair_bytes(const void *a, const void *b) {
+    unsigned long long ba = pair_bytes[*(const size_t *)a];
+    unsigned long long bb = pair_bytes[*(const size_t *)b];
+    return (ba < bb) - (ba > bb);
+}
+
+// Ordena el índice de bloques por digest. Cada bloque distinto cuenta una
+// vez para el total deduplicado; los que aparecen en varios archivos suman
+// su tamaño a cada par de esos archivos. Si son más de CHUNK_PAIR_LIMIT
+// (un bloque de ceros, por ejemplo) sólo se suma a los pares con el primero,
+// para no generar todos los pares posibles.
+void report_chunks(void) {
+    unsigned long long total = 0, unique = 0, distinct = 0;
+    int *files = NULL;
+    size_t files_capacity = 0;
+
+    qsort(chunk_records, chunk_count, sizeof(ChunkRecord), compare_chunk);
+    for (size_t start = 0; start < chunk_count;) {
+        size_t end = start + 1;
+        while (end < chunk_count && memcmp(chunk_records[end].digest, chunk_records[start].digest, 16) == 0) {
+            end++;
+        }
+        unique += chunk_records[start].size;
+        distinct++;
+        if (end - start > files_capacity) {
+            files_capacity = end - start;
+            files = realloc(files, sizeof(int) * files_capacity);
+        }
+        // Un archivo con el bloque repetido cuenta una sola vez por par
+        size_t file_count = 0;
+        for (size_t i = start; i < end; i++) {
+            total += chunk_records[i].size;
+            if (i == start || chunk_records[i].file != chunk_records[i - 1].file) {
+                files[file_count++] = chunk_records[i].file;
+            }
+        }
+        size_t paired = file_count <= CHUNK_PAIR_LIMIT ? file_count : 1;
+        for (size_t a = 0; a < paired; a++) {
+            for (size_t b = a + 1; b < file_count; b++) {
+                pair_add(files[a], files[b], chunk_records[start].size);
+            }
+        }
+        start = end;
+    }
+
+    printf("Bloques de contenido (FastCDC, entre %d y %d bytes, promedio %d): %llu archivos, %llu bytes en %zu bloques, "
+           "%llu distintos.\n", DPL_CDC_MIN, DPL_CDC_MAX, DPL_CDC_AVG, chunk_files, total, chunk_count, distinct);
+    printf("Deduplicando por bloques se ahorrarían %llu bytes (%.1f%%).\n", total - unique,
+           total > 0 ? 100.0 * (total - unique) / total : 0.0);
+
+    free(files);
+
+    size_t *order = malloc(sizeof(size_t) * (pair_used > 0 ? pair_used : 1));
+    size_t pairs = 0;
+    for (size_t i = 0; i < pair_slots; i++) {
+        if (pair_keys[i] != ~0ULL) {
+            order[pairs++] = i;
+        }
+    }
+    qsort(order, pairs, sizeof(size_t), compare_pair_bytes);
+    printf("Se han encontrado %zu pares de archivos distintos con datos en común.\n", pairs);
+    for (size_t i = 0; i < pairs; i++) {
+        int a = (int)(pair_keys[order[i]] >> 32);
+        int b = (int)(pair_keys[order[i]] & 0xffffffff);
+        unsigned long long smaller = catalog.size[a] < catalog.size[b] ? catalog.size[a] : catalog.size[b];
+        printf("%s comparte %llu bytes con %s (%.1f%% del menor)\n", file_path(b), pair_bytes[order[i]],
+               file_path(a), smaller > 0 ? 100.0 * pair_bytes[order[i]] / smaller : 0.0);
+    }
+    free(order);
+}
+
+// Los grupos se reparten entre num_threads hilos; cada grupo lo procesa un
+// único hilo de principio a fin
+void run_dedupe_stage(int num_threads) {
+    pthread_t threads[num_threads];
+    int created = 0;
+
+    next_group = 0;
+    for (int i = 0; i < num_threads; i++) {
+        if (pthread_create(&threads[created], NULL, dedupe_worker, NULL) == 0) {
+            created++;
+        }
+    }
+    for (int i = 0; i < created; i++) {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+void *dedupe_worker(void *arg) {
+    (void)arg;
+
+    if (idle_io) {
+        set_idle_io_priority();
+    }
+
+    while (1) {
+        pthread_mutex_lock(&action_lock);
+        int index = next_group < group_count ? next_group++ : -1;
+        pthread_mutex_unlock(&action_lock);
+        if (index == -1) {
+            break;
+        }
+        dedupe_group(&groups[index]);
+    }
+    return NULL;
+}
+
+// FIDEDUPERANGE sólo funciona dentro de un mismo sistema de archivos, así que
+// el grupo se parte por st_dev y en cada parte el primer archivo visitado es
+// el que se conserva
+void dedupe_group(const DupGroup *group) {
+    int *pending = malloc(sizeof(int) * group->count);
+    int *done = calloc(group->count, sizeof(int));
+
+    for (int k = 0; k < group->count; k++) {
+        if (done[k]) {
+            continue;
+        }
+        int keeper = group->members[k];
+        int count = 0;
+        for (int m = k + 1; m < group->count; m++) {
+            int member = group->members[m];
+            if (done[m] || catalog.dev[member] != catalog.dev[keeper]) {
+                continue;
+            }
+            done[m] = 1;
+            // Otro nombre del mismo inodo: no hay nada que compartir
+            if (catalog.ino[member] != catalog.ino[keeper]) {
+                pending[count++] = member;
+            }
+        }
+        for (int start = 0; start < count; start += DEDUPE_BATCH) {
+            int batch = count - start < DEDUPE_BATCH ? count - start : DEDUPE_BATCH;
+            dedupe_batch(keeper, &pending[start], batch);
+        }
+    }
+    free(pending);
+    free(done);
+}
+
+// Deduplica hasta DEDUPE_BATCH miembros contra keeper en una sola llamada por
+// bloque de DEDUPE_CHUNK bytes. El kernel compara el contenido y comparte los
+// extents de forma atómica, así que un archivo modificado después del hash
+// simplemente se reporta como distinto.
+int dedupe_batch(int keeper, const int *members, int count) {
+    const char *source_path = file_path(keeper);
+    off_t source_size = catalog.size[keeper];
+    int fds[DEDUPE_BATCH];
+    int failed[DEDUPE_BATCH] = {0};
+    int unsupported[DEDUPE_BATCH] = {0};
+
+    if (dry_run) {
+        for (int i = 0; i < count; i++) {
+            printf("[simulación] %s compartiría sus datos con %s\n", file_path(members[i]), source_path);
+            pthread_mutex_lock(&action_lock);
+            deduped_files++;
+            deduped_bytes += source_size;
+            pthread_mutex_unlock(&action_lock);
+        }
+        return 0;
+    }
+
+    int src_fd = open(source_path, O_RDONLY);
+    if (src_fd == -1) {
+        perror("open");
+        pthread_mutex_lock(&action_lock);
+        failed_files += count;
+        pthread_mutex_unlock(&action_lock);
+        return -1;
+    }
+
+    struct file_dedupe_range *range = calloc(1, sizeof(struct file_dedupe_range) +
+                                                count * sizeof(struct file_dedupe_range_info));
+    if (range == NULL) {
+        perror("calloc");
+        close(src_fd);
+        pthread_mutex_lock(&action_lock);
+        failed_files += count;
+        pthread_mutex_unlock(&action_lock);
+        return -1;
+    }
+    for (int i = 0; i < count; i++) {
+        // El kernel acepta un destino de sólo lectura si somos sus dueños
+        fds[i] = open(file_path(members[i]), O_RDWR);
+        if (fds[i] == -1) {
+            fds[i] = open(file_path(members[i]), O_RDONLY);
+        }
+        int open_err = errno;
+        journal_entry("PLAN", "dedupe", keeper, members[i], NULL);
+        if (fds[i] == -1) {
+            failed[i] = 1;
+            journal_entry("FAIL", "dedupe", keeper, members[i], strerror(open_err));
+        }
+    }
+
+    for (off_t offset = 0; offset < source_size; offset += DEDUPE_CHUNK) {
+        off_t length = source_size - offset < DEDUPE_CHUNK ? source_size - offset : DEDUPE_CHUNK;
+        int dest_count = 0;
+        int slot[DEDUPE_BATCH];
+        for (int i = 0; i < count; i++) {
+            if (!failed[i] && !unsupported[i]) {
+                range->info[dest_count].dest_fd = fds[i];
+                range->info[dest_count].dest_offset = offset;
+                slot[dest_count++] = i;
+            }
+        }
+        if (dest_count == 0) {
+            break;
+        }
+        range->src_offset = offset;
+        range->src_length = length;
+        range->dest_count = dest_count;
+
+        if (ioctl(src_fd, FIDEDUPERANGE, range) == -1) {
+            int err = errno;
+            for (int d = 0; d < dest_count; d++) {
+                // Sistema sin soporte: se puede recurrir a hardlinks. EINVAL no
+                // entra aquí: es un rango inválido o un solapamiento en el
+                // mismo inodo, no una falta de soporte
+                if (err == EOPNOTSUPP || err == ENOTTY || err == EXDEV) {
+                    unsupported[slot[d]] = 1;
+                } else {
+                    failed[slot[d]] = 1;
+                    journal_entry("FAIL", "dedupe", keeper, members[slot[d]], strerror(err));
+                }
+            }
+            continue;
+        }
+        for (int d = 0; d < dest_count; d++) {
+            struct file_dedupe_range_info *info = &range->info[d];
+            if (info->status == FILE_DEDUPE_RANGE_SAME) {
+                pthread_mutex_lock(&action_lock);
+                deduped_bytes += info->bytes_deduped;
+                pthread_mutex_unlock(&action_lock);
+                // El kernel puede compartir menos bytes que los pedidos: el
+                // resto del bloque se completa antes de pasar al siguiente
+                const char *reason;
+                if ((off_t)info->bytes_deduped < length &&
+                    dedupe_remainder(src_fd, fds[slot[d]], offset + info->bytes_deduped, offset + length, &reason) == -1) {
+                    failed[slot[d]] = 1;
+                    journal_entry("FAIL", "dedupe", keeper, members[slot[d]], reason);
+                }
+            } else {
+                failed[slot[d]] = 1;
+                journal_entry("FAIL", "dedupe", keeper, members[slot[d]],
+                              info->status == FILE_DEDUPE_RANGE_DIFFERS ? "contenido distinto" : strerror(-info->status));
+            }
+        }
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (fds[i] != -1) {
+            close(fds[i]);
+        }
+        if (unsupported[i] && hardlink_fallback) {
+            journal_entry("FAIL", "dedupe", keeper, members[i], "FIDEDUPERANGE no soportado");
+            replace_with_hardlink(keeper, members[i]);
+            continue;
+        }
+        pthread_mutex_lock(&action_lock);
+        if (failed[i] || unsupported[i]) {
+            failed_files++;
+        } else {
+            deduped_files++;
+        }
+        pthread_mutex_unlock(&action_lock);
+        if (!failed[i] && !unsupported[i]) {
+            journal_entry("DONE", "dedupe", keeper, members[i], NULL);
+        } else if (unsupported[i]) {
+            journal_entry("FAIL", "dedupe", keeper, members[i], "FIDEDUPERANGE no soportado");
+        }
+    }
+    free(range);
+    close(src_fd);
+    return 0;
+}
+
+// Completa [start, end) de un bloque que FIDEDUPERANGE compartió sólo en
+// parte, pidiendo al kernel el resto hasta que no quede nada. Devuelve -1
+// (con el motivo en reason) si el resto no se pudo compartir.
+int dedupe_remainder(int src_fd, int dest_fd, off_t start, off_t end, const char **reason) {
+    struct file_dedupe_range *range = calloc(1, sizeof(struct file_dedupe_range) +
+                                                sizeof(struct file_dedupe_range_info));
+    int result = 0;
+
+    if (range == NULL) {
+        *reason = strerror(ENOMEM);
+        return -1;
+    }
+    while (start < end) {
+        range->src_offset = start;
+        range->src_length = end - start;
+        range->dest_count = 1;
+        range->info[0].dest_fd = dest_fd;
+        range->info[0].dest_offset = start;
+        if (ioctl(src_fd, FIDEDUPERANGE, range) == -1) {
+            *reason = strerror(errno);
+            result = -1;
+            break;
+        }
+        if (range->info[0].status != FILE_DEDUPE_RANGE_SAME) {
+            *reason = range->info[0].status == FILE_DEDUPE_RANGE_DIFFERS ? "contenido distinto"
+                                                                         : strerror(-range->info[0].status);
+            result = -1;
+            break;
+        }
+        if (range->info[0].bytes_deduped == 0) {
+            *reason = "deduplicación incompleta";
+            result = -1;
+            break;
+        }
+        pthread_mutex_lock(&action_lock);
+        deduped_bytes += range->info[0].bytes_deduped;
+        pthread_mutex_unlock(&action_lock);
+        start += range->info[0].bytes_deduped;
+    }
+    free(range);
+    return result;
+}
+
+// Reemplaza member por un hardlink a keeper. El contenido se compara byte a
+// byte antes (no hay un kernel que lo verifique) y el reemplazo es atómico:
+// el enlace se crea con un nombre temporal y luego se renombra encima.
+int replace_with_hardlink(int keeper, int member) {
+    const char *keeper_path = file_path(keeper);
+    const char *member_path = file_path(member);
+    char tmp_path[MAX_PATH + 32];
+    struct stat keeper_stat, member_stat;
+    int result = -1;
+
+    // Si ya son el mismo inodo, link+rename no haría nada: rename(2) devuelve
+    // éxito sin tocar el nombre temporal cuando ambos apuntan al mismo archivo
+    if (lstat(keeper_path, &keeper_stat) == 0 && lstat(member_path, &member_stat) == 0 &&
+        keeper_stat.st_dev == member_stat.st_dev && keeper_stat.st_ino == member_stat.st_ino) {
+        return 0;
+    }
+
+    journal_entry("PLAN", "hardlink", keeper, member, NULL);
+    if (files_identical(keeper_path, member_path) != 1) {
+        journal_entry("FAIL", "hardlink", keeper, member, "contenido distinto");
+    } else {
+        snprintf(tmp_path, sizeof(tmp_path), "%s.dpl-tmp.%ld", member_path, (long)getpid());
+        if (link(keeper_path, tmp_path) == -1) {
+            journal_entry("FAIL", "hardlink", keeper, member, strerror(errno));
+        } else if (rename(tmp_path, member_path) == -1) {
+            journal_entry("FAIL", "hardlink", keeper, member, strerror(errno));
+            unlink(tmp_path);
+        } else {
+            // Por si rename no retiró el nombre temporal (mismo inodo)
+            if (lstat(tmp_path, &member_stat) == 0) {
+                unlink(tmp_path);
+            }
+            journal_entry("DONE", "hardlink", keeper, member, NULL);
+            result = 0;
+        }
+    }
+
+    pthread_mutex_lock(&action_lock);
+    if (result == 0) {
+        linked_files++;
+    } else {
+        failed_files++;
+    }
+    pthread_mutex_unlock(&action_lock);
+    return result;
+}
+
+// Devuelve 1 si ambos archivos tienen el mismo contenido, 0 si no, -1 si error
+int files_identical(const char *path1, const char *path2) {
+    unsigned char buffer1[READ_BUF_SIZE], buffer2[READ_BUF_SIZE];
+    int result = 1;
+
+    int fd1 = open(path1, O_RDONLY);
+    int fd2 = open(path2, O_RDONLY);
+    if (fd1 == -1 || fd2 == -1) {
+        result = -1;
+    }
+    while (result == 1) {
+        ssize_t len1 = read(fd1, buffer1, sizeof(buffer1));
+        ssize_t len2 = len1 > 0 ? read(fd2, buffer2, (size_t)len1) : read(fd2, buffer2, 1);
+        if (len1 == -1 || len2 == -1) {
+            result = -1;
+        } else if (len1 != len2 || memcmp(buffer1, buffer2, (size_t)len1) != 0) {
+            result = 0;
+        } else if (len1 == 0) {
+            break;
+        } else {
+            bucket_take(&bytes_bucket, 2.0 * len1);
+        }
+    }
+    if (fd1 != -1) {
+        close(fd1);
+    }
+    if (fd2 != -1) {
+        close(fd2);
+    }
+    return result;
+}
+
+// Cada acción se registra como PLAN antes de tocar el archivo y como DONE o
+// FAIL después, con los metadatos originales del archivo reemplazado (modo,
+// dueño y mtime). Una línea PLAN sin DONE identifica una acción interrumpida;
+// con los metadatos se puede deshacer un hardlink copiando el archivo
+// conservado y restaurando modo, dueño y fechas.
+void journal_entry(const char *state, const char *action, int keeper, int member, const char *detail) {
+    if (journal == NULL) {
+        return;
+    }
+    struct stat statbuf;
+    memset(&statbuf, 0, sizeof(statbuf));
+    stat(file_path(member), &statbuf);
+
+    pthread_mutex_lock(&action_lock);
+    fprintf(journal, "%s\t%s\t%s\t%s\t%lld\t%lld\t%o\t%u:%u\t%s\n", state, action,
+            file_path(keeper), file_path(member), (long long)catalog.size[member],
+            (long long)statbuf.st_mtime, (unsigned int)statbuf.st_mode, (unsigned int)statbuf.st_uid,
+            (unsigned int)statbuf.st_gid, detail != NULL ? detail : "");
+    fflush(journal);
+    fsync(fileno(journal));
+    pthread_mutex_unlock(&action_lock);
+}
+
+// Inicia la vigilancia. fanotify marca el montaje completo y no necesita un
+// descriptor por directorio, pero requiere CAP_SYS_ADMIN; sin permisos se
+// usa inotify con una marca por directorio, acotada por --max-watches.
+int watch_init(const char *start_dir) {
+    if (realpath(start_dir, watch_root) == NULL) {
+        perror("realpath");
+        return -1;
+    }
+
+    watch_fd = fanotify_init(FAN_CLASS_NOTIF | FAN_CLOEXEC, O_RDONLY | O_LARGEFILE);
+    if (watch_fd != -1) {
+        if (fanotify_mark(watch_fd, FAN_MARK_ADD | FAN_MARK_MOUNT, FAN_CLOSE_WRITE, AT_FDCWD, watch_root) == 0) {
+            watch_fanotify = 1;
+            return 0;
+        }
+        close(watch_fd);
+    }
+
+    watch_fd = inotify_init1(IN_CLOEXEC);
+    if (watch_fd == -1) {
+        perror("inotify_init1");
+        return -1;
+    }
+    if (max_watches == 0) {
+        FILE *file = fopen("/proc/sys/fs/inotify/max_user_watches", "r");
+        if (file == NULL || fscanf(file, "%d", &max_watches) != 1) {
+            max_watches = 8192;
+        }
+        if (file != NULL) {
+            fclose(file);
+        }
+        max_watches -= max_watches / 10; // Dejar margen a otros procesos del usuario
+    }
+    return 0;
+}
+
+void watch_directory(const char *path) {
+    pthread_mutex_lock(&watch_lock);
+    if (watch_count >= max_watches) {
+        if (watch_count == max_watches) {
+            fprintf(stderr, "Límite de %d directorios vigilados alcanzado; los demás no se vigilan\n", max_watches);
+            watch_count++; // Avisar una sola vez
+        }
+        pthread_mutex_unlock(&watch_lock);
+        return;
+    }
+    int wd = inotify_add_watch(watch_fd, path, IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_ONLYDIR);
+    if (wd == -1) {
+        pthread_mutex_unlock(&watch_lock);
+        perror("inotify_add_watch");
+        return;
+    }
+    if (wd >= watch_capacity) {
+        int capacity = watch_capacity > 0 ? watch_capacity : 1024;
+        while (capacity <= wd) {
+            capacity *= 2;
+        }
+        watch_paths = realloc(watch_paths, sizeof(char *) * capacity);
+        memset(&watch_paths[watch_capacity], 0, sizeof(char *) * (capacity - watch_capacity));
+        watch_capacity = capacity;
+    }
+    if (watch_paths[wd] == NULL) {
+        watch_count++;
+    }
+    free(watch_paths[wd]); // Un directorio renombrado reutiliza su wd
+    watch_paths[wd] = strdup(path);
+    pthread_mutex_unlock(&watch_lock);
+}
+
+// Directorio nuevo durante la vigilancia: se marca y se procesa su contenido,
+// que pudo crearse antes de que la marca existiera
+void watch_scan_directory(const char *path) {
+    if (!watch_fanotify) {
+        watch_directory(path);
+    }
+    DIR *dir = opendir(path);
+    if (dir == NULL) {
+        return;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        char full_path[MAX_PATH];
+        struct stat statbuf;
+        snprintf(full_path, sizeof(full_path), "%s/%s", path, entry->d_name);
+        if (stat(full_path, &statbuf) == -1) {
+            continue;
+        }
+        if (S_ISDIR(statbuf.st_mode)) {
+            watch_scan_directory(full_path);
+        } else {
+            watch_process_file(full_path);
+        }
+    }
+    closedir(dir);
+}
+
+void run_watch_loop(void) {
+    char buffer[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len;
+
+    printf("Vigilando %s con %s...\n", watch_root, watch_fanotify ? "fanotify" : "inotify");
+    fflush(stdout);
+
+    while ((len = read(watch_fd, buffer, sizeof(buffer))) != 0) {
+        if (len == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("read");
+            break;
+        }
+
+        if (watch_fanotify) {
+            struct fanotify_event_metadata *event = (struct fanotify_event_metadata *)buffer;
+            size_t root_len = strlen(watch_root);
+            for (; FAN_EVENT_OK(event, len); event = FAN_EVENT_NEXT(event, len)) {
+                if (event->fd < 0) {
+                    continue; // FAN_NOFD: cola desbordada
+                }
+                char link[64], path[MAX_PATH];
+                snprintf(link, sizeof(link), "/proc/self/fd/%d", event->fd);
+                ssize_t path_len = readlink(link, path, sizeof(path) - 1);
+                close(event->fd);
+                if (path_len <= 0) {
+                    continue;
+                }
+                path[path_len] = '\0';
+                // La marca cubre todo el montaje: quedarse sólo con el árbol pedido
+                if (strncmp(path, watch_root, root_len) == 0 && (path[root_len] == '/' || path[root_len] == '\0')) {
+                    watch_process_file(path);
+                }
+            }
+            continue;
+        }
+
+        for (char *ptr = buffer; ptr < buffer + len;) {
+            struct inotify_event *event = (struct inotify_event *)ptr;
+            ptr += sizeof(struct inotify_event) + event->len;
+
+            if (event->mask & IN_Q_OVERFLOW) {
+                fprintf(stderr, "Se perdieron eventos de inotify; conviene volver a escanear\n");
+                continue;
+            }
+            if (event->mask & IN_IGNORED) {
+                // El directorio se borró: liberar su ranura
+                pthread_mutex_lock(&watch_lock);
+                if (event->wd < watch_capacity && watch_paths[event->wd] != NULL) {
+                    free(watch_paths[event->wd]);
+                    watch_paths[event->wd] = NULL;
+                    watch_count--;
+                }
+                pthread_mutex_unlock(&watch_lock);
+                continue;
+            }
+            if (event->len == 0 || event->wd >= watch_capacity || watch_paths[event->wd] == NULL) {
+                continue;
+            }
+
+            char full_path[MAX_PATH];
+            snprintf(full_path, sizeof(full_path), "%s/%s", watch_paths[event->wd], event->name);
+            if (event->mask & IN_ISDIR) {
+                if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+                    watch_scan_directory(full_path);
+                }
+            } else if (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
+                watch_process_file(full_path);
+            }
+        }
+    }
+}
+
+// Compara un archivo creado o modificado contra el índice. Sólo se lee si ya
+// hay otra entrada del mismo tamaño; las entradas de tamaño único del
+// escaneo inicial se leen de forma diferida la primera vez que hace falta.
+void watch_process_file(const char *path) {
+    struct stat statbuf;
+    char hash[HASH_SIZE];
+    unsigned char digest[16];
+
+    if (stat(path, &statbuf) == -1 || !S_ISREG(statbuf.st_mode) || statbuf.st_size == 0) {
+        return;
+    }
+
+    unsigned int bucket = index_bucket(statbuf.st_size);
+    int self = -1, same_size = 0;
+    for (int e = index_buckets[bucket]; e != -1; e = index_entries[e].next) {
+        if (index_entries[e].size == statbuf.st_size) {
+            same_size = 1;
+            if (strcmp(index_blob + index_entries[e].path, path) == 0) {
+                self = e;
+            }
+        }
+    }
+    if (!same_size) {
+        index_insert(path, statbuf.st_size, statbuf.st_mtime, NULL);
+        return;
+    }
+    if (!hash_file(path, hash) || hex_to_digest(hash, digest) == -1) {
+        return;
+    }
+
+    int matched = 0;
+    for (int e = index_buckets[bucket]; e != -1;) {
+        IndexEntry *entry = &index_entries[e];
+        int next = entry->next;
+        if (e != self && entry->size == statbuf.st_size && index_refresh(entry)) {
+            if (entry->hashed && memcmp(entry->digest, digest, 16) == 0) {
+                printf("Nuevo duplicado: %s es duplicado de %s\n", path, index_blob + entry->path);
+                fflush(stdout);
+                matched = 1;
+                break;
+            }
+        }
+        e = next;
+    }
+
+    if (self != -1) {
+        IndexEntry *entry = &index_entries[self];
+        memcpy(entry->digest, digest, 16);
+        entry->hashed = 1;
+        entry->mtime = statbuf.st_mtime;
+    } else if (!matched) {
+        index_insert(path, statbuf.st_size, statbuf.st_mtime, digest);
+    }
+}
+
+// Carga en el índice el resultado del escaneo: un representante por cada
+// (tamaño, hash) y los archivos de tamaño único sin hash
+void build_watch_index(void) {
+    index_grow_buckets();
+    for (int i = 0; i < catalog.count; i++) {
+        if (catalog.shared_with[i] >= 0) {
+            continue;
+        }
+        if (catalog.flags[i] & FILE_HASHED) {
+            int duplicate = 0;
+            for (int e = index_buckets[index_bucket(catalog.size[i])]; e != -1; e = index_entries[e].next) {
+                if (index_entries[e].size == catalog.size[i] && index_entries[e].hashed &&
+                    memcmp(index_entries[e].digest, catalog.digest[i], 16) == 0) {
+                    duplicate = 1;
+                    break;
+                }
+            }
+            if (!duplicate) {
+                index_insert(file_path(i), catalog.size[i], catalog.mtime[i], catalog.digest[i]);
+            }
+        } else {
+            index_insert(file_path(i), catalog.size[i], catalog.mtime[i], NULL);
+        }
+    }
+}
+
+int index_insert(const char *path, off_t size, time_t mtime, const unsigned char *digest) {
+    int e;
+    if (index_free != -1) {
+        e = index_free;
+        index_free = index_entries[e].next;
+    } else {
+        if (index_count >= max_index) {
+            static int warned = 0;
+            if (!warned) {
+                fprintf(stderr, "Índice lleno (%d entradas); los archivos nuevos no se agregan\n", max_index);
+                warned = 1;
+            }
+            return -1;
+        }
+        if (index_count == index_capacity) {
+            index_capacity = index_capacity > 0 ? index_capacity * 2 : 1024;
+            index_entries = realloc(index_entries, sizeof(IndexEntry) * index_capacity);
+        }
+        e = index_count++;
+    }
+    IndexEntry *entry = &index_entries[e];
+    entry->size = size;
+    entry->mtime = mtime;
+    entry->hashed = digest != NULL;
+    if (digest != NULL) {
+        memcpy(entry->digest, digest, 16);
+    }
+    index_set_path(entry, path);
+    unsigned int bucket = index_bucket(size);
+    entry->next = index_buckets[bucket];
+    index_buckets[bucket] = e;
+
+    index_live++;
+    if (index_live * 4 > index_bucket_count * 3) {
+        index_grow_buckets();
+    }
+    return e;
+}
+
+// Guarda la ruta de una entrada nueva al final del bloque. Cuando más de la
+// mitad del bloque son rutas de entradas liberadas se compacta, para que la
+// memoria no crezca sin límite en una vigilancia larga.
+void index_set_path(IndexEntry *entry, const char *path) {
+    size_t len = strlen(path) + 1;
+
+    if (index_blob_size + len > index_blob_capacity && index_blob_size > 2 * index_blob_live + 1024 * 1024) {
+        char *compact = malloc(index_blob_capacity);
+        size_t size = 0;
+        for (int e = 0; e < index_count; e++) {
+            if (&index_entries[e] != entry && index_entries[e].size >= 0) {
+                size_t path_len = strlen(index_blob + index_entries[e].path) + 1;
+                memcpy(compact + size, index_blob + index_entries[e].path, path_len);
+                index_entries[e].path = size;
+                size += path_len;
+            }
+        }
+        free(index_blob);
+        index_blob = compact;
+        index_blob_size = size;
+    }
+    if (index_blob_size + len > index_blob_capacity) {
+        index_blob_capacity = index_blob_capacity > 0 ? index_blob_capacity * 2 : 64 * 1024;
+        while (index_blob_size + len > index_blob_capacity) {
+            index_blob_capacity *= 2;
+        }
+        index_blob = realloc(index_blob, index_blob_capacity);
+    }
+    memcpy(index_blob + index_blob_size, path, len);
+    entry->path = index_blob_size;
+    index_blob_size += len;
+    index_blob_live += len;
+}
+
+// Comprueba que el representante de una entrada siga igual y calcula su hash
+// si todavía no lo tiene. Si desapareció o cambió de tamaño la entrada se
+// libera y devuelve 0.
+int index_refresh(IndexEntry *entry) {
+    struct stat statbuf;
+    char hash[HASH_SIZE];
+    const char *path = index_blob + entry->path;
+    int valid = stat(path, &statbuf) == 0 && statbuf.st_size == entry->size;
+
+    if (valid && (!entry->hashed || statbuf.st_mtime != entry->mtime)) {
+        valid = hash_file(path, hash) && hex_to_digest(hash, entry->digest) == 0;
+        entry->hashed = valid;
+        entry->mtime = statbuf.st_mtime;
+    }
+    if (!valid) {
+        int e = (int)(entry - index_entries);
+        unsigned int bucket = index_bucket(entry->size);
+        for (int *link = &index_buckets[bucket]; *link != -1; link = &index_entries[*link].next) {
+            if (*link == e) {
+                *link = entry->next;
+                break;
+            }
+        }
+        index_blob_live -= strlen(path) + 1;
+        entry->size = -1;
+        entry->next = index_free;
+        index_free = e;
+        index_live--;
+    }
+    return valid;
+}
+
+void index_grow_buckets(void) {
+    int count = index_bucket_count > 0 ? index_bucket_count * 2 : 1024;
+    free(index_buckets);
+    index_buckets = malloc(sizeof(int) * count);
+    for (int i = 0; i < count; i++) {
+        index_buckets[i] = -1;
+    }
+    index_bucket_count = count;
+    for (int e = 0; e < index_count; e++) {
+        if (index_entries[e].size >= 0) {
+            unsigned int bucket = index_bucket(index_entries[e].size);
+            index_entries[e].next = index_buckets[bucket];
+            index_buckets[bucket] = e;
+        }
+    }
+}
+
+unsigned int index_bucket(off_t size) {
+    unsigned long long x = (unsigned long long)size * 0x9e3779b97f4a7c15ULL;
+    return (unsigned int)(x >> 32) & (index_bucket_count - 1);
+}
+
+// El modo --mem-limit es un ordenamiento externo en tres pasadas. El
+// recorrido emite (tamaño, file_id); cada pasada mezcla las corridas
+// ordenadas, calcula el siguiente hash sólo para los grupos con dos o más
+// miembros y vuelca los resultados en corridas nuevas. La memoria usada es
+// la mitad de --mem-limit para el búfer de corridas y un cuarto para el lote
+// de archivos a leer, más un FILE por corrida durante la mezcla.
+int spill_init(void) {
+    char paths_name[MAX_PATH + 16];
+
+    if (tmp_base == NULL) {
+        tmp_base = getenv("TMPDIR") != NULL ? getenv("TMPDIR") : "/tmp";
+    }
+    snprintf(spill_dir, sizeof(spill_dir), "%s/dpl-XXXXXX", tmp_base);
+    if (mkdtemp(spill_dir) == NULL) {
+        perror("mkdtemp");
+        return -1;
+    }
+    snprintf(paths_name, sizeof(paths_name), "%s/paths", spill_dir);
+    paths_file = fopen(paths_name, "w+");
+    if (paths_file == NULL) {
+        perror("fopen");
+        return -1;
+    }
+    spill_capacity = mem_limit / 2 / sizeof(SpillRecord);
+    spill_buffer = malloc(spill_capacity * sizeof(SpillRecord));
+
+    // Durante el recorrido la lista de pendientes usa el cuarto que después
+    // ocupa el lote de lectura. El archivo se borra enseguida: sólo lo usa
+    // este proceso.
+    snprintf(paths_name, sizeof(paths_name), "%s/frontier", spill_dir);
+    to_visit.spill = fopen(paths_name, "w+");
+    if (to_visit.spill == NULL) {
+        perror("fopen");
+        return -1;
+    }
+    unlink(paths_name);
+    to_visit.limit = mem_limit / 4;
+    return spill_buffer != NULL ? 0 : -1;
+}
+
+void spill_add_file(const char *path, off_t size) {
+    SpillRecord record;
+    size_t len = strlen(path) + 1;
+
+    memset(&record, 0, sizeof(record));
+    record.size = (unsigned long long)size;
+    pthread_mutex_lock(&spill_lock);
+    record.file_id = paths_size;
+    fwrite(path, 1, len, paths_file);
+    paths_size += len;
+    spill_push(&record);
+    pthread_mutex_unlock(&spill_lock);
+}
+
+// Quien llama debe tener spill_lock o ser el único hilo activo
+void spill_push(const SpillRecord *record) {
+    if (spill_count == spill_capacity) {
+        spill_flush();
+    }
+    spill_buffer[spill_count++] = *record;
+}
+
+// Ordena el búfer y lo escribe como una corrida nueva
+void spill_flush(void) {
+    char name[MAX_PATH + 32];
+
+    if (spill_count == 0) {
+        return;
+    }
+    qsort(spill_buffer, spill_count, sizeof(SpillRecord), compare_record);
+    int run = spill_next_run++;
+    run_file_name(run, name, sizeof(name));
+    FILE *file = fopen(name, "w");
+    if (file == NULL || fwrite(spill_buffer, sizeof(SpillRecord), spill_count, file) != spill_count) {
+        perror("fwrite");
+        exit(EXIT_FAILURE); // Sin la corrida el resultado sería incompleto
+    }
+    fclose(file);
+    if (spill_run_count == spill_run_capacity) {
+        spill_run_capacity = spill_run_capacity > 0 ? spill_run_capacity * 2 : 64;
+        spill_runs = realloc(spill_runs, sizeof(int) * spill_run_capacity);
+    }
+    spill_runs[spill_run_count++] = run;
+    spill_count = 0;
+}
+
+// Orden (tamaño, hash, file_id): file_id conserva el orden de descubrimiento
+int compare_record(const void *a, const void *b) {
+    const SpillRecord *ra = (const SpillRecord *)a;
+    const SpillRecord *rb = (const SpillRecord *)b;
+    if (ra->size != rb->size) {
+        return (ra->size > rb->size) - (ra->size < rb->size);
+    }
+    int diff = memcmp(ra->digest, rb->digest, 16);
+    if (diff != 0) {
+        return diff;
+    }
+    return (ra->file_id > rb->file_id) - (ra->file_id < rb->file_id);
+}
+
+void run_file_name(int run, char *name, size_t len) {
+    snprintf(name, len, "%s/run-%d", spill_dir, run);
+}
+
+MergeState *merge_open(int *runs, int count) {
+    char name[MAX_PATH + 32];
+    MergeState *state = calloc(1, sizeof(MergeState));
+
+    state->files = calloc(count, sizeof(FILE *));
+    state->heads = malloc(sizeof(SpillRecord) * (count > 0 ? count : 1));
+    state->heap = malloc(sizeof(int) * (count > 0 ? count : 1));
+    state->runs = runs;
+    state->count = count;
+    for (int i = 0; i < count; i++) {
+        run_file_name(runs[i], name, sizeof(name));
+        state->files[i] = fopen(name, "r");
+        if (state->files[i] != NULL && fread(&state->heads[i], sizeof(SpillRecord), 1, state->files[i]) == 1) {
+            state->heap[state->heap_count++] = i;
+        }
+    }
+    for (int i = state->heap_count / 2 - 1; i >= 0; i--) {
+        heap_sift_down(state, i);
+    }
+    return state;
+}
+
+int merge_next(MergeState *state, SpillRecord *record) {
+    if (state->heap_count == 0) {
+        return 0;
+    }
+    int run = state->heap[0];
+    *record = state->heads[run];
+    if (fread(&state->heads[run], sizeof(SpillRecord), 1, state->files[run]) != 1) {
+        state->heap[0] = state->heap[--state->heap_count]; // Corrida agotada
+    }
+    heap_sift_down(state, 0);
+    return 1;
+}
+
+void heap_sift_down(MergeState *state, int pos) {
+    while (1) {
+        int smallest = pos;
+        int left = 2 * pos + 1, right = 2 * pos + 2;
+        if (left < state->heap_count &&
+            compare_record(&state->heads[state->heap[left]], &state->heads[state->heap[smallest]]) < 0) {
+            smallest = left;
+        }
+        if (right < state->heap_count &&
+            compare_record(&state->heads[state->heap[right]], &state->heads[state->heap[smallest]]) < 0) {
+            smallest = right;
+        }
+        if (smallest == pos) {
+            return;
+        }
+        int tmp = state->heap[pos];
+        state->heap[pos] = state->heap[smallest];
+        state->heap[smallest] = tmp;
+        pos = smallest;
+    }
+}
+
+// Cierra la mezcla y borra sus corridas
+void merge_close(MergeState *state) {
+    char name[MAX_PATH + 32];
+
+    for (int i = 0; i < state->count; i++) {
+        if (state->files[i] != NULL) {
+            fclose(state->files[i]);
+        }
+        run_file_name(state->runs[i], name, sizeof(name));
+        unlink(name);
+    }
+    free(state->files);
+    free(state->heads);
+    free(state->heap);
+    free(state->runs);
+    free(state);
+}
+
+// Mezcla las corridas de a MERGE_FANIN hasta que quede un número que se pueda
+// abrir a la vez, para no agotar descriptores con millones de archivos
+void reduce_runs(void) {
+    while (spill_run_count > MERGE_FANIN) {
+        int *runs = malloc(sizeof(int) * MERGE_FANIN);
+        memcpy(runs, spill_runs, sizeof(int) * MERGE_FANIN);
+        memmove(spill_runs, spill_runs + MERGE_FANIN, sizeof(int) * (spill_run_count - MERGE_FANIN));
+        spill_run_count -= MERGE_FANIN;
+
+        MergeState *state = merge_open(runs, MERGE_FANIN);
+        SpillRecord record;
+        while (merge_next(state, &record)) {
+            spill_push(&record);
+        }
+        merge_close(state);
+        spill_flush();
+    }
+}
+
+int read_spilled_path(unsigned long long file_id, char *path) {
+    ssize_t len = pread(fileno(paths_file), path, MAX_PATH - 1, (off_t)file_id);
+    if (len <= 0) {
+        return -1;
+    }
+    path[len] = '\0';
+    return 0;
+}
+
+// Lote de registros que esperan su hash, compartido por los hilos de una pasada
+SpillRecord *external_batch = NULL;
+int *external_ok = NULL;
+size_t external_batch_count = 0, external_batch_next = 0;
+int external_full = 0;
+
+// Una pasada: full = 0 agrupa por tamaño y calcula el hash parcial, full = 1
+// agrupa por (tamaño, parcial) y calcula el hash completo
+void external_pass(int full, int num_threads) {
+    size_t batch_capacity = mem_limit / 4 / (sizeof(SpillRecord) + sizeof(int));
+    SpillRecord record, first;
+    int have_first = 0, first_queued = 0;
+
+    reduce_runs();
+    int *runs = spill_runs;
+    int count = spill_run_count;
+    spill_runs = NULL;
+    spill_run_count = spill_run_capacity = 0;
+
+    external_batch = malloc(sizeof(SpillRecord) * batch_capacity);
+    external_ok = malloc(sizeof(int) * batch_capacity);
+    external_batch_count = 0;
+    external_full = full;
+
+    MergeState *state = merge_open(runs, count);
+    while (1) {
+        int more = merge_next(state, &record);
+        // Mismo grupo: mismo tamaño y, en la pasada completa, mismo parcial
+        int same = more && have_first && record.size == first.size &&
+                   (!full || memcmp(record.digest, first.digest, 16) == 0);
+        if (same) {
+            if (!first_queued) {
+                external_batch[external_batch_count++] = first;
+                first_queued = 1;
+            }
+            external_batch[external_batch_count++] = record;
+        } else {
+            first = record;
+            have_first = more;
+            first_queued = 0;
+        }
+
+        // Procesar el lote cuando está lleno (dejando lugar a un grupo que
+        // empieza) o al terminar la mezcla
+        if (external_batch_count + 2 > batch_capacity || (!more && external_batch_count > 0)) {
+            pthread_t threads[num_threads];
+            int created = 0;
+            external_batch_next = 0;
+            for (int i = 0; i < num_threads; i++) {
+                if (pthread_create(&threads[created], NULL, external_hash_worker, NULL) == 0) {
+                    created++;
+                }
+            }
+            for (int i = 0; i < created; i++) {
+                pthread_join(threads[i], NULL);
+            }
+            for (size_t i = 0; i < external_batch_count; i++) {
+                if (external_ok[i]) {
+                    spill_push(&external_batch[i]);
+                }
+            }
+            external_batch_count = 0;
+        }
+        if (!more) {
+            break;
+        }
+    }
+    merge_close(state);
+    spill_flush();
+    free(external_batch);
+    free(external_ok);
+}
+
+void *external_hash_worker(void *arg) {
+    (void)arg;
+    char path[MAX_PATH];
+    char hash[HASH_SIZE];
+
+    if (idle_io) {
+        set_idle_io_priority();
+    }
 
-    return EXIT_SUCCESS;
+    while (1) {
+        pthread_mutex_lock(&spill_lock);
+        size_t i = external_batch_next < external_batch_count ? external_batch_next++ : external_batch_count;
+        pthread_mutex_unlock(&spill_lock);
+        if (i == external_batch_count) {
+            break;
+        }
+        SpillRecord *record = &external_batch[i];
+        external_ok[i] = 0;
+        if (read_spilled_path(record->file_id, path) == -1) {
+            continue;
+        }
+        if (!external_full) {
+            external_ok[i] = partial_digest(path, record->digest) == 0;
+        } else if (record->size <= PARTIAL_SIZE && hash_mode != 'x') {
+            external_ok[i] = 1; // El parcial ya cubrió el archivo completo
+        } else {
+            external_ok[i] = hash_file(path, hash) && hex_to_digest(hash, record->digest) == 0;
+        }
+    }
+    return NULL;
 }
 
-void *check_duplicates(void *arg) {
-    char mode = *(char *)arg; // Obtener el modo de hash
+// Última mezcla: los grupos por (tamaño, hash completo) son los duplicados.
+// Cada archivo se informa contra el primero descubierto de su grupo, para
+// que la salida sea lineal aunque un grupo tenga millones de miembros. Las
+// líneas van a un archivo temporal porque el total se imprime primero. El
+// total sí cuenta pares, n·(n−1)/2 por grupo, como en el modo en memoria.
+void external_report(void) {
+    char results_name[MAX_PATH + 16], keeper[MAX_PATH], path[MAX_PATH], line[2 * MAX_PATH + 32];
+    SpillRecord record, first;
+    int have_first = 0;
+    long long count = 0, group_size = 0;
 
-    while (1) {
-        // Esperar a que haya archivos a visitar
-        sem_wait(&sem_to_visit);
+    reduce_runs();
+    snprintf(results_name, sizeof(results_name), "%s/results", spill_dir);
+    FILE *results = fopen(results_name, "w+");
+    if (results == NULL) {
+        perror("fopen");
+        return;
+    }
 
-        // Bloquear acceso a la lista de archivos a visitar
-        sem_wait(&mutex);
-        if (to_visit.count == 0) {
-            sem_post(&mutex);
-            break; // Salir si no hay más archivos a visitar
+    MergeState *state = merge_open(spill_runs, spill_run_count);
+    spill_runs = NULL;
+    spill_run_count = spill_run_capacity = 0;
+    while (merge_next(state, &record)) {
+        if (have_first && record.size == first.size && memcmp(record.digest, first.digest, 16) == 0) {
+            // El nuevo miembro forma un par con cada uno de los anteriores
+            count += group_size++;
+            if (read_spilled_path(first.file_id, keeper) == 0 && read_spilled_path(record.file_id, path) == 0) {
+                fprintf(results, "%s es duplicado de %s\n", path, keeper);
+            }
+        } else {
+            first = record;
+            have_first = 1;
+            group_size = 1;
         }
-        // Obtener el siguiente archivo a visitar
-        char current_file[MAX_PATH];
-        strcpy(current_file, to_visit.files[--to_visit.count].path);
-        sem_post(&mutex);
+    }
+    merge_close(state);
 
+    printf("Se han encontrado %lld archivos duplicados.\n", count);
+    rewind(results);
+    while (fgets(line, sizeof(line), results) != NULL) {
+        fputs(line, stdout);
+    }
+    fclose(results);
+    unlink(results_name);
+}
 
-        // Verificar si el archivo es un directorio
-        struct stat statbuf;
-        if (stat(current_file, &statbuf) == -1) {
-            perror("stat");
-            continue;
-        }
+void spill_cleanup(void) {
+    char paths_name[MAX_PATH + 16];
 
-        if (S_ISDIR(statbuf.st_mode)) {
-            // Procesar el directorio
-            DIR *dir = opendir(current_file);
-            if (dir == NULL) {
-                perror("opendir");
-                continue;
-            }
+    fclose(paths_file);
+    snprintf(paths_name, sizeof(paths_name), "%s/paths", spill_dir);
+    unlink(paths_name);
+    rmdir(spill_dir);
+    free(spill_buffer);
+    free(spill_runs);
+}
 
-            struct dirent *entry;
-            while ((entry = readdir(dir)) != NULL) {
-                if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
-                    char full_path[MAX_PATH];
-                    snprintf(full_path, sizeof(full_path), "%s/%s", current_file, entry->d_name);
-                    add_to_visit(full_path); // Agregar archivos encontrados a la lista
-                }
-            }
-            closedir(dir);
-        } else if (S_ISREG(statbuf.st_mode) && statbuf.st_size > 0) {
-            // Comparar con archivos visitados
-            sem_wait(&sem_visited);
-            for (int i = 0; i < visited.count; i++) {
-                if (is_duplicate(current_file, visited.files[i].path, mode)) { // Usar el modo
-                    // Almacenar el par de duplicados
+// MD5 de los primeros PARTIAL_SIZE bytes; descarta rápido los archivos de
+// igual tamaño que difieren al principio. Con -m x se usa el hash rápido.
+int partial_digest(const char *path, unsigned char digest[16]) {
+    DigestContext context;
 
-                    strcpy(duplicates[duplicate_count].file1, current_file);
+    if (hash_mode == 'x') {
+        return fast_partial_digest(path, digest);
+    }
 
-                    strcpy(duplicates[duplicate_count].file2, visited.files[i].path);
+    bucket_take(&files_bucket, 1);
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+    struct stat statbuf;
+    int result = fstat(fd, &statbuf);
+    if (result == 0) {
+        digest_init(&context, DPL_DIGEST_MD5);
+        result = digest_update_range(&context, fd, 0, statbuf.st_size < PARTIAL_SIZE ? statbuf.st_size : PARTIAL_SIZE);
+    }
+    close(fd);
+    if (result == -1) {
+        return -1;
+    }
+    digest_final(&context, digest);
+    return 0;
+}
 
-                    duplicate_count++;
-                }
-            }
-            add_to_visited(current_file);
-            sem_post(&sem_visited);
-        }
+// Hash rápido de los primeros y los últimos FAST_PARTIAL_SIZE bytes (del
+// archivo completo si es más chico). El final detecta los archivos que sólo
+// difieren por lo que se les agregó, como los logs. No confirma nada: sólo
+// sirve para descartar, la confirmación sigue siendo el MD5.
+int fast_partial_digest(const char *path, unsigned char digest[16]) {
+    unsigned char buffer[2 * FAST_PARTIAL_SIZE];
+    struct stat statbuf;
 
-        // Verificar si no hay más archivos a visitar
-        sem_wait(&mutex);
-        if (to_visit.count == 0) {
-            pthread_cond_broadcast(&cond_to_visit); // Notificar a otros hilos
-            sem_post(&mutex);
-            break; // Salir si no hay más archivos a visitar
+    bucket_take(&files_bucket, 1);
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+    if (fstat(fd, &statbuf) == -1) {
+        close(fd);
+        return -1;
+    }
+    size_t len = statbuf.st_size > 2 * FAST_PARTIAL_SIZE ? 2 * FAST_PARTIAL_SIZE : (size_t)statbuf.st_size;
+    bucket_take(&bytes_bucket, len);
+    ssize_t got;
+    if (len < sizeof(buffer)) {
+        got = pread(fd, buffer, len, 0);
+    } else {
+        got = pread(fd, buffer, FAST_PARTIAL_SIZE, 0);
+        if (got == FAST_PARTIAL_SIZE) {
+            ssize_t tail = pread(fd, buffer + FAST_PARTIAL_SIZE, FAST_PARTIAL_SIZE,
+                                 statbuf.st_size - FAST_PARTIAL_SIZE);
+            got = tail == FAST_PARTIAL_SIZE ? (ssize_t)len : -1;
         }
-        sem_post(&mutex);
     }
-    return NULL;
+    close(fd);
+    if (got != (ssize_t)len) {
+        return -1;
+    }
+    dpl_fast128(buffer, len, digest);
+    return 0;
 }
 
-void add_to_visit(const char *path) {
-    sem_wait(&mutex);
-    strcpy(to_visit.files[to_visit.count++].path, path);
-    sem_post(&mutex);
-    sem_post(&sem_to_visit);
+int hash_file(const char *path, char *hash_output) {
+    if (hash_mode == 'e') {
+        return get_md5_hash_executable(path, hash_output) == 0;
+    }
+    if (hash_mode == 'd') {
+        return get_md5_hash_daemon(path, hash_output) == 1;
+    }
+    if (hash_mode == 'b') {
+        return get_blake3_hash(path, hash_output) == 1;
+    }
+    return get_md5_hash_library(path, hash_output) == 1;
 }
 
-void add_to_visited(const char *path) {
-    sem_wait(&mutex);
-    strcpy(visited.files[visited.count++].path, path);
-    sem_post(&mutex);
+int hex_to_digest(const char *hex, unsigned char digest[16]) {
+    for (int i = 0; i < 16; i++) {
+        unsigned int byte;
+        if (sscanf(hex + 2 * i, "%2x", &byte) != 1) {
+            return -1;
+        }
+        digest[i] = (unsigned char)byte;
+    }
+    return 0;
 }
 
 int get_md5_hash_executable(const char *filename, char *hash_output) {
     int pipefd[2];
     pid_t pid;
-    char command[256];
+    struct stat statbuf;
+
+    // El proceso hijo lee el archivo completo: se cobra por adelantado, sin
+    // contar los huecos de los archivos dispersos
+    bucket_take(&files_bucket, 1);
+    if (stat(filename, &statbuf) == 0) {
+        off_t allocated = (off_t)statbuf.st_blocks * 512;
+        bucket_take(&bytes_bucket, allocated < statbuf.st_size ? allocated : statbuf.st_size);
+    }
 
     // Crear la tubería
     if (pipe(pipefd) == -1) {
@@ -220,12 +5477,21 @@ int get_md5_hash_executable(const char *filename, char *hash_output) {
         // Cerrar la escritura de la tubería
         close(pipefd[1]);
 
-        // Leer el hash de la tubería
-        read(pipefd[0], hash_output, HASH_SIZE);
+        // Leer el hash de la tubería. Si la señal de --time-budget corta la
+        // espera, el hijo se termina: su resultado ya no se usaría.
+        ssize_t n = read(pipefd[0], hash_output, HASH_SIZE);
         hash_output[HASH_SIZE - 1] = '\0'; // Asegurarse de que la cadena esté terminada
+        if (n < HASH_SIZE - 1) {
+            kill(pid, SIGKILL);
+        }
 
-        // Esperar a que el proceso hijo termine
-        wait(NULL);
+        // Esperar a este proceso hijo (otros hilos pueden tener los suyos)
+        while (waitpid(pid, NULL, 0) == -1 && errno == EINTR) {
+        }
+        if (n < HASH_SIZE - 1) {
+            close(pipefd[0]);
+            return -1;
+        }
     }
 
     // Cerrar la lectura de la tubería
@@ -233,44 +5499,670 @@ int get_md5_hash_executable(const char *filename, char *hash_output) {
     return 0;
 }
 
+// Cliente del servicio: cada hilo mantiene su propia conexión. Se envía un
+// lote de una ruta (la ruta terminada en '\0' y un '\0' que cierra el lote)
+// y se lee la línea de respuesta.
+int get_md5_hash_daemon(const char *filename, char *hash_output) {
+    char absolute[2 * MAX_PATH];
+    char reply[3 * MAX_PATH];
+    size_t length = 0;
+
+    // El servicio no comparte el directorio de trabajo del cliente
+    if (filename[0] == '/') {
+        snprintf(absolute, sizeof(absolute) - 1, "%s", filename);
+    } else {
+        char cwd[MAX_PATH];
+        if (getcwd(cwd, sizeof(cwd)) == NULL) {
+            return 0;
+        }
+        snprintf(absolute, sizeof(absolute) - 1, "%s/%s", cwd, filename);
+    }
+
+    if (daemon_fd == -1) {
+        struct sockaddr_un address;
+        memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        snprintf(address.sun_path, sizeof(address.sun_path), "%s", socket_path);
+        daemon_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (daemon_fd == -1 || connect(daemon_fd, (struct sockaddr *)&address, sizeof(address)) == -1) {
+            perror("connect");
+            if (daemon_fd != -1) {
+                close(daemon_fd);
+                daemon_fd = -1;
+            }
+            return 0;
+        }
+    }
+
+    size_t request = strlen(absolute) + 2; // Ruta, su '\0' y el '\0' del fin de lote
+    absolute[request - 1] = '\0';
+    if (send(daemon_fd, absolute, request, MSG_NOSIGNAL) != (ssize_t)request) {
+        close(daemon_fd);
+        daemon_fd = -1;
+        return 0;
+    }
+    while (length < sizeof(reply) - 1) {
+        ssize_t n = read(daemon_fd, reply + length, 1);
+        if (n <= 0) {
+            close(daemon_fd);
+            daemon_fd = -1;
+            return 0;
+        }
+        if (reply[length++] == '\n') {
+            break;
+        }
+    }
+    reply[length] = '\0';
+    if (strncmp(reply, "ERR", 3) == 0 || length < HASH_SIZE) {
+        return 0;
+    }
+    memcpy(hash_output, reply, HASH_SIZE - 1);
+    hash_output[HASH_SIZE - 1] = '\0';
+    return 1;
+}
+
 int get_md5_hash_library(const char *filename, char *hash_output) {
-    return MDFile((char *)filename, hash_output);
+    // Se recorre el archivo aquí en lugar de usar MDFile para poder limitar
+    // el ancho de banda entre lectura y lectura
+    DigestContext context;
+    unsigned char digest[16];
+
+    bucket_take(&files_bucket, 1);
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) {
+        return 0;
+    }
+
+    digest_init(&context, DPL_DIGEST_MD5);
+    int result = digest_update_fd(&context, fd);
+    close(fd);
+    if (result == -1) {
+        return 0;
+    }
+    digest_final(&context, digest);
+
+    for (int i = 0; i < 16; i++) {
+        sprintf(&hash_output[i * 2], "%02x", digest[i]);
+    }
+    hash_output[HASH_SIZE - 1] = '\0';
+    return 1;
+}
+
+// Con -m b: los primeros 16 bytes de BLAKE3, en el mismo formato que el MD5.
+// Los archivos de al menos BLAKE3_PARALLEL_MIN bytes se reparten entre hasta
+// blake3_threads hilos, si el pool compartido tiene auxiliares libres; el
+// resultado es el mismo que leyéndolos en orden.
+int get_blake3_hash(const char *filename, char *hash_output) {
+    DigestContext context;
+    unsigned char digest[16];
+    struct stat statbuf;
+
+    bucket_take(&files_bucket, 1);
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) {
+        return 0;
+    }
+
+    digest_init(&context, DPL_DIGEST_BLAKE3);
+    int result = 1; // 1: no se repartió, leerlo en este hilo
+    if (blake3_threads > 1 && fstat(fd, &statbuf) == 0 && statbuf.st_size >= BLAKE3_PARALLEL_MIN) {
+        result = blake3_parallel(fd, &statbuf, &context);
+    }
+    if (result == 1) {
+        result = digest_update_fd(&context, fd);
+    }
+    close(fd);
+    if (result == -1) {
+        return 0;
+    }
+    digest_final(&context, digest);
+
+    for (int i = 0; i < 16; i++) {
+        sprintf(&hash_output[i * 2], "%02x", digest[i]);
+    }
+    hash_output[HASH_SIZE - 1] = '\0';
+    return 1;
+}
+
+// Calcula en paralelo los segmentos completos que no son el final del
+// archivo (el final tiene que quedar en el contexto para cerrar la raíz),
+// los agrega en orden y lee el resto en este hilo. Devuelve 1 sin tocar el
+// contexto si el pool no tiene auxiliares libres.
+int blake3_parallel(int fd, const struct stat *statbuf, DigestContext *context) {
+    Blake3Job job;
+    int created = 0;
+
+    int helpers = blake3_reserve_helpers(blake3_threads - 1);
+    if (helpers == 0) {
+        return 1;
+    }
+    job.fd = fd;
+    job.sparse = (off_t)statbuf->st_blocks * 512 < statbuf->st_size;
+    job.segments = (statbuf->st_size - 1) / BLAKE3_SEGMENT;
+    job.next = 0;
+    job.failed = 0;
+    job.cvs = malloc(sizeof(*job.cvs) * job.segments);
+    if (job.cvs == NULL) {
+        blake3_release_helpers(helpers);
+        return -1;
+    }
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_t threads[helpers];
+    for (int i = 0; i < helpers; i++) {
+        if (pthread_create(&threads[created], NULL, blake3_segment_worker, &job) == 0) {
+            created++;
+        }
+    }
+    blake3_segment_worker(&job); // Este hilo también calcula segmentos
+    for (int i = 0; i < created; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    pthread_mutex_destroy(&job.lock);
+    blake3_release_helpers(helpers);
+
+    int result = -1;
+    if (!job.failed) {
+        for (off_t i = 0; i < job.segments; i++) {
+            dpl_blake3_push_subtree(&context->blake3, job.cvs[i], BLAKE3_SEGMENT / DPL_BLAKE3_CHUNK);
+        }
+        result = digest_update_range(context, fd, job.segments * BLAKE3_SEGMENT, statbuf->st_size);
+        if (result == 0) {
+            result = check_size_unchanged(fd, statbuf->st_size);
+        }
+    }
+    free(job.cvs);
+    return result;
+}
+
+void *blake3_segment_worker(void *arg) {
+    Blake3Job *job = (Blake3Job *)arg;
+    unsigned char *buffer = malloc(BLAKE3_SEGMENT);
+
+    if (idle_io) {
+        set_idle_io_priority();
+    }
+    budget_register();
+    while (buffer != NULL) {
+        pthread_mutex_lock(&job->lock);
+        off_t segment = job->failed || job->next >= job->segments ? -1 : job->next++;
+        pthread_mutex_unlock(&job->lock);
+        if (segment == -1) {
+            break;
+        }
+
+        off_t start = segment * BLAKE3_SEGMENT;
+        if (read_segment(job->fd, buffer, start, job->sparse) == -1) {
+            pthread_mutex_lock(&job->lock);
+            job->failed = 1;
+            pthread_mutex_unlock(&job->lock);
+            break;
+        }
+        dpl_blake3_subtree(buffer, BLAKE3_SEGMENT / DPL_BLAKE3_CHUNK, (uint64_t)start / DPL_BLAKE3_CHUNK,
+                           job->cvs[segment]);
+    }
+    if (buffer == NULL) {
+        pthread_mutex_lock(&job->lock);
+        job->failed = 1;
+        pthread_mutex_unlock(&job->lock);
+    }
+    budget_unregister();
+    free(buffer);
+    return NULL;
+}
+
+// Toma hasta wanted auxiliares del pool; devuelve cuántos obtuvo
+int blake3_reserve_helpers(int wanted) {
+    pthread_mutex_lock(&blake3_pool_lock);
+    int granted = wanted < blake3_free_helpers ? wanted : blake3_free_helpers;
+    if (granted < 0) {
+        granted = 0;
+    }
+    blake3_free_helpers -= granted;
+    pthread_mutex_unlock(&blake3_pool_lock);
+    return granted;
+}
+
+void blake3_release_helpers(int count) {
+    pthread_mutex_lock(&blake3_pool_lock);
+    blake3_free_helpers += count;
+    pthread_mutex_unlock(&blake3_pool_lock);
 }
 
-int is_duplicate(const char *file1, const char *file2, char mode) {
-    char hash1[HASH_SIZE];
-    char hash2[HASH_SIZE];
+// Llena buffer con el segmento que empieza en start. Igual que en
+// digest_update_fd, los huecos de un archivo disperso se rellenan con ceros
+// sin leerlos. Devuelve -1 si el archivo se acortó, hubo un error o se agotó
+// el plazo.
+int read_segment(int fd, unsigned char *buffer, off_t start, int sparse) {
+    off_t end = start + BLAKE3_SEGMENT;
+    off_t pos = start;
 
-    if (mode == 'e') {
-        if (get_md5_hash_executable(file1, hash1) == -1 || get_md5_hash_executable(file2, hash2) == -1) {
-            return 0; // Error al obtener el hash
+    while (pos < end) {
+        if (budget_expired) {
+            return -1;
+        }
+        off_t stop = end;
+        if (sparse) {
+            off_t data = lseek(fd, pos, SEEK_DATA);
+            if (data == -1 && errno == ENXIO) {
+                data = end; // Sólo queda un hueco hasta el final del archivo
+            }
+            if (data > pos) {
+                off_t zeros = (data < end ? data : end) - pos;
+                memset(buffer + (pos - start), 0, (size_t)zeros);
+                pos += zeros;
+                continue;
+            }
+            // data == pos, o SEEK_DATA no soportado: leer hasta el próximo hueco
+            off_t hole = data == pos ? lseek(fd, pos, SEEK_HOLE) : -1;
+            if (hole > pos && hole < end) {
+                stop = hole;
+            }
         }
-    } else if (mode == 'l') {
-        if (get_md5_hash_library(file1, hash1) == 0 || get_md5_hash_library(file2, hash2) == 0) {
-            return 0; // Error al obtener el hash
+        size_t want = stop - pos < READ_BUF_SIZE ? (size_t)(stop - pos) : READ_BUF_SIZE;
+        ssize_t len = pread(fd, buffer + (pos - start), want, pos);
+        if (len <= 0) {
+            return -1; // Error, o el archivo se acortó
         }
+        bucket_take(&bytes_bucket, len);
+        pos += len;
+    }
+    return 0;
+}
+
+// Con --digests: lee el archivo una sola vez y deja en el catálogo el MD5 y
+// los demás digests pedidos. Devuelve 1 si pudo leerlo completo.
+int hash_file_digests(int file) {
+    DigestContext context;
+
+    bucket_take(&files_bucket, 1);
+    int fd = open(file_path(file), O_RDONLY);
+    if (fd == -1) {
+        return 0;
+    }
+    digest_init(&context, digest_set);
+    int result = digest_update_fd(&context, fd);
+    close(fd);
+    if (result == -1) {
+        return 0;
+    }
+    digest_final(&context, catalog.digest[file]);
+    if (digest_set & DPL_DIGEST_SHA256) {
+        dpl_sha256_final(&context.sha256, catalog.sha256[file]);
+    }
+    if (digest_set & DPL_DIGEST_CRC32C) {
+        catalog.crc32c[file] = context.crc32c;
+    }
+    return 1;
+}
+
+void digest_init(DigestContext *context, int set) {
+    context->set = set;
+    MD5Init(&context->md5);
+    if (set & DPL_DIGEST_SHA256) {
+        dpl_sha256_init(&context->sha256);
+    }
+    context->crc32c = 0;
+    if (set & DPL_DIGEST_BLAKE3) {
+        dpl_blake3_init(&context->blake3);
+    }
+}
+
+// Cierra el digest que agrupa: los primeros 16 bytes de BLAKE3 si el
+// contexto lo calcula, si no el MD5. Los digests adicionales los lee quien
+// los pidió.
+void digest_final(DigestContext *context, unsigned char digest[16]) {
+    if (context->set & DPL_DIGEST_BLAKE3) {
+        dpl_blake3_final(&context->blake3, digest, 16);
     } else {
-        return 0; // Modo no válido
+        MD5Final(digest, &context->md5);
     }
+}
 
-    return strcmp(hash1, hash2) == 0 ? 1 : 0; // Retorna 1 si son duplicados, 0 si no
+// Cada buffer pasa por todos los algoritmos mientras todavía está en caché
+void digest_update(DigestContext *context, const unsigned char *data, size_t len) {
+    if (context->set & DPL_DIGEST_MD5) {
+        MD5Update(&context->md5, (unsigned char *)data, (unsigned int)len);
+    }
+    if (context->set & DPL_DIGEST_SHA256) {
+        dpl_sha256_update(&context->sha256, data, len);
+    }
+    if (context->set & DPL_DIGEST_CRC32C) {
+        context->crc32c = dpl_crc32c_update(context->crc32c, data, len);
+    }
+    if (context->set & DPL_DIGEST_BLAKE3) {
+        dpl_blake3_update(&context->blake3, data, len);
+    }
 }
 
-void process_directory(const char *dir_path) {
-    DIR *dir = opendir(dir_path);
-    struct dirent *entry;
+// Alimenta los digests con el contenido completo de fd. Los huecos de un
+// archivo disperso se localizan con SEEK_DATA/SEEK_HOLE y se alimentan desde
+// zero_block sin leerlos; el hash resultante es idéntico al de una lectura
+// normal. MD5 es secuencial, así que los huecos sí cuestan CPU, pero no E/S.
+int digest_update_fd(DigestContext *context, int fd) {
+    struct stat statbuf;
+    off_t pos = 0;
 
-    if (dir == NULL) {
-        perror("No se puede abrir el directorio");
+    if (fstat(fd, &statbuf) == -1) {
+        return -1;
+    }
+
+    // Sólo vale la pena buscar huecos si hay menos bloques asignados que bytes
+    if ((off_t)statbuf.st_blocks * 512 < statbuf.st_size) {
+        while (pos < statbuf.st_size) {
+            off_t data = lseek(fd, pos, SEEK_DATA);
+            if (data == -1) {
+                if (errno != ENXIO) {
+                    break; // SEEK_DATA no soportado: leer el resto normalmente
+                }
+                data = statbuf.st_size; // Sólo queda un hueco hasta el final
+            }
+            if (data > statbuf.st_size) {
+                data = statbuf.st_size;
+            }
+            digest_update_zeros(context, data - pos);
+            pos = data;
+            if (pos >= statbuf.st_size) {
+                break;
+            }
+
+            off_t hole = lseek(fd, pos, SEEK_HOLE);
+            if (hole == -1 || hole > statbuf.st_size) {
+                hole = statbuf.st_size;
+            }
+            if (digest_update_range(context, fd, pos, hole) == -1) {
+                return -1;
+            }
+            pos = hole;
+        }
+    }
+
+    // Lo que queda (todo el archivo si no es disperso) se lee hasta el
+    // tamaño de fstat. Si el archivo cambió de tamaño mientras se leía, el
+    // hash no corresponde a ninguna versión y el archivo no se informa.
+    if (digest_update_range(context, fd, pos, statbuf.st_size) == -1) {
+        return -1;
+    }
+    return check_size_unchanged(fd, statbuf.st_size);
+}
+
+// Lee [start, end) con pread. Un fin de archivo antes de end es un error,
+// igual que uno de lectura: el archivo se acortó después del stat.
+int digest_update_range(DigestContext *context, int fd, off_t start, off_t end) {
+    unsigned char buffer[READ_BUF_SIZE];
+    off_t pos = start;
+
+    while (pos < end) {
+        if (budget_expired) {
+            return -1; // El hash quedaría incompleto: el archivo no se informa
+        }
+        size_t want = sizeof(buffer);
+        if (end - pos < (off_t)want) {
+            want = (size_t)(end - pos);
+        }
+        ssize_t len = pread(fd, buffer, want, pos);
+        if (len <= 0) {
+            return -1;
+        }
+        bucket_take(&bytes_bucket, len);
+        digest_update(context, buffer, (size_t)len);
+        pos += len;
+    }
+    return 0;
+}
+
+// 0 si fd sigue teniendo size bytes
+int check_size_unchanged(int fd, off_t size) {
+    struct stat statbuf;
+    return fstat(fd, &statbuf) == 0 && statbuf.st_size == size ? 0 : -1;
+}
+
+void digest_update_zeros(DigestContext *context, off_t len) {
+    while (len > 0) {
+        unsigned int chunk = len > READ_BUF_SIZE ? READ_BUF_SIZE : (unsigned int)len;
+        digest_update(context, zero_block, chunk);
+        len -= chunk;
+    }
+}
+
+void bucket_init(TokenBucket *bucket, double rate) {
+    pthread_mutex_init(&bucket->lock, NULL);
+    bucket->rate = rate;
+    bucket->tokens = 0;
+    bucket->generation = 0;
+    clock_gettime(CLOCK_MONOTONIC, &bucket->last);
+}
+
+void bucket_set_rate(TokenBucket *bucket, double rate) {
+    pthread_mutex_lock(&bucket->lock);
+    bucket->rate = rate;
+    bucket->tokens = 0; // La deuda acumulada con el límite anterior se descarta
+    bucket->generation++;
+    clock_gettime(CLOCK_MONOTONIC, &bucket->last);
+    pthread_mutex_unlock(&bucket->lock);
+}
+
+void bucket_take(TokenBucket *bucket, double amount) {
+    check_limits_reload();
+
+    pthread_mutex_lock(&bucket->lock);
+    if (bucket->rate <= 0) {
+        pthread_mutex_unlock(&bucket->lock);
+        return; // Sin límite
+    }
+
+    // Recargar según el tiempo transcurrido, con una ráfaga máxima de un segundo
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double elapsed = (now.tv_sec - bucket->last.tv_sec) + (now.tv_nsec - bucket->last.tv_nsec) / 1e9;
+    bucket->last = now;
+    bucket->tokens += elapsed * bucket->rate;
+    if (bucket->tokens > bucket->rate) {
+        bucket->tokens = bucket->rate;
+    }
+
+    bucket->tokens -= amount;
+    double wait = bucket->tokens < 0 ? -bucket->tokens / bucket->rate : 0;
+    unsigned int generation = bucket->generation;
+    pthread_mutex_unlock(&bucket->lock);
+
+    // La deuda puede ser de minutos (-m e cobra el archivo entero de una
+    // vez), así que se duerme por tramos: si entre tanto SIGHUP cambia el
+    // límite, la deuda vieja se descartó y el hilo deja de esperar
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (!budget_expired) {
+        double remaining = wait - seconds_since(&start);
+        if (remaining <= 0) {
+            break;
+        }
+        double step = remaining < BUCKET_SLEEP_MS / 1000.0 ? remaining : BUCKET_SLEEP_MS / 1000.0;
+        struct timespec ts;
+        ts.tv_sec = (time_t)step;
+        ts.tv_nsec = (long)((step - ts.tv_sec) * 1e9);
+        nanosleep(&ts, NULL);
+
+        check_limits_reload();
+        pthread_mutex_lock(&bucket->lock);
+        int changed = bucket->generation != generation;
+        pthread_mutex_unlock(&bucket->lock);
+        if (changed) {
+            break;
+        }
+    }
+}
+
+// Duración con sufijo opcional s, m o h; sin sufijo son segundos
+double parse_duration(const char *text) {
+    char *end;
+    double value = strtod(text, &end);
+
+    switch (*end) {
+    case 's': end++; break;
+    case 'm': value *= 60; end++; break;
+    case 'h': value *= 3600; end++; break;
+    }
+    if (end == text || *end != '\0') {
+        return -1; // Valor inválido
+    }
+    return value;
+}
+
+double parse_rate(const char *text) {
+    char *end;
+    double value = strtod(text, &end);
+
+    switch (*end) {
+    case 'k': case 'K': value *= 1024; end++; break;
+    case 'm': case 'M': value *= 1024 * 1024; end++; break;
+    case 'g': case 'G': value *= 1024 * 1024 * 1024; end++; break;
+    }
+    if (end == text || *end != '\0' || !isfinite(value)) {
+        return -1; // Valor inválido
+    }
+    return value;
+}
+
+// Formato del archivo de control, una clave por línea:
+//   bwlimit=50M
+//   files-per-sec=200
+// Las claves ausentes conservan su valor actual; 0 desactiva el límite.
+int load_limits_file(const char *path) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        perror("fopen");
+        return -1;
+    }
+
+    char line[256];
+    while (fgets(line, sizeof(line), file) != NULL) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '#' || line[0] == '\0') {
+            continue;
+        }
+        char *value = strchr(line, '=');
+        if (value == NULL) {
+            fprintf(stderr, "Línea inválida en %s: %s\n", path, line);
+            continue;
+        }
+        *value++ = '\0';
+        double rate = parse_rate(value);
+        if (rate < 0) {
+            fprintf(stderr, "Valor inválido en %s: %s\n", path, value);
+        } else if (strcmp(line, "bwlimit") == 0) {
+            bucket_set_rate(&bytes_bucket, rate);
+        } else if (strcmp(line, "files-per-sec") == 0) {
+            bucket_set_rate(&files_bucket, rate);
+        } else {
+            fprintf(stderr, "Clave desconocida en %s: %s\n", path, line);
+        }
+    }
+    fclose(file);
+    return 0;
+}
+
+// Los límites se releen fuera del manejador de señal, en el primer hilo que
+// vuelve a pedir tokens después de recibir SIGHUP
+void check_limits_reload(void) {
+    if (!reload_limits) {
         return;
     }
+    pthread_mutex_lock(&limits_lock);
+    if (reload_limits) {
+        reload_limits = 0;
+        load_limits_file(limits_file);
+    }
+    pthread_mutex_unlock(&limits_lock);
+}
 
-    while ((entry = readdir(dir)) != NULL) {
-        if (entry->d_type == DT_REG) { // Solo archivos regulares
-            char full_path[MAX_PATH];
-            snprintf(full_path, sizeof(full_path), "%s/%s", dir_path, entry->d_name);
-            add_to_visited(full_path);
+void handle_sighup(int sig) {
+    (void)sig;
+    reload_limits = 1;
+}
+
+// Sólo sirve para interrumpir la llamada bloqueada del hilo que la recibe
+void handle_budget_signal(int sig) {
+    (void)sig;
+}
+
+// Espera a que se cumpla el plazo de --time-budget o a que termine la etapa
+// 2. Al cumplirse, despierta a los hilos del recorrido y reenvía SIGUSR1 a
+// los hilos registrados hasta que la etapa termina: una sola señal podría
+// llegar justo antes de que el hilo entre en la llamada que bloquea.
+void *budget_thread(void *arg) {
+    (void)arg;
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += (time_t)time_budget;
+    deadline.tv_nsec += (long)((time_budget - (time_t)time_budget) * 1e9);
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&budget_lock);
+    while (!budget_done && pthread_cond_timedwait(&budget_wake, &budget_lock, &deadline) != ETIMEDOUT) {
+    }
+    if (budget_done) {
+        pthread_mutex_unlock(&budget_lock);
+        return NULL;
+    }
+    budget_expired = 1;
+    fprintf(stderr, "Se agotó el presupuesto de tiempo: se detiene la lectura\n");
+    for (int i = 0; i < num_walkers; i++) {
+        sem_post(&sem_to_visit);
+    }
+    while (!budget_done) {
+        for (int i = 0; i < budget_thread_count; i++) {
+            pthread_kill(budget_threads[i], SIGUSR1);
+        }
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += BUDGET_SIGNAL_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
         }
+        pthread_cond_timedwait(&budget_wake, &budget_lock, &deadline);
+    }
+    pthread_mutex_unlock(&budget_lock);
+    return NULL;
+}
+
+// Un hilo registrado sigue vivo mientras figura en la lista, así que
+// pthread_kill sobre él es seguro bajo budget_lock
+void budget_register(void) {
+    pthread_mutex_lock(&budget_lock);
+    if (budget_thread_count == budget_thread_capacity) {
+        budget_thread_capacity = budget_thread_capacity > 0 ? budget_thread_capacity * 2 : 64;
+        budget_threads = realloc(budget_threads, sizeof(pthread_t) * budget_thread_capacity);
+        if (budget_threads == NULL) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    budget_threads[budget_thread_count++] = pthread_self();
+    pthread_mutex_unlock(&budget_lock);
+}
+
+void budget_unregister(void) {
+    pthread_mutex_lock(&budget_lock);
+    for (int i = 0; i < budget_thread_count; i++) {
+        if (pthread_equal(budget_threads[i], pthread_self())) {
+            budget_threads[i] = budget_threads[--budget_thread_count];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&budget_lock);
+}
+
+// sem_wait que se reintenta si una señal lo interrumpe
+void lock_sem(sem_t *sem) {
+    while (sem_wait(sem) == -1 && errno == EINTR) {
+    }
+}
+
+void set_idle_io_priority(void) {
+    // Con who = 0 el cambio afecta sólo al hilo que lo invoca
+    if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT) == -1) {
+        perror("ioprio_set");
     }
-    closedir(dir);
 }
@@ -0,0 +1,742 @@
+#include <stdlib.h>
+#include <string.h>
+#include "dpl_digest.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define DPL_X86 1
+#endif
+
+#define FAST_STRIPE 64        // Bytes que consume cada paso de los 8 carriles
+#define FAST_BLOCK_STRIPES 16 // Pasos entre dos mezclas de los acumuladores
+#define FAST_PRIME32 0x9e3779b1ULL
+#define BLAKE3_CHUNK_START 1
+#define BLAKE3_CHUNK_END 2
+#define BLAKE3_PARENT 4
+#define BLAKE3_ROOT 8
+#define BLAKE3_LANES 4 // Trozos por llamada a blake3_chunks
+#define CDC_MASK_SMALL 0x0003590703530000ULL // 15 bits: antes de DPL_CDC_AVG
+#define CDC_MASK_LARGE 0x0000d90003530000ULL // 11 bits: después
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+// Constantes del hash rápido: salida de splitmix64 a partir de 0
+static const uint64_t fast_key[16] = {
+    0xe220a8397b1dcdafULL, 0x6e789e6aa1b965f4ULL, 0x06c45d188009454fULL, 0xf88bb8a8724c81ecULL,
+    0x1b39896a51a8749bULL, 0x53cb9f0c747ea2eaULL, 0x2c829abe1f4532e1ULL, 0xc584133ac916ab3cULL,
+    0x3ee5789041c98ac3ULL, 0xf3b8488c368cb0a6ULL, 0x657eecdd3cb13d09ULL, 0xc2d326e0055bdef6ULL,
+    0x8621a03fe0bbdb7bULL, 0x8e1f7555983aa92fULL, 0xb54e0f1600cc4d19ULL, 0x84bb3f97971d80abULL
+};
+
+// BLAKE3 usa como clave el valor inicial de SHA-256
+static const uint32_t blake3_iv[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+static const unsigned char blake3_permutation[16] = {2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8};
+static unsigned char blake3_schedule[7][16]; // Orden de las palabras del mensaje en cada ronda
+
+static uint64_t cdc_gear[256]; // Un valor seudoaleatorio por byte
+
+static uint32_t crc32c_table[256];
+static int has_sha_ni = 0;
+static int has_sse42 = 0;
+static int has_sse2 = 0;
+static void (*sha256_blocks)(uint32_t state[8], const unsigned char *data, size_t blocks);
+static uint32_t (*crc32c_blocks)(uint32_t crc, const unsigned char *data, size_t len);
+static void (*fast_stripes)(uint64_t acc[8], const unsigned char *data, size_t stripes, size_t first);
+static void (*blake3_chunks)(const unsigned char *data, uint64_t first, uint32_t cvs[BLAKE3_LANES][8]);
+
+static uint32_t rotr(uint32_t x, int n) {
+    return (x >> n) | (x << (32 - n));
+}
+
+static void sha256_blocks_portable(uint32_t state[8], const unsigned char *data, size_t blocks) {
+    uint32_t w[64];
+
+    for (; blocks > 0; blocks--, data += 64) {
+        for (int i = 0; i < 16; i++) {
+            w[i] = (uint32_t)data[4 * i] << 24 | (uint32_t)data[4 * i + 1] << 16 |
+                   (uint32_t)data[4 * i + 2] << 8 | data[4 * i + 3];
+        }
+        for (int i = 16; i < 64; i++) {
+            uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int i = 0; i < 64; i++) {
+            uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+            uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+    }
+}
+
+// CRC32C reflejado (polinomio 0x82f63b78), un byte por paso
+static uint32_t crc32c_blocks_portable(uint32_t crc, const unsigned char *data, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        crc = crc32c_table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+static uint64_t load64(const unsigned char *data) {
+    uint64_t value;
+    memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+// Consume stripes pasos de 64 bytes; first es el número de paso del primero
+// dentro del bloque, que elige la ventana de fast_key y cuándo mezclar. Cada
+// carril suma el producto de las dos mitades de (dato ^ clave) y el dato de
+// su vecino, así que ningún byte de entrada se pierde aunque el producto dé 0.
+static void fast_stripes_portable(uint64_t acc[8], const unsigned char *data, size_t stripes, size_t first) {
+    for (size_t s = first; s < first + stripes; s++, data += FAST_STRIPE) {
+        const uint64_t *key = fast_key + s % 8;
+        for (int i = 0; i < 8; i++) {
+            uint64_t value = load64(data + 8 * i);
+            uint64_t keyed = value ^ key[i];
+            acc[i ^ 1] += value;
+            acc[i] += (keyed & 0xffffffff) * (keyed >> 32);
+        }
+        if (s % FAST_BLOCK_STRIPES == FAST_BLOCK_STRIPES - 1) {
+            for (int i = 0; i < 8; i++) {
+                acc[i] = ((acc[i] ^ (acc[i] >> 47)) ^ fast_key[8 + i]) * FAST_PRIME32;
+            }
+        }
+    }
+}
+
+static uint32_t load32(const unsigned char *data) {
+    return (uint32_t)data[0] | (uint32_t)data[1] << 8 | (uint32_t)data[2] << 16 | (uint32_t)data[3] << 24;
+}
+
+static void blake3_g(uint32_t v[16], int a, int b, int c, int d, uint32_t x, uint32_t y) {
+    v[a] += v[b] + x;
+    v[d] = rotr(v[d] ^ v[a], 16);
+    v[c] += v[d];
+    v[b] = rotr(v[b] ^ v[c], 12);
+    v[a] += v[b] + y;
+    v[d] = rotr(v[d] ^ v[a], 8);
+    v[c] += v[d];
+    v[b] = rotr(v[b] ^ v[c], 7);
+}
+
+// Función de compresión; deja en out las 8 primeras palabras de la salida,
+// que son el valor de encadenamiento (o el comienzo del hash en la raíz)
+static void blake3_compress(const uint32_t cv[8], const unsigned char block[64], uint32_t block_len,
+                            uint64_t counter, uint32_t flags, uint32_t out[8]) {
+    uint32_t m[16], v[16];
+
+    for (int i = 0; i < 16; i++) {
+        m[i] = load32(block + 4 * i);
+    }
+    memcpy(v, cv, 8 * sizeof(uint32_t));
+    memcpy(v + 8, blake3_iv, 4 * sizeof(uint32_t));
+    v[12] = (uint32_t)counter;
+    v[13] = (uint32_t)(counter >> 32);
+    v[14] = block_len;
+    v[15] = flags;
+    for (int r = 0; r < 7; r++) {
+        const unsigned char *s = blake3_schedule[r];
+        blake3_g(v, 0, 4, 8, 12, m[s[0]], m[s[1]]);
+        blake3_g(v, 1, 5, 9, 13, m[s[2]], m[s[3]]);
+        blake3_g(v, 2, 6, 10, 14, m[s[4]], m[s[5]]);
+        blake3_g(v, 3, 7, 11, 15, m[s[6]], m[s[7]]);
+        blake3_g(v, 0, 5, 10, 15, m[s[8]], m[s[9]]);
+        blake3_g(v, 1, 6, 11, 12, m[s[10]], m[s[11]]);
+        blake3_g(v, 2, 7, 8, 13, m[s[12]], m[s[13]]);
+        blake3_g(v, 3, 4, 9, 14, m[s[14]], m[s[15]]);
+    }
+    for (int i = 0; i < 8; i++) {
+        out[i] = v[i] ^ v[i + 8];
+    }
+}
+
+static void blake3_parent(const uint32_t left[8], const uint32_t right[8], uint32_t flags, uint32_t out[8]) {
+    unsigned char block[64];
+    for (int i = 0; i < 8; i++) {
+        for (int b = 0; b < 4; b++) {
+            block[4 * i + b] = (unsigned char)(left[i] >> (8 * b));
+            block[32 + 4 * i + b] = (unsigned char)(right[i] >> (8 * b));
+        }
+    }
+    blake3_compress(blake3_iv, block, 64, 0, BLAKE3_PARENT | flags, out);
+}
+
+// Valores de encadenamiento de BLAKE3_LANES trozos completos consecutivos
+static void blake3_chunks_portable(const unsigned char *data, uint64_t first, uint32_t cvs[BLAKE3_LANES][8]) {
+    for (int lane = 0; lane < BLAKE3_LANES; lane++, data += DPL_BLAKE3_CHUNK) {
+        memcpy(cvs[lane], blake3_iv, sizeof(blake3_iv));
+        for (int b = 0; b < DPL_BLAKE3_CHUNK / 64; b++) {
+            uint32_t flags = (b == 0 ? BLAKE3_CHUNK_START : 0) | (b == DPL_BLAKE3_CHUNK / 64 - 1 ? BLAKE3_CHUNK_END : 0);
+            blake3_compress(cvs[lane], data + 64 * b, 64, first + lane, flags, cvs[lane]);
+        }
+    }
+}
+
+#ifdef DPL_X86
+// Igual que fast_stripes_portable, de a dos carriles por registro
+__attribute__((target("sse2")))
+static void fast_stripes_sse2(uint64_t acc[8], const unsigned char *data, size_t stripes, size_t first) {
+    const __m128i prime = _mm_set1_epi32((int)FAST_PRIME32);
+    __m128i lanes[4];
+
+    for (int r = 0; r < 4; r++) {
+        lanes[r] = _mm_loadu_si128((const __m128i *)&acc[2 * r]);
+    }
+    for (size_t s = first; s < first + stripes; s++, data += FAST_STRIPE) {
+        const uint64_t *key = fast_key + s % 8;
+        for (int r = 0; r < 4; r++) {
+            __m128i value = _mm_loadu_si128((const __m128i *)(data + 16 * r));
+            __m128i keyed = _mm_xor_si128(value, _mm_loadu_si128((const __m128i *)(key + 2 * r)));
+            __m128i product = _mm_mul_epu32(keyed, _mm_srli_epi64(keyed, 32));
+            lanes[r] = _mm_add_epi64(lanes[r], _mm_add_epi64(_mm_shuffle_epi32(value, 0x4e), product));
+        }
+        if (s % FAST_BLOCK_STRIPES == FAST_BLOCK_STRIPES - 1) {
+            for (int r = 0; r < 4; r++) {
+                __m128i mixed = _mm_xor_si128(lanes[r], _mm_srli_epi64(lanes[r], 47));
+                mixed = _mm_xor_si128(mixed, _mm_loadu_si128((const __m128i *)&fast_key[8 + 2 * r]));
+                // Producto de 64x32 bits: parte baja más parte alta desplazada
+                __m128i low = _mm_mul_epu32(mixed, prime);
+                __m128i high = _mm_mul_epu32(_mm_srli_epi64(mixed, 32), prime);
+                lanes[r] = _mm_add_epi64(low, _mm_slli_epi64(high, 32));
+            }
+        }
+    }
+    for (int r = 0; r < 4; r++) {
+        _mm_storeu_si128((__m128i *)&acc[2 * r], lanes[r]);
+    }
+}
+
+#define ROTR_SSE2(x, n) _mm_or_si128(_mm_srli_epi32((x), (n)), _mm_slli_epi32((x), 32 - (n)))
+
+// Se fuerza inline para que el estado quede en registros
+__attribute__((target("sse2"), always_inline))
+static inline void blake3_g_sse2(__m128i v[16], int a, int b, int c, int d, __m128i x, __m128i y) {
+    v[a] = _mm_add_epi32(_mm_add_epi32(v[a], v[b]), x);
+    v[d] = _mm_xor_si128(v[d], v[a]);
+    v[d] = _mm_shufflehi_epi16(_mm_shufflelo_epi16(v[d], 0xb1), 0xb1); // Rotar 16 bits
+    v[c] = _mm_add_epi32(v[c], v[d]);
+    v[b] = ROTR_SSE2(_mm_xor_si128(v[b], v[c]), 12);
+    v[a] = _mm_add_epi32(_mm_add_epi32(v[a], v[b]), y);
+    v[d] = ROTR_SSE2(_mm_xor_si128(v[d], v[a]), 8);
+    v[c] = _mm_add_epi32(v[c], v[d]);
+    v[b] = ROTR_SSE2(_mm_xor_si128(v[b], v[c]), 7);
+}
+
+// Transpone 4 filas de 4 palabras: fila i, palabra j pasa a fila j, palabra i
+__attribute__((target("sse2")))
+static void transpose4_sse2(__m128i rows[4]) {
+    __m128i ab_low = _mm_unpacklo_epi32(rows[0], rows[1]);
+    __m128i ab_high = _mm_unpackhi_epi32(rows[0], rows[1]);
+    __m128i cd_low = _mm_unpacklo_epi32(rows[2], rows[3]);
+    __m128i cd_high = _mm_unpackhi_epi32(rows[2], rows[3]);
+    rows[0] = _mm_unpacklo_epi64(ab_low, cd_low);
+    rows[1] = _mm_unpackhi_epi64(ab_low, cd_low);
+    rows[2] = _mm_unpacklo_epi64(ab_high, cd_high);
+    rows[3] = _mm_unpackhi_epi64(ab_high, cd_high);
+}
+
+// Igual que blake3_chunks_portable con un trozo por carril: cada registro
+// tiene la misma palabra del estado de los 4 trozos
+__attribute__((target("sse2")))
+static void blake3_chunks_sse2(const unsigned char *data, uint64_t first, uint32_t cvs[BLAKE3_LANES][8]) {
+    __m128i h[8], m[16], v[16];
+
+    for (int i = 0; i < 8; i++) {
+        h[i] = _mm_set1_epi32((int)blake3_iv[i]);
+    }
+    __m128i counter_low = _mm_set_epi32((int)(uint32_t)(first + 3), (int)(uint32_t)(first + 2),
+                                        (int)(uint32_t)(first + 1), (int)(uint32_t)first);
+    __m128i counter_high = _mm_set_epi32((int)(uint32_t)((first + 3) >> 32), (int)(uint32_t)((first + 2) >> 32),
+                                         (int)(uint32_t)((first + 1) >> 32), (int)(uint32_t)(first >> 32));
+    for (int b = 0; b < DPL_BLAKE3_CHUNK / 64; b++) {
+        // Palabras del bloque b de cada trozo, de a 4 palabras por trozo
+        for (int q = 0; q < 4; q++) {
+            for (int lane = 0; lane < 4; lane++) {
+                m[4 * q + lane] = _mm_loadu_si128((const __m128i *)(data + lane * DPL_BLAKE3_CHUNK + 64 * b + 16 * q));
+            }
+            transpose4_sse2(&m[4 * q]);
+        }
+        uint32_t flags = (b == 0 ? BLAKE3_CHUNK_START : 0) | (b == DPL_BLAKE3_CHUNK / 64 - 1 ? BLAKE3_CHUNK_END : 0);
+        for (int i = 0; i < 8; i++) {
+            v[i] = h[i];
+        }
+        for (int i = 0; i < 4; i++) {
+            v[8 + i] = _mm_set1_epi32((int)blake3_iv[i]);
+        }
+        v[12] = counter_low;
+        v[13] = counter_high;
+        v[14] = _mm_set1_epi32(64);
+        v[15] = _mm_set1_epi32((int)flags);
+        for (int r = 0; r < 7; r++) {
+            const unsigned char *s = blake3_schedule[r];
+            blake3_g_sse2(v, 0, 4, 8, 12, m[s[0]], m[s[1]]);
+            blake3_g_sse2(v, 1, 5, 9, 13, m[s[2]], m[s[3]]);
+            blake3_g_sse2(v, 2, 6, 10, 14, m[s[4]], m[s[5]]);
+            blake3_g_sse2(v, 3, 7, 11, 15, m[s[6]], m[s[7]]);
+            blake3_g_sse2(v, 0, 5, 10, 15, m[s[8]], m[s[9]]);
+            blake3_g_sse2(v, 1, 6, 11, 12, m[s[10]], m[s[11]]);
+            blake3_g_sse2(v, 2, 7, 8, 13, m[s[12]], m[s[13]]);
+            blake3_g_sse2(v, 3, 4, 9, 14, m[s[14]], m[s[15]]);
+        }
+        for (int i = 0; i < 8; i++) {
+            h[i] = _mm_xor_si128(v[i], v[i + 8]);
+        }
+    }
+    // De vuelta a una fila por trozo
+    transpose4_sse2(&h[0]);
+    transpose4_sse2(&h[4]);
+    for (int lane = 0; lane < 4; lane++) {
+        _mm_storeu_si128((__m128i *)&cvs[lane][0], h[lane]);
+        _mm_storeu_si128((__m128i *)&cvs[lane][4], h[4 + lane]);
+    }
+}
+
+// SHA-256 con las instrucciones SHA-NI. El estado se guarda en los registros
+// en el orden ABEF/CDGH que esperan sha256rnds2; cada iteración del bucle
+// hace 4 rondas y prepara con sha256msg1/msg2 las palabras de 3 grupos más
+// adelante.
+__attribute__((target("sha,sse4.1,ssse3")))
+static void sha256_blocks_ni(uint32_t state[8], const unsigned char *data, size_t blocks) {
+    const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i tmp = _mm_loadu_si128((const __m128i *)&state[0]);
+    __m128i state1 = _mm_loadu_si128((const __m128i *)&state[4]);
+
+    tmp = _mm_shuffle_epi32(tmp, 0xb1);             // CDAB
+    state1 = _mm_shuffle_epi32(state1, 0x1b);       // EFGH
+    __m128i state0 = _mm_alignr_epi8(tmp, state1, 8); // ABEF
+    state1 = _mm_blend_epi16(state1, tmp, 0xf0);    // CDGH
+
+    for (; blocks > 0; blocks--, data += 64) {
+        __m128i abef = state0, cdgh = state1;
+        __m128i w[4];
+
+        for (int g = 0; g < 16; g++) {
+            if (g < 4) {
+                w[g] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 16 * g)), mask);
+            }
+            __m128i msg = _mm_add_epi32(w[g % 4], _mm_loadu_si128((const __m128i *)&sha256_k[4 * g]));
+            state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+            if (g >= 3 && g < 15) {
+                __m128i next = _mm_add_epi32(w[(g + 1) % 4], _mm_alignr_epi8(w[g % 4], w[(g + 3) % 4], 4));
+                w[(g + 1) % 4] = _mm_sha256msg2_epu32(next, w[g % 4]);
+            }
+            msg = _mm_shuffle_epi32(msg, 0x0e);
+            state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+            if (g >= 1 && g <= 12) {
+                w[(g + 3) % 4] = _mm_sha256msg1_epu32(w[(g + 3) % 4], w[g % 4]);
+            }
+        }
+        state0 = _mm_add_epi32(state0, abef);
+        state1 = _mm_add_epi32(state1, cdgh);
+    }
+
+    tmp = _mm_shuffle_epi32(state0, 0x1b);        // FEBA
+    state1 = _mm_shuffle_epi32(state1, 0xb1);     // DCHG
+    state0 = _mm_blend_epi16(tmp, state1, 0xf0);  // DCBA
+    state1 = _mm_alignr_epi8(state1, tmp, 8);     // ABEF
+    _mm_storeu_si128((__m128i *)&state[0], state0);
+    _mm_storeu_si128((__m128i *)&state[4], state1);
+}
+
+// CRC32C con la instrucción crc32 de SSE4.2, de a 8 bytes
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_blocks_sse42(uint32_t crc, const unsigned char *data, size_t len) {
+    uint64_t value = crc;
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        value = _mm_crc32_u64(value, word);
+        data += 8;
+        len -= 8;
+    }
+    crc = (uint32_t)value;
+    while (len > 0) {
+        crc = _mm_crc32_u8(crc, *data++);
+        len--;
+    }
+    return crc;
+}
+#endif
+
+void dpl_digest_init(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = crc & 1 ? (crc >> 1) ^ 0x82f63b78 : crc >> 1;
+        }
+        crc32c_table[i] = crc;
+    }
+    // La tabla gear sale de splitmix64, igual en cualquier máquina
+    uint64_t seed = 0x64706c2d63646331ULL;
+    for (int i = 0; i < 256; i++) {
+        seed += 0x9e3779b97f4a7c15ULL;
+        uint64_t x = seed;
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+        cdc_gear[i] = x ^ (x >> 31);
+    }
+    sha256_blocks = sha256_blocks_portable;
+    crc32c_blocks = crc32c_blocks_portable;
+    fast_stripes = fast_stripes_portable;
+    blake3_chunks = blake3_chunks_portable;
+    for (int i = 0; i < 16; i++) {
+        blake3_schedule[0][i] = (unsigned char)i;
+    }
+    for (int r = 1; r < 7; r++) {
+        for (int i = 0; i < 16; i++) {
+            blake3_schedule[r][i] = blake3_schedule[r - 1][blake3_permutation[i]];
+        }
+    }
+
+#ifdef DPL_X86
+    unsigned int eax, ebx, ecx, edx;
+    if (__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+        has_sse2 = (edx & bit_SSE2) != 0;
+        has_sse42 = (ecx & bit_SSE4_2) != 0;
+        int sse41 = (ecx & bit_SSE4_1) != 0 && (ecx & bit_SSSE3) != 0;
+        if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+            has_sha_ni = sse41 && (ebx & bit_SHA) != 0;
+        }
+    }
+    if (has_sha_ni) {
+        sha256_blocks = sha256_blocks_ni;
+    }
+    if (has_sse42) {
+        crc32c_blocks = crc32c_blocks_sse42;
+    }
+    if (has_sse2) {
+        fast_stripes = fast_stripes_sse2;
+        blake3_chunks = blake3_chunks_sse2;
+    }
+#endif
+}
+
+void dpl_sha256_init(DplSha256 *context) {
+    static const uint32_t initial[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    memcpy(context->state, initial, sizeof(initial));
+    context->length = 0;
+    context->used = 0;
+}
+
+void dpl_sha256_update(DplSha256 *context, const unsigned char *data, size_t len) {
+    context->length += len;
+    if (context->used > 0) {
+        size_t take = 64 - context->used < len ? 64 - context->used : len;
+        memcpy(context->block + context->used, data, take);
+        context->used += take;
+        data += take;
+        len -= take;
+        if (context->used < 64) {
+            return;
+        }
+        sha256_blocks(context->state, context->block, 1);
+        context->used = 0;
+    }
+    // Los bloques completos se procesan directamente desde el buffer de lectura
+    if (len >= 64) {
+        sha256_blocks(context->state, data, len / 64);
+        data += len / 64 * 64;
+        len %= 64;
+    }
+    memcpy(context->block, data, len);
+    context->used = len;
+}
+
+void dpl_sha256_final(DplSha256 *context, unsigned char digest[32]) {
+    uint64_t bits = context->length * 8;
+    unsigned char pad[72];
+    size_t pad_len = (context->used < 56 ? 56 : 120) - context->used;
+
+    memset(pad, 0, sizeof(pad));
+    pad[0] = 0x80;
+    for (int i = 0; i < 8; i++) {
+        pad[pad_len + i] = (unsigned char)(bits >> (56 - 8 * i));
+    }
+    uint64_t length = context->length;
+    dpl_sha256_update(context, pad, pad_len + 8);
+    context->length = length;
+    for (int i = 0; i < 8; i++) {
+        digest[4 * i] = (unsigned char)(context->state[i] >> 24);
+        digest[4 * i + 1] = (unsigned char)(context->state[i] >> 16);
+        digest[4 * i + 2] = (unsigned char)(context->state[i] >> 8);
+        digest[4 * i + 3] = (unsigned char)context->state[i];
+    }
+}
+
+uint32_t dpl_crc32c_update(uint32_t crc, const unsigned char *data, size_t len) {
+    return ~crc32c_blocks(~crc, data, len);
+}
+
+// Producto de 64x64 bits plegado a 64
+static uint64_t fold64(uint64_t a, uint64_t b) {
+    unsigned __int128 product = (unsigned __int128)a * b;
+    return (uint64_t)product ^ (uint64_t)(product >> 64);
+}
+
+// Finalizador de splitmix64
+static uint64_t avalanche(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+void dpl_fast128(const unsigned char *data, size_t len, unsigned char digest[16]) {
+    uint64_t acc[8] = {
+        0xc2b2ae3dULL, 0x9e3779b185ebca87ULL, 0xc2b2ae3d27d4eb4fULL, 0x165667b19e3779f9ULL,
+        0x85ebca77c2b2ae63ULL, 0x85ebca77ULL, 0x27d4eb2f165667c5ULL, 0x9e3779b1ULL
+    };
+    size_t stripes = len / FAST_STRIPE;
+
+    fast_stripes(acc, data, stripes, 0);
+    // El resto se completa con ceros; la longitud entra en la mezcla final,
+    // así que "a" y "a\0" no coinciden
+    if (len % FAST_STRIPE > 0) {
+        unsigned char last[FAST_STRIPE];
+        memset(last, 0, sizeof(last));
+        memcpy(last, data + stripes * FAST_STRIPE, len % FAST_STRIPE);
+        fast_stripes(acc, last, 1, stripes);
+    }
+
+    uint64_t low = len * 0x9e3779b185ebca87ULL;
+    uint64_t high = ~len * 0xc2b2ae3d27d4eb4fULL;
+    for (int i = 0; i < 4; i++) {
+        low += fold64(acc[2 * i] ^ fast_key[i], acc[2 * i + 1] ^ fast_key[8 + i]);
+        high += fold64(acc[2 * i] ^ fast_key[4 + i], acc[2 * i + 1] ^ fast_key[12 + i]);
+    }
+    low = avalanche(low);
+    high = avalanche(high ^ low);
+    for (int i = 0; i < 8; i++) {
+        digest[i] = (unsigned char)(low >> (56 - 8 * i));
+        digest[8 + i] = (unsigned char)(high >> (56 - 8 * i));
+    }
+}
+
+static void blake3_store(const uint32_t words[8], unsigned char *out, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        out[i] = (unsigned char)(words[i / 4] >> (8 * (i % 4)));
+    }
+}
+
+// Agrega el valor de un subárbol de 2^levels trozos que termina en el trozo
+// total - 1. Cada bit en 0 de total por encima de levels indica que el
+// subárbol completa un par con el de la pila, que se combinan en su padre.
+static void blake3_push(DplBlake3 *context, const uint32_t cv[8], uint64_t total, int levels) {
+    uint32_t node[8];
+
+    memcpy(node, cv, sizeof(node));
+    total >>= levels;
+    while ((total & 1) == 0) {
+        blake3_parent(context->stack[--context->depth], node, 0, node);
+        total >>= 1;
+    }
+    memcpy(context->stack[context->depth++], node, sizeof(node));
+}
+
+static void blake3_start_chunk(DplBlake3 *context, uint64_t chunk) {
+    memcpy(context->cv, blake3_iv, sizeof(blake3_iv));
+    context->block_len = 0;
+    context->blocks_done = 0;
+    context->chunk = chunk;
+}
+
+void dpl_blake3_init(DplBlake3 *context) {
+    context->depth = 0;
+    blake3_start_chunk(context, 0);
+}
+
+void dpl_blake3_update(DplBlake3 *context, const unsigned char *data, size_t len) {
+    while (len > 0) {
+        size_t used = context->blocks_done * 64 + context->block_len;
+        // Trozo completo y vienen más datos: ya se sabe que no es la raíz
+        if (used == DPL_BLAKE3_CHUNK) {
+            uint32_t cv[8];
+            blake3_compress(context->cv, context->block, 64, context->chunk, BLAKE3_CHUNK_END, cv);
+            blake3_push(context, cv, context->chunk + 1, 0);
+            blake3_start_chunk(context, context->chunk + 1);
+            used = 0;
+        }
+        // Al comienzo de un trozo, los grupos de trozos completos que no son
+        // el final de los datos van directo por carriles
+        if (used == 0 && len > BLAKE3_LANES * DPL_BLAKE3_CHUNK) {
+            uint32_t cvs[BLAKE3_LANES][8];
+            blake3_chunks(data, context->chunk, cvs);
+            for (int lane = 0; lane < BLAKE3_LANES; lane++) {
+                blake3_push(context, cvs[lane], context->chunk + lane + 1, 0);
+            }
+            blake3_start_chunk(context, context->chunk + BLAKE3_LANES);
+            data += BLAKE3_LANES * DPL_BLAKE3_CHUNK;
+            len -= BLAKE3_LANES * DPL_BLAKE3_CHUNK;
+            continue;
+        }
+        // El último bloque se guarda hasta saber si es el final del trozo
+        if (context->block_len == 64) {
+            uint32_t flags = context->blocks_done == 0 ? BLAKE3_CHUNK_START : 0;
+            blake3_compress(context->cv, context->block, 64, context->chunk, flags, context->cv);
+            context->blocks_done++;
+            context->block_len = 0;
+        }
+        size_t take = 64 - context->block_len < len ? 64 - context->block_len : len;
+        memcpy(context->block + context->block_len, data, take);
+        context->block_len += take;
+        data += take;
+        len -= take;
+    }
+}
+
+void dpl_blake3_final(DplBlake3 *context, unsigned char *digest, size_t len) {
+    uint32_t out[8];
+    unsigned char block[64];
+
+    memset(block, 0, sizeof(block));
+    memcpy(block, context->block, context->block_len);
+    uint32_t flags = (context->blocks_done == 0 ? BLAKE3_CHUNK_START : 0) | BLAKE3_CHUNK_END;
+    if (context->depth == 0) {
+        blake3_compress(context->cv, block, (uint32_t)context->block_len, 0, flags | BLAKE3_ROOT, out);
+    } else {
+        // El trozo en curso y luego cada subárbol de la pila, de derecha a
+        // izquierda; el último padre es la raíz
+        blake3_compress(context->cv, block, (uint32_t)context->block_len, context->chunk, flags, out);
+        for (int i = context->depth - 1; i >= 0; i--) {
+            blake3_parent(context->stack[i], out, i == 0 ? BLAKE3_ROOT : 0, out);
+        }
+    }
+    blake3_store(out, digest, len > 32 ? 32 : len);
+}
+
+void dpl_blake3_subtree(const unsigned char *data, uint64_t chunks, uint64_t first, unsigned char cv[32]) {
+    uint32_t (*cvs)[8] = malloc(sizeof(*cvs) * (chunks < BLAKE3_LANES ? BLAKE3_LANES : chunks));
+    uint64_t count = 0;
+
+    if (chunks >= BLAKE3_LANES) {
+        for (; count < chunks; count += BLAKE3_LANES) {
+            blake3_chunks(data + count * DPL_BLAKE3_CHUNK, first + count, &cvs[count]);
+        }
+    } else {
+        for (; count < chunks; count++) {
+            memcpy(cvs[count], blake3_iv, sizeof(blake3_iv));
+            for (int b = 0; b < DPL_BLAKE3_CHUNK / 64; b++) {
+                uint32_t flags = (b == 0 ? BLAKE3_CHUNK_START : 0) | (b == DPL_BLAKE3_CHUNK / 64 - 1 ? BLAKE3_CHUNK_END : 0);
+                blake3_compress(cvs[count], data + count * DPL_BLAKE3_CHUNK + 64 * b, 64, first + count, flags,
+                                cvs[count]);
+            }
+        }
+    }
+    // Un nivel del árbol por pasada, combinando pares vecinos
+    for (; count > 1; count /= 2) {
+        for (uint64_t i = 0; i < count / 2; i++) {
+            blake3_parent(cvs[2 * i], cvs[2 * i + 1], 0, cvs[i]);
+        }
+    }
+    blake3_store(cvs[0], cv, 32);
+    free(cvs);
+}
+
+void dpl_blake3_push_subtree(DplBlake3 *context, const unsigned char cv[32], uint64_t chunks) {
+    uint32_t words[8];
+    int levels = 0;
+
+    for (int i = 0; i < 8; i++) {
+        words[i] = load32(cv + 4 * i);
+    }
+    while (((uint64_t)1 << levels) < chunks) {
+        levels++;
+    }
+    blake3_push(context, words, context->chunk + chunks, levels);
+    blake3_start_chunk(context, context->chunk + chunks);
+}
+
+// Los primeros DPL_CDC_MIN bytes no se miran: ningún corte puede caer ahí.
+// El valor de fp sólo depende de los últimos 64 bytes, así que empezar en
+// DPL_CDC_MIN no le quita nada a que el corte dependa del contenido.
+size_t dpl_cdc_cut(const unsigned char *data, size_t len) {
+    if (len <= DPL_CDC_MIN) {
+        return len;
+    }
+    size_t limit = len < DPL_CDC_MAX ? len : DPL_CDC_MAX;
+    size_t normal = limit < DPL_CDC_AVG ? limit : DPL_CDC_AVG;
+    uint64_t fp = 0;
+    size_t i = DPL_CDC_MIN;
+
+    for (; i < normal; i++) {
+        fp = (fp << 1) + cdc_gear[data[i]];
+        if ((fp & CDC_MASK_SMALL) == 0) {
+            return i + 1;
+        }
+    }
+    for (; i < limit; i++) {
+        fp = (fp << 1) + cdc_gear[data[i]];
+        if ((fp & CDC_MASK_LARGE) == 0) {
+            return i + 1;
+        }
+    }
+    return limit;
+}
+
+int dpl_digest_parse(const char *list) {
+    int set = 0;
+    const char *name = list;
+
+    while (*name != '\0') {
+        size_t len = strcspn(name, ",");
+        if (len == 3 && strncmp(name, "md5", len) == 0) {
+            set |= DPL_DIGEST_MD5;
+        } else if (len == 6 && strncmp(name, "sha256", len) == 0) {
+            set |= DPL_DIGEST_SHA256;
+        } else if (len == 6 && strncmp(name, "crc32c", len) == 0) {
+            set |= DPL_DIGEST_CRC32C;
+        } else {
+            return -1;
+        }
+        name += len;
+        if (*name == ',') {
+            name++;
+        }
+    }
+    return set > 0 ? set : -1;
+}
+
+const char *dpl_digest_backend(int algorithm) {
+    if (algorithm == DPL_DIGEST_SHA256 && has_sha_ni) {
+        return "sha-ni";
+    }
+    if (algorithm == DPL_DIGEST_CRC32C && has_sse42) {
+        return "sse4.2";
+    }
+    if ((algorithm == DPL_DIGEST_FAST128 || algorithm == DPL_DIGEST_BLAKE3) && has_sse2) {
+        return "sse2";
+    }
+    return "portable";
+}
@@ -0,0 +1,100 @@
+#ifndef DPL_DIGEST_H
+#define DPL_DIGEST_H
+
+// Digests adicionales al MD5 que dpl puede calcular en la misma pasada de
+// lectura (--digests): SHA-256 y CRC32C (Castagnoli). Cada algoritmo tiene
+// una versión portable y una acelerada que se elige al iniciar según cpuid:
+// SHA-NI para SHA-256 y la instrucción crc32 de SSE4.2 para CRC32C. Ambas
+// versiones dan exactamente el mismo resultado.
+//
+// También está el hash rápido de 128 bits con que -m x descarta candidatos
+// antes de calcular el MD5. No es criptográfico ni compatible con ningún
+// hash publicado: sigue el esquema de acumuladores de XXH3 (8 carriles de 64
+// bits, producto de 32x32 bits por carril) con constantes propias, y tiene
+// una versión SSE2 y otra portable con el mismo resultado.
+//
+// BLAKE3 (-m b) sigue la especificación: trozos de 1 KiB que forman un árbol
+// binario, de modo que un subárbol completo se puede calcular por separado
+// (dpl_blake3_subtree) y agregar después con dpl_blake3_push_subtree; así
+// varios hilos reparten un archivo grande. Con SSE2 se comprimen 4 trozos a
+// la vez, uno por carril.
+//
+// dpl_cdc_cut implementa el corte de FastCDC para --chunks: un hash gear
+// (fp = (fp << 1) + gear[byte]) que corta donde los bits de una máscara dan
+// 0, con una máscara más exigente antes del tamaño promedio y otra más
+// permisiva después, para que los tamaños se concentren cerca del promedio.
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define DPL_DIGEST_MD5 1
+#define DPL_DIGEST_SHA256 2
+#define DPL_DIGEST_CRC32C 4
+#define DPL_DIGEST_FAST128 8 // Sólo para dpl_digest_backend; no se guarda en el índice
+#define DPL_DIGEST_BLAKE3 16 // Reemplaza al MD5 con -m b; no se guarda en el índice
+#define DPL_BLAKE3_CHUNK 1024
+#define DPL_BLAKE3_MAX_DEPTH 54 // Niveles de la pila: alcanza para 2^64 bytes
+#define DPL_CDC_MIN 2048  // Tamaño mínimo de un bloque de --chunks
+#define DPL_CDC_AVG 8192  // Tamaño promedio buscado
+#define DPL_CDC_MAX 65536 // Tamaño máximo
+
+typedef struct {
+    uint32_t state[8];
+    uint64_t length; // Bytes procesados
+    unsigned char block[64];
+    size_t used;     // Bytes pendientes en block
+} DplSha256;
+
+typedef struct {
+    uint32_t stack[DPL_BLAKE3_MAX_DEPTH][8]; // Valores de encadenamiento de los subárboles completos
+    int depth;
+    uint32_t cv[8];          // Del trozo en curso
+    unsigned char block[64];
+    size_t block_len;
+    int blocks_done;         // Bloques ya comprimidos del trozo en curso
+    uint64_t chunk;          // Número del trozo en curso
+} DplBlake3;
+
+// Detecta las extensiones del procesador; llamar una vez antes de usar los
+// demás funciones desde varios hilos
+void dpl_digest_init(void);
+
+void dpl_sha256_init(DplSha256 *context);
+void dpl_sha256_update(DplSha256 *context, const unsigned char *data, size_t len);
+void dpl_sha256_final(DplSha256 *context, unsigned char digest[32]);
+
+// CRC32C encadenable: se empieza con 0 y se pasa el valor devuelto
+uint32_t dpl_crc32c_update(uint32_t crc, const unsigned char *data, size_t len);
+
+void dpl_blake3_init(DplBlake3 *context);
+void dpl_blake3_update(DplBlake3 *context, const unsigned char *data, size_t len);
+// Escribe los primeros len bytes de la salida (como máximo 32)
+void dpl_blake3_final(DplBlake3 *context, unsigned char *digest, size_t len);
+
+// Valor de encadenamiento de los chunks trozos (potencia de 2) que empiezan
+// en el trozo first, múltiplo de chunks. El subárbol no puede ser el árbol
+// entero: después tiene que venir al menos un byte más.
+void dpl_blake3_subtree(const unsigned char *data, uint64_t chunks, uint64_t first, unsigned char cv[32]);
+
+// Agrega un subárbol calculado con dpl_blake3_subtree como si se hubieran
+// pasado sus datos a dpl_blake3_update. El contexto tiene que estar al
+// comienzo de un trozo múltiplo de chunks.
+void dpl_blake3_push_subtree(DplBlake3 *context, const unsigned char cv[32], uint64_t chunks);
+
+// Largo del próximo bloque de contenido que empieza en data; len es lo que
+// queda disponible. Si len es menor que DPL_CDC_MAX sólo se puede confiar en
+// el corte cuando data termina donde termina el archivo.
+size_t dpl_cdc_cut(const unsigned char *data, size_t len);
+
+// Hash rápido de 128 bits de un bloque en memoria
+void dpl_fast128(const unsigned char *data, size_t len, unsigned char digest[16]);
+
+// Convierte una lista separada por comas (md5,sha256,crc32c) a DPL_DIGEST_*;
+// -1 si algún nombre no existe
+int dpl_digest_parse(const char *list);
+
+// Implementación elegida para el algoritmo: "sha-ni", "sse4.2", "sse2" o
+// "portable"
+const char *dpl_digest_backend(int algorithm);
+
+#endif
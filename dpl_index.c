@@ -0,0 +1,489 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include "md5-lib/global.h"
+#include "md5-lib/md5.h"
+#include "dpl_index.h"
+
+#define LOOKUP_BUF_SIZE (64 * 1024)
+
+static void open_bloom(DplIndex *index, const char *path);
+
+// El MD5 ya está bien distribuido: los primeros 8 bytes sirven de hash
+static uint64_t slot_of(const unsigned char digest[16], uint64_t slot_count) {
+    uint64_t hash;
+    memcpy(&hash, digest, sizeof(hash));
+    return hash & (slot_count - 1);
+}
+
+// Finalizador de splitmix64
+static uint64_t mix64(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+// La tabla usa los primeros 8 bytes del digest; el filtro, los últimos
+// mezclados con el tamaño. Los bits bajos eligen el bloque y los 63 bits de
+// una segunda mezcla dan las posiciones (9 bits cada una) dentro de él.
+static uint64_t bloom_key(const unsigned char digest[16], uint64_t size) {
+    uint64_t hash;
+    memcpy(&hash, digest + 8, sizeof(hash));
+    return mix64(hash ^ mix64(size + 0x9e3779b97f4a7c15ULL));
+}
+
+static void bloom_add(unsigned char *blocks, uint64_t block_count, uint32_t hashes, uint64_t key) {
+    unsigned char *block = blocks + (key & (block_count - 1)) * DPL_BLOOM_BLOCK;
+    uint64_t bits = mix64(key);
+    for (uint32_t i = 0; i < hashes; i++) {
+        unsigned int bit = (bits >> (9 * i)) & 511;
+        block[bit / 8] |= (unsigned char)(1 << (bit % 8));
+    }
+}
+
+static int bloom_test(const unsigned char *blocks, uint64_t block_count, uint32_t hashes, uint64_t key) {
+    const unsigned char *block = blocks + (key & (block_count - 1)) * DPL_BLOOM_BLOCK;
+    uint64_t bits = mix64(key);
+    for (uint32_t i = 0; i < hashes; i++) {
+        unsigned int bit = (bits >> (9 * i)) & 511;
+        if (!(block[bit / 8] & (1 << (bit % 8)))) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Sincroniza el temporal y lo renombra a path; si algo falló, lo borra
+static int finish_atomic(FILE *out, const char *tmp_path, const char *path, int failed) {
+    if (fflush(out) != 0 || fsync(fileno(out)) == -1) {
+        failed = 1;
+    }
+    if (fclose(out) != 0 || failed || rename(tmp_path, path) == -1) {
+        int saved = errno;
+        unlink(tmp_path);
+        errno = saved;
+        return -1;
+    }
+    return 0;
+}
+
+// Construye el filtro sobre las entradas de la tabla y lo guarda en <path>.bloom
+static int write_bloom(const char *path, uint64_t generation, const DplIndexSlot *slots, uint64_t slot_count,
+                       uint64_t entry_count) {
+    DplBloomHeader header;
+    uint64_t block_count = 1;
+    while (block_count * DPL_BLOOM_BLOCK * 8 < entry_count * DPL_BLOOM_BITS_PER_ENTRY) {
+        block_count *= 2;
+    }
+    unsigned char *blocks = calloc(block_count, DPL_BLOOM_BLOCK);
+    if (blocks == NULL) {
+        return -1;
+    }
+    for (uint64_t i = 0; i < slot_count; i++) {
+        if (slots[i].path != 0) {
+            bloom_add(blocks, block_count, DPL_BLOOM_HASHES, bloom_key(slots[i].digest, slots[i].size));
+        }
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, DPL_BLOOM_MAGIC, sizeof(header.magic));
+    header.version = DPL_BLOOM_VERSION;
+    header.hashes = DPL_BLOOM_HASHES;
+    header.generation = generation;
+    header.block_count = block_count;
+    header.entry_count = entry_count;
+
+    char bloom_path[4096], tmp_path[sizeof(bloom_path) + 32];
+    snprintf(bloom_path, sizeof(bloom_path), "%s.bloom", path);
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp.%d", bloom_path, (int)getpid());
+    FILE *out = fopen(tmp_path, "wb");
+    if (out == NULL) {
+        free(blocks);
+        return -1;
+    }
+    int failed = fwrite(&header, sizeof(header), 1, out) != 1 ||
+                 fwrite(blocks, DPL_BLOOM_BLOCK, block_count, out) != block_count;
+    free(blocks);
+    return finish_atomic(out, tmp_path, bloom_path, failed);
+}
+
+static int compare_records(const void *a, const void *b) {
+    return dpl_index_compare_records((const DplIndexRecord *)a, (const DplIndexRecord *)b);
+}
+
+int dpl_index_compare_records(const DplIndexRecord *a, const DplIndexRecord *b) {
+    if (a->size != b->size) {
+        return a->size < b->size ? -1 : 1;
+    }
+    return memcmp(a->digest, b->digest, 16);
+}
+
+int dpl_index_write(const char *path, const char *host, int digests, const DplIndexEntry *entries, size_t count) {
+    DplIndexHeader header;
+    uint64_t slot_count = 16;
+    while (slot_count < count * 2) {
+        slot_count *= 2;
+    }
+
+    DplIndexSlot *slots = calloc(slot_count, sizeof(DplIndexSlot));
+    if (slots == NULL) {
+        return -1;
+    }
+    uint64_t entry_count = 0, paths_size = 0;
+    for (size_t i = 0; i < count; i++) {
+        uint64_t slot = slot_of(entries[i].digest, slot_count);
+        while (slots[slot].path != 0 &&
+               (slots[slot].size != entries[i].size || memcmp(slots[slot].digest, entries[i].digest, 16) != 0)) {
+            slot = (slot + 1) & (slot_count - 1);
+        }
+        if (slots[slot].path != 0) {
+            continue; // Ya hay un archivo con este contenido
+        }
+        memcpy(slots[slot].digest, entries[i].digest, 16);
+        slots[slot].size = entries[i].size;
+        slots[slot].path = paths_size + 1;
+        paths_size += strlen(entries[i].path) + 1;
+        entry_count++;
+    }
+
+    // Sección ordenada: las mismas entradas que la tabla, por (tamaño, digest)
+    DplIndexRecord *records = malloc(sizeof(DplIndexRecord) * (entry_count > 0 ? entry_count : 1));
+    if (records == NULL) {
+        free(slots);
+        return -1;
+    }
+    uint64_t record_count = 0;
+    for (uint64_t i = 0; i < slot_count; i++) {
+        if (slots[i].path != 0) {
+            records[record_count].size = slots[i].size;
+            memcpy(records[record_count].digest, slots[i].digest, 16);
+            records[record_count].path = slots[i].path - 1;
+            record_count++;
+        }
+    }
+    qsort(records, record_count, sizeof(DplIndexRecord), compare_records);
+
+    // El filtro va primero: mientras no se renombre el índice, el filtro nuevo
+    // no coincide en generación con el índice viejo y simplemente se ignora
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    uint64_t generation = mix64(((uint64_t)now.tv_sec << 32) ^ (uint64_t)now.tv_nsec ^ ((uint64_t)getpid() << 16));
+    if (write_bloom(path, generation, slots, slot_count, entry_count) == -1) {
+        free(records);
+        free(slots);
+        return -1;
+    }
+
+    // Digests adicionales en el orden de la sección ordenada: cada registro
+    // se ubica en la tabla y de ahí se llega a la primera entrada con ese contenido
+    DplIndexDigests *extra = NULL;
+    digests &= DPL_DIGEST_SHA256 | DPL_DIGEST_CRC32C;
+    if (digests != 0) {
+        extra = calloc(entry_count > 0 ? entry_count : 1, sizeof(DplIndexDigests));
+        size_t *first = malloc(sizeof(size_t) * slot_count);
+        if (extra == NULL || first == NULL) {
+            free(extra);
+            free(first);
+            free(records);
+            free(slots);
+            return -1;
+        }
+        for (size_t i = count; i-- > 0;) {
+            uint64_t slot = slot_of(entries[i].digest, slot_count);
+            while (slots[slot].size != entries[i].size || memcmp(slots[slot].digest, entries[i].digest, 16) != 0) {
+                slot = (slot + 1) & (slot_count - 1);
+            }
+            first[slot] = i; // Al recorrer hacia atrás queda la primera
+        }
+        for (uint64_t r = 0; r < entry_count; r++) {
+            uint64_t slot = slot_of(records[r].digest, slot_count);
+            while (slots[slot].size != records[r].size || memcmp(slots[slot].digest, records[r].digest, 16) != 0) {
+                slot = (slot + 1) & (slot_count - 1);
+            }
+            const DplIndexEntry *entry = &entries[first[slot]];
+            if (digests & DPL_DIGEST_SHA256) {
+                memcpy(extra[r].sha256, entry->sha256, 32);
+            }
+            if (digests & DPL_DIGEST_CRC32C) {
+                extra[r].crc32c = entry->crc32c;
+            }
+        }
+        free(first);
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, DPL_INDEX_MAGIC, sizeof(header.magic));
+    header.version = DPL_INDEX_VERSION;
+    header.digests = (uint32_t)digests;
+    header.generation = generation;
+    header.entry_count = entry_count;
+    header.slot_count = slot_count;
+    header.slots_offset = sizeof(header);
+    header.records_offset = header.slots_offset + slot_count * sizeof(DplIndexSlot);
+    header.digests_offset = header.records_offset + entry_count * sizeof(DplIndexRecord);
+    header.paths_offset = header.digests_offset + (digests != 0 ? entry_count * sizeof(DplIndexDigests) : 0);
+    header.paths_size = paths_size;
+    snprintf(header.host, sizeof(header.host), "%s", host);
+
+    char tmp_path[4096];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp.%d", path, (int)getpid());
+    FILE *out = fopen(tmp_path, "wb");
+    if (out == NULL) {
+        free(extra);
+        free(records);
+        free(slots);
+        return -1;
+    }
+    int failed = fwrite(&header, sizeof(header), 1, out) != 1 ||
+                 fwrite(slots, sizeof(DplIndexSlot), slot_count, out) != slot_count ||
+                 fwrite(records, sizeof(DplIndexRecord), entry_count, out) != entry_count ||
+                 (extra != NULL && fwrite(extra, sizeof(DplIndexDigests), entry_count, out) != entry_count);
+    free(extra);
+    free(records);
+    // Las rutas se escriben en el mismo orden en que se les asignó offset
+    for (size_t i = 0; i < count && !failed; i++) {
+        uint64_t slot = slot_of(entries[i].digest, slot_count);
+        while (slots[slot].size != entries[i].size || memcmp(slots[slot].digest, entries[i].digest, 16) != 0) {
+            slot = (slot + 1) & (slot_count - 1);
+        }
+        if (slots[slot].path != 0) {
+            size_t length = strlen(entries[i].path) + 1;
+            failed = fwrite(entries[i].path, 1, length, out) != length;
+            slots[slot].path = 0; // Sólo la primera entrada de cada contenido
+        }
+    }
+    free(slots);
+    return finish_atomic(out, tmp_path, path, failed);
+}
+
+int dpl_index_open(DplIndex *index, const char *path) {
+    struct stat statbuf;
+
+    memset(index, 0, sizeof(*index));
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+    if (fstat(fd, &statbuf) == -1) {
+        close(fd);
+        return -1;
+    }
+    if ((size_t)statbuf.st_size < sizeof(DplIndexHeader)) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+    void *map = mmap(NULL, statbuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+
+    const DplIndexHeader *header = (const DplIndexHeader *)map;
+    uint64_t length = (uint64_t)statbuf.st_size;
+    if (memcmp(header->magic, DPL_INDEX_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != DPL_INDEX_VERSION || header->slot_count == 0 ||
+        (header->slot_count & (header->slot_count - 1)) != 0 ||
+        header->slots_offset + header->slot_count * sizeof(DplIndexSlot) > length ||
+        header->records_offset + header->entry_count * sizeof(DplIndexRecord) > length ||
+        (header->digests != 0 && header->digests_offset + header->entry_count * sizeof(DplIndexDigests) > length) ||
+        header->paths_offset + header->paths_size > length) {
+        munmap(map, statbuf.st_size);
+        errno = EINVAL;
+        return -1;
+    }
+    // Las consultas saltan a slots al azar
+    madvise(map, statbuf.st_size, MADV_RANDOM);
+
+    index->map = map;
+    index->length = statbuf.st_size;
+    index->header = header;
+    index->slots = (const DplIndexSlot *)((const char *)map + header->slots_offset);
+    index->paths = (const char *)map + header->paths_offset;
+    index->records = (const DplIndexRecord *)((const char *)map + header->records_offset);
+    if (header->digests != 0) {
+        index->digests = (const DplIndexDigests *)((const char *)map + header->digests_offset);
+    }
+    open_bloom(index, path);
+    return 0;
+}
+
+// Un filtro ausente, dañado o de otra generación no es un error: sólo se
+// pierde el atajo para los archivos que no están
+static void open_bloom(DplIndex *index, const char *path) {
+    char bloom_path[4096];
+    struct stat statbuf;
+
+    snprintf(bloom_path, sizeof(bloom_path), "%s.bloom", path);
+    int fd = open(bloom_path, O_RDONLY);
+    if (fd == -1) {
+        return;
+    }
+    if (fstat(fd, &statbuf) == -1 || (size_t)statbuf.st_size < sizeof(DplBloomHeader)) {
+        close(fd);
+        return;
+    }
+    void *map = mmap(NULL, statbuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return;
+    }
+    const DplBloomHeader *header = (const DplBloomHeader *)map;
+    if (memcmp(header->magic, DPL_BLOOM_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != DPL_BLOOM_VERSION || header->generation != index->header->generation ||
+        header->block_count == 0 || (header->block_count & (header->block_count - 1)) != 0 ||
+        header->hashes == 0 || header->hashes > 7 ||
+        (header->block_count + 1) * DPL_BLOOM_BLOCK > (uint64_t)statbuf.st_size) {
+        munmap(map, statbuf.st_size);
+        return;
+    }
+    index->bloom_map = map;
+    index->bloom_length = statbuf.st_size;
+    index->bloom = (const unsigned char *)map + DPL_BLOOM_BLOCK;
+    index->bloom_blocks = header->block_count;
+    index->bloom_hashes = header->hashes;
+}
+
+void dpl_index_close(DplIndex *index) {
+    if (index->map != NULL) {
+        munmap(index->map, index->length);
+    }
+    if (index->bloom_map != NULL) {
+        munmap(index->bloom_map, index->bloom_length);
+    }
+    memset(index, 0, sizeof(*index));
+}
+
+const DplIndexRecord *dpl_index_records(const DplIndex *index) {
+    // madvise necesita una dirección alineada a página
+    long page = sysconf(_SC_PAGESIZE);
+    uintptr_t start = (uintptr_t)index->records & ~(uintptr_t)(page - 1);
+    uintptr_t end = (uintptr_t)(index->records + index->header->entry_count);
+    if (end > start) {
+        madvise((void *)start, end - start, MADV_SEQUENTIAL);
+    }
+    return index->records;
+}
+
+int dpl_index_maybe_contains(const DplIndex *index, const unsigned char digest[16], uint64_t size) {
+    if (index->bloom == NULL || size == DPL_ANY_SIZE) {
+        return 1;
+    }
+    return bloom_test(index->bloom, index->bloom_blocks, index->bloom_hashes, bloom_key(digest, size));
+}
+
+const char *dpl_index_lookup(const DplIndex *index, const unsigned char digest[16], uint64_t size) {
+    uint64_t mask = index->header->slot_count - 1;
+
+    if (!dpl_index_maybe_contains(index, digest, size)) {
+        return NULL;
+    }
+
+    for (uint64_t slot = slot_of(digest, index->header->slot_count);; slot = (slot + 1) & mask) {
+        const DplIndexSlot *entry = &index->slots[slot];
+        if (entry->path == 0 || entry->path > index->header->paths_size) {
+            return NULL;
+        }
+        if (memcmp(entry->digest, digest, 16) == 0 && (size == DPL_ANY_SIZE || entry->size == size)) {
+            return index->paths + entry->path - 1;
+        }
+    }
+}
+
+const DplIndexDigests *dpl_index_digests(const DplIndex *index, const unsigned char digest[16], uint64_t size) {
+    if (index->digests == NULL) {
+        return NULL;
+    }
+    // Sin tamaño, la tabla dice cuál es (el digest lo identifica)
+    if (size == DPL_ANY_SIZE) {
+        uint64_t mask = index->header->slot_count - 1;
+        for (uint64_t slot = slot_of(digest, index->header->slot_count);; slot = (slot + 1) & mask) {
+            const DplIndexSlot *entry = &index->slots[slot];
+            if (entry->path == 0) {
+                return NULL;
+            }
+            if (memcmp(entry->digest, digest, 16) == 0) {
+                size = entry->size;
+                break;
+            }
+        }
+    }
+
+    DplIndexRecord key;
+    key.size = size;
+    memcpy(key.digest, digest, 16);
+    uint64_t lo = 0, hi = index->header->entry_count;
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        int cmp = dpl_index_compare_records(&index->records[mid], &key);
+        if (cmp == 0) {
+            return &index->digests[mid];
+        }
+        if (cmp < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return NULL;
+}
+
+int dpl_index_lookup_file(const DplIndex *index, const char *path, const char **match,
+                          const DplIndexDigests **digests) {
+    unsigned char buffer[LOOKUP_BUF_SIZE];
+    unsigned char digest[16];
+    struct stat statbuf;
+    MD5_CTX context;
+    ssize_t len;
+
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+    if (fstat(fd, &statbuf) == -1) {
+        close(fd);
+        return -1;
+    }
+    MD5Init(&context);
+    while ((len = read(fd, buffer, sizeof(buffer))) > 0) {
+        MD5Update(&context, buffer, (unsigned int)len);
+    }
+    close(fd);
+    if (len == -1) {
+        return -1;
+    }
+    MD5Final(digest, &context);
+
+    const char *found = dpl_index_lookup(index, digest, (uint64_t)statbuf.st_size);
+    if (match != NULL) {
+        *match = found;
+    }
+    if (digests != NULL) {
+        *digests = found != NULL ? dpl_index_digests(index, digest, (uint64_t)statbuf.st_size) : NULL;
+    }
+    return found != NULL;
+}
+
+int dpl_index_parse_digest(const char *hex, unsigned char digest[16]) {
+    if (strlen(hex) != 32) {
+        return -1;
+    }
+    for (int i = 0; i < 16; i++) {
+        unsigned int byte;
+        if (sscanf(hex + 2 * i, "%2x", &byte) != 1) {
+            return -1;
+        }
+        digest[i] = (unsigned char)byte;
+    }
+    return 0;
+}
@@ -0,0 +1,140 @@
+#ifndef DPL_INDEX_H
+#define DPL_INDEX_H
+
+// Índice de digests exportado por dpl --export-index. Es un archivo
+// inmutable pensado para abrirse con mmap: una cabecera, una tabla de
+// direccionamiento abierto con un slot por cada (tamaño, hash) distinto, las
+// mismas entradas ordenadas por (tamaño, digest), opcionalmente los digests
+// adicionales de cada una (SHA-256, CRC32C) y el bloque de rutas. Una
+// consulta toca sólo los slots que recorre, sin copiar el índice a memoria
+// dinámica; dpl merge recorre la sección ordenada de varios índices a la vez.
+//
+// Junto al índice se guarda un filtro de Bloom por bloques (<índice>.bloom).
+// Cada (tamaño, digest) marca bits dentro de un único bloque de 64 bytes, así
+// que descartar un archivo nuevo cuesta una sola línea de caché del filtro y
+// no toca la tabla. Si el filtro falta o no corresponde al índice (distinta
+// generación), las consultas van directo a la tabla.
+//
+// Los enteros se guardan en el orden de bytes de la máquina que escribió el
+// índice. Tanto dpl como el programa de consulta (dpl-lookup) se enlazan
+// con dpl_index.c; el Makefile de la raíz construye ambos.
+
+#include <stdint.h>
+#include <stddef.h>
+#include "dpl_digest.h"
+
+#define DPL_INDEX_MAGIC "DPLINDEX"
+#define DPL_INDEX_VERSION 5
+#define DPL_HOST_SIZE 64
+#define DPL_BLOOM_MAGIC "DPLBLOOM"
+#define DPL_BLOOM_VERSION 1
+#define DPL_BLOOM_BLOCK 64          // Bytes por bloque: una línea de caché
+#define DPL_BLOOM_BITS_PER_ENTRY 10 // Con 7 bits por clave, ~1% de falsos positivos
+#define DPL_BLOOM_HASHES 7
+#define DPL_ANY_SIZE UINT64_MAX // Tamaño comodín para buscar sólo por digest
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t digests;      // DPL_DIGEST_SHA256 | DPL_DIGEST_CRC32C guardados, o 0
+    uint64_t generation;   // Identifica la escritura; el filtro debe tener la misma
+    uint64_t entry_count;
+    uint64_t slot_count;   // Potencia de 2, al menos el doble de entry_count
+    uint64_t slots_offset; // Desde el comienzo del archivo
+    uint64_t paths_offset;
+    uint64_t paths_size;
+    uint64_t records_offset; // entry_count registros ordenados por (tamaño, digest)
+    uint64_t digests_offset; // Con digests != 0, un DplIndexDigests por registro, en el mismo orden
+    char host[DPL_HOST_SIZE]; // Máquina donde se hizo el recorrido
+} DplIndexHeader;
+
+typedef struct {
+    unsigned char digest[16];
+    uint64_t size;
+    uint64_t path; // Offset de la ruta en el bloque más uno; 0 = slot vacío
+} DplIndexSlot;
+
+typedef struct {
+    uint64_t size;
+    unsigned char digest[16];
+    uint64_t path; // Offset de la ruta en el bloque
+} DplIndexRecord;
+
+typedef struct {
+    unsigned char sha256[32];
+    uint32_t crc32c;
+    uint32_t reserved;
+} DplIndexDigests;
+
+// Cabecera del filtro; los bloques empiezan en el byte DPL_BLOOM_BLOCK
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t hashes;
+    uint64_t generation;
+    uint64_t block_count; // Potencia de 2
+    uint64_t entry_count;
+    char reserved[DPL_BLOOM_BLOCK - 40];
+} DplBloomHeader;
+
+// Archivo a exportar
+typedef struct {
+    uint64_t size;
+    unsigned char digest[16];
+    unsigned char sha256[32]; // Sólo si se exportan con DPL_DIGEST_SHA256
+    uint32_t crc32c;          // Sólo si se exportan con DPL_DIGEST_CRC32C
+    const char *path;
+} DplIndexEntry;
+
+typedef struct {
+    void *map;
+    size_t length;
+    const DplIndexHeader *header;
+    const DplIndexSlot *slots;
+    const char *paths;
+    const DplIndexRecord *records;
+    const DplIndexDigests *digests; // NULL si el índice no guarda digests adicionales
+    void *bloom_map;      // NULL si no hay filtro utilizable
+    size_t bloom_length;
+    const unsigned char *bloom;
+    uint64_t bloom_blocks;
+    uint32_t bloom_hashes;
+} DplIndex;
+
+// Escribe el índice y su filtro en archivos temporales y los renombra, de
+// modo que quien los tenga abiertos siga viendo la versión anterior. Las
+// entradas con el mismo (tamaño, digest) se guardan una sola vez. digests
+// indica qué campos adicionales de las entradas se guardan
+// (DPL_DIGEST_SHA256, DPL_DIGEST_CRC32C o 0). Devuelve 0 o -1 (errno).
+int dpl_index_write(const char *path, const char *host, int digests, const DplIndexEntry *entries, size_t count);
+
+int dpl_index_open(DplIndex *index, const char *path);
+void dpl_index_close(DplIndex *index);
+
+// Devuelve la ruta guardada para el digest (y el tamaño, salvo DPL_ANY_SIZE)
+// o NULL si no está en el índice. Con tamaño se consulta antes el filtro.
+const char *dpl_index_lookup(const DplIndex *index, const unsigned char digest[16], uint64_t size);
+
+// Calcula el MD5 del archivo y lo busca. Devuelve 1 si existe (y deja la ruta
+// en match y los digests adicionales en digests, si no son NULL), 0 si no, o
+// -1 si no se pudo leer el archivo.
+int dpl_index_lookup_file(const DplIndex *index, const char *path, const char **match,
+                          const DplIndexDigests **digests);
+
+// Digests adicionales del contenido (tamaño, MD5), o NULL si el índice no
+// los guarda o el contenido no está. Busca en la sección ordenada.
+const DplIndexDigests *dpl_index_digests(const DplIndex *index, const unsigned char digest[16], uint64_t size);
+
+// 0 si el filtro asegura que (digest, tamaño) no está; 1 si puede estar
+int dpl_index_maybe_contains(const DplIndex *index, const unsigned char digest[16], uint64_t size);
+
+// Prepara la sección ordenada para leerla de principio a fin y la devuelve
+const DplIndexRecord *dpl_index_records(const DplIndex *index);
+
+// Orden de la sección ordenada: por tamaño y luego por digest
+int dpl_index_compare_records(const DplIndexRecord *a, const DplIndexRecord *b);
+
+// Convierte 32 dígitos hexadecimales a los 16 bytes del digest
+int dpl_index_parse_digest(const char *hex, unsigned char digest[16]);
+
+#endif
@@ -0,0 +1,89 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "dpl_index.h"
+
+// Consulta un índice exportado con dpl --export-index. Cada argumento es un
+// archivo (se calcula su MD5) o, con -x, un digest en hexadecimal. El código
+// de salida es 0 si todos existen en el índice, 1 si falta alguno y 2 ante
+// un error.
+
+// Agrega a la línea los digests adicionales que guarde el índice
+static void print_digests(const DplIndex *index, const DplIndexDigests *digests) {
+    if (digests == NULL) {
+        return;
+    }
+    if (index->header->digests & DPL_DIGEST_SHA256) {
+        printf(" sha256=");
+        for (int i = 0; i < 32; i++) {
+            printf("%02x", digests->sha256[i]);
+        }
+    }
+    if (index->header->digests & DPL_DIGEST_CRC32C) {
+        printf(" crc32c=%08x", digests->crc32c);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    const char *index_path = NULL;
+    int digests = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "i:x")) != -1) {
+        switch (opt) {
+        case 'i': index_path = optarg; break;
+        case 'x': digests = 1; break;
+        default: index_path = NULL; optind = argc + 1; break;
+        }
+    }
+    if (index_path == NULL || optind >= argc) {
+        fprintf(stderr, "Uso: %s -i <indice> [-x] <archivo | digest>...\n", argv[0]);
+        fprintf(stderr, "  -x   los argumentos son digests MD5 en hexadecimal\n");
+        return 2;
+    }
+
+    DplIndex index;
+    if (dpl_index_open(&index, index_path) == -1) {
+        perror(index_path);
+        return 2;
+    }
+
+    int status = 0;
+    for (int i = optind; i < argc; i++) {
+        const char *match = NULL;
+        const DplIndexDigests *extra = NULL;
+        int found;
+        if (digests) {
+            unsigned char digest[16];
+            if (dpl_index_parse_digest(argv[i], digest) == -1) {
+                fprintf(stderr, "%s: digest inválido\n", argv[i]);
+                status = 2;
+                continue;
+            }
+            match = dpl_index_lookup(&index, digest, DPL_ANY_SIZE);
+            found = match != NULL;
+            if (found) {
+                extra = dpl_index_digests(&index, digest, DPL_ANY_SIZE);
+            }
+        } else {
+            found = dpl_index_lookup_file(&index, argv[i], &match, &extra);
+            if (found == -1) {
+                perror(argv[i]);
+                status = 2;
+                continue;
+            }
+        }
+        if (found) {
+            printf("%s: existe (%s)", argv[i], match);
+            print_digests(&index, extra);
+            printf("\n");
+        } else {
+            printf("%s: no existe\n", argv[i]);
+            status = status == 0 ? 1 : status;
+        }
+    }
+
+    dpl_index_close(&index);
+    return status;
+}
@@ -6,10 +6,18 @@
 #include <pthread.h>
 #include <semaphore.h>
 #include <unistd.h>
+#include <time.h>
+#include <getopt.h>
 
 #define MAX_FILES 1024
 #define MAX_PATH 1024
 
+// Búsqueda rápida de posibles duplicados sin leer el contenido: los archivos
+// se agrupan sólo por metadatos, con una tabla hash sobre la clave elegida.
+// La salida es una lista de grupos que dpl puede confirmar con --candidates.
+#define KEY_NAME_SIZE 'n'  // (nombre, tamaño)
+#define KEY_SIZE_MTIME 'm' // (tamaño, fecha de modificación)
+
 typedef struct {
     char path[MAX_PATH];
 } FileNode;
@@ -19,30 +27,74 @@ typedef struct {
     int count;
 } FileList;
 
+// Archivo regular encontrado en el recorrido. Los archivos con la misma
+// clave forman una lista enlazada por next a partir de la cabeza del grupo.
+typedef struct {
+    char *path;
+    const char *name; // Apunta al nombre dentro de path
+    off_t size;
+    time_t mtime;
+    int next;  // Siguiente archivo del mismo grupo, -1 al final
+    int count; // Archivos del grupo (sólo en la cabeza)
+} FileRecord;
+
 FileList to_visit;
-FileList visited;
+FileRecord *visited = NULL;
+int visited_count = 0, visited_capacity = 0;
+int *table = NULL; // Cabezas de grupo, direccionamiento abierto
+int table_size = 0;
+char key_mode = KEY_NAME_SIZE;
 sem_t mutex;
 sem_t sem_to_visit;
 sem_t sem_visited;
+int num_walkers = 0;
+int active_walkers = 0; // Hilos procesando una entrada (protegido por mutex)
 
 void *check_duplicates(void *arg);
 void add_to_visit(const char *path);
-void add_to_visited(const char *path);
-int is_duplicate(const char *file1, const char *file2);
+void add_to_visited(const char *path, const struct stat *statbuf);
+int is_duplicate(const FileRecord *file1, const FileRecord *file2);
+unsigned int record_hash(const FileRecord *record);
+void grow_table(void);
 void process_directory(const char *dir_path);
+void print_groups(FILE *out);
 
 int main(int argc, char *argv[]) {
-    if (argc != 5 || strcmp(argv[1], "-t") != 0 || strcmp(argv[3], "-d") != 0) {
-        fprintf(stderr, "Uso: %s -t <numero de threads> -d <directorio de inicio>\n", argv[0]);
+    int num_threads = 0;
+    const char *start_dir = NULL;
+    const char *output_path = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:d:k:o:")) != -1) {
+        switch (opt) {
+        case 't': num_threads = atoi(optarg); break;
+        case 'd': start_dir = optarg; break;
+        case 'k': key_mode = optarg[0]; break;
+        case 'o': output_path = optarg; break;
+        default: start_dir = NULL; break;
+        }
+    }
+    if (optind != argc || num_threads <= 0 || start_dir == NULL ||
+        (key_mode != KEY_NAME_SIZE && key_mode != KEY_SIZE_MTIME)) {
+        fprintf(stderr, "Uso: %s -t <numero de threads> -d <directorio de inicio> [-k <n | m>] [-o <archivo>]\n", argv[0]);
+        fprintf(stderr, "  -k n   agrupa por nombre y tamaño (por defecto)\n");
+        fprintf(stderr, "  -k m   agrupa por tamaño y fecha de modificación\n");
+        fprintf(stderr, "  -o     escribe los grupos en el archivo (entrada de dpl --candidates)\n");
         return EXIT_FAILURE;
     }
 
-    int num_threads = atoi(argv[2]);
-    const char *start_dir = argv[4];
+    FILE *out = stdout;
+    if (output_path != NULL) {
+        out = fopen(output_path, "w");
+        if (out == NULL) {
+            perror("fopen");
+            return EXIT_FAILURE;
+        }
+    }
 
     // Inicializar listas y semáforos
     to_visit.count = 0;
-    visited.count = 0;
+    grow_table();
     sem_init(&mutex, 0, 1);
     sem_init(&sem_to_visit, 0, 0);
     sem_init(&sem_visited, 0, 1);
@@ -51,6 +103,7 @@ int main(int argc, char *argv[]) {
     add_to_visit(start_dir);
 
     // Crear hilos
+    num_walkers = num_threads;
     pthread_t threads[num_threads];
     for (int i = 0; i < num_threads; i++) {
         pthread_create(&threads[i], NULL, check_duplicates, NULL);
@@ -61,15 +114,27 @@ int main(int argc, char *argv[]) {
         pthread_join(threads[i], NULL);
     }
 
+    print_groups(out);
+    if (out != stdout) {
+        fclose(out);
+    }
+
     // Limpiar semáforos
     sem_destroy(&mutex);
     sem_destroy(&sem_to_visit);
     sem_destroy(&sem_visited);
+    for (int i = 0; i < visited_count; i++) {
+        free(visited[i].path);
+    }
+    free(visited);
+    free(table);
 
     return EXIT_SUCCESS;
 }
 
 void *check_duplicates(void *arg) {
+    (void)arg;
+
     while (1) {
         // Esperar a que haya archivos a visitar
         sem_wait(&sem_to_visit);
@@ -78,33 +143,34 @@ void *check_duplicates(void *arg) {
         sem_wait(&mutex);
         if (to_visit.count == 0) {
             sem_post(&mutex);
-            break; // Salir si no hay más archivos a visitar
+            break; // El recorrido terminó y otro hilo nos despertó para salir
         }
         // Obtener el siguiente archivo a visitar
         char current_file[MAX_PATH];
         strcpy(current_file, to_visit.files[--to_visit.count].path);
+        active_walkers++;
         sem_post(&mutex);
 
         // Procesar el directorio o archivo
         struct stat statbuf;
         if (stat(current_file, &statbuf) == -1) {
             perror("stat");
-            continue;
-        }
-
-        if (S_ISDIR(statbuf.st_mode)) {
+        } else if (S_ISDIR(statbuf.st_mode)) {
             process_directory(current_file);
         } else if (S_ISREG(statbuf.st_mode) && statbuf.st_size > 0) {
-            // Comparar con archivos visitados
-            sem_wait(&sem_visited);
-            for (int i = 0; i < visited.count; i++) {
-                if (is_duplicate(current_file, visited.files[i].path)) {
-                    printf("Duplicado encontrado: %s y %s\n", current_file, visited.files[i].path);
-                }
+            add_to_visited(current_file, &statbuf);
+        }
+
+        // Si no queda nada pendiente ni nadie que pueda agregar más entradas,
+        // el recorrido terminó: despertar a todos los hilos para que salgan
+        sem_wait(&mutex);
+        active_walkers--;
+        if (to_visit.count == 0 && active_walkers == 0) {
+            for (int i = 0; i < num_walkers; i++) {
+                sem_post(&sem_to_visit);
             }
-            add_to_visited(current_file);
-            sem_post(&sem_visited);
         }
+        sem_post(&mutex);
     }
     return NULL;
 }
@@ -114,21 +180,105 @@ void add_to_visit(const char *path) {
     if (to_visit.count < MAX_FILES) {
         strcpy(to_visit.files[to_visit.count++].path, path);
         sem_post(&sem_to_visit);
+    } else {
+        fprintf(stderr, "Lista de archivos a visitar llena, se omite %s\n", path);
     }
     sem_post(&mutex);
 }
 
-void add_to_visited(const char *path) {
-    sem_wait(&mutex);
-    if (visited.count < MAX_FILES) {
-        strcpy(visited.files[visited.count++].path, path);
+// Registra el archivo y lo agrega al grupo de su clave; el grupo se busca en
+// la tabla en lugar de compararlo con todos los archivos anteriores
+void add_to_visited(const char *path, const struct stat *statbuf) {
+    sem_wait(&sem_visited);
+    if (visited_count == visited_capacity) {
+        visited_capacity = visited_capacity > 0 ? visited_capacity * 2 : 4096;
+        visited = realloc(visited, sizeof(FileRecord) * visited_capacity);
+        if (visited == NULL) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
     }
-    sem_post(&mutex);
+    if (visited_count * 2 >= table_size) {
+        grow_table();
+    }
+    int index = visited_count++;
+    FileRecord *record = &visited[index];
+    record->path = strdup(path);
+    record->name = strrchr(record->path, '/') != NULL ? strrchr(record->path, '/') + 1 : record->path;
+    record->size = statbuf->st_size;
+    record->mtime = statbuf->st_mtime;
+    record->next = -1;
+    record->count = 1;
+
+    unsigned int slot = record_hash(record) & (table_size - 1);
+    while (table[slot] != -1 && !is_duplicate(&visited[table[slot]], record)) {
+        slot = (slot + 1) & (table_size - 1);
+    }
+    if (table[slot] == -1) {
+        table[slot] = index; // Primer archivo con esta clave
+    } else {
+        FileRecord *head = &visited[table[slot]];
+        record->next = head->next;
+        head->next = index;
+        head->count++;
+    }
+    sem_post(&sem_visited);
 }
 
-int is_duplicate(const char *file1, const char *file2) {
-    // Aquí se puede implementar una comparación más robusta, como comparar hashes
-    return strcmp(file1, file2) == 0; // Comparación simple por nombre
+// Dos archivos son posibles duplicados si coinciden en la clave elegida;
+// el contenido no se lee, eso queda para dpl
+int is_duplicate(const FileRecord *file1, const FileRecord *file2) {
+    if (file1->size != file2->size) {
+        return 0;
+    }
+    if (key_mode == KEY_SIZE_MTIME) {
+        return file1->mtime == file2->mtime;
+    }
+    return strcmp(file1->name, file2->name) == 0;
+}
+
+// FNV-1a sobre los campos de la clave
+unsigned int record_hash(const FileRecord *record) {
+    unsigned int hash = 2166136261u;
+    unsigned long long size = (unsigned long long)record->size;
+    unsigned long long second = key_mode == KEY_SIZE_MTIME ? (unsigned long long)record->mtime : 0;
+
+    for (int i = 0; i < 8; i++) {
+        hash = (hash ^ ((size >> (8 * i)) & 0xff)) * 16777619u;
+        hash = (hash ^ ((second >> (8 * i)) & 0xff)) * 16777619u;
+    }
+    if (key_mode == KEY_NAME_SIZE) {
+        for (const char *c = record->name; *c != '\0'; c++) {
+            hash = (hash ^ (unsigned char)*c) * 16777619u;
+        }
+    }
+    return hash;
+}
+
+// Duplica la tabla y vuelve a insertar las cabezas de grupo
+void grow_table(void) {
+    int old_size = table_size;
+    int *old = table;
+
+    table_size = table_size > 0 ? table_size * 2 : 8192;
+    table = malloc(sizeof(int) * table_size);
+    if (table == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < table_size; i++) {
+        table[i] = -1;
+    }
+    for (int i = 0; i < old_size; i++) {
+        if (old[i] != -1) {
+            unsigned int slot = record_hash(&visited[old[i]]) & (table_size - 1);
+            while (table[slot] != -1) {
+                slot = (slot + 1) & (table_size - 1);
+            }
+            table[slot] = old[i];
+        }
+    }
+    free(old);
 }
 
 void process_directory(const char *dir_path) {
@@ -143,12 +293,47 @@ void process_directory(const char *dir_path) {
         if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
             char full_path[MAX_PATH];
             snprintf(full_path, sizeof(full_path), "%s/%s", dir_path, entry->d_name);
-            if (entry->d_type == DT_DIR) {
+            if (entry->d_type == DT_REG) {
+                // Los archivos se registran aquí mismo: sólo hace falta su stat
+                struct stat statbuf;
+                if (stat(full_path, &statbuf) == -1) {
+                    perror("stat");
+                } else if (statbuf.st_size > 0) {
+                    add_to_visited(full_path, &statbuf);
+                }
+            } else if (entry->d_type == DT_DIR || entry->d_type == DT_UNKNOWN) {
                 add_to_visit(full_path); // Agregar directorio a visitar
-            } else if (entry->d_type == DT_REG) {
-                add_to_visit(full_path); // Agregar archivo regular a visitar
             }
         }
     }
     closedir(dir);
-} 
\ No newline at end of file
+}
+
+// Formato de salida, el mismo que lee dpl --candidates: cada grupo empieza
+// con una línea de comentario (#) seguida de una ruta por línea, y los grupos
+// se separan con una línea vacía
+void print_groups(FILE *out) {
+    int group_count = 0, file_count = 0;
+
+    for (int i = 0; i < table_size; i++) {
+        if (table[i] == -1 || visited[table[i]].count < 2) {
+            continue;
+        }
+        const FileRecord *head = &visited[table[i]];
+        if (key_mode == KEY_SIZE_MTIME) {
+            char when[32];
+            strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&head->mtime));
+            fprintf(out, "# %d archivos de %lld bytes modificados el %s\n", head->count, (long long)head->size, when);
+        } else {
+            fprintf(out, "# %d archivos llamados %s de %lld bytes\n", head->count, head->name, (long long)head->size);
+        }
+        for (int f = table[i]; f != -1; f = visited[f].next) {
+            fprintf(out, "%s\n", visited[f].path);
+        }
+        fprintf(out, "\n");
+        group_count++;
+        file_count += head->count;
+    }
+    fprintf(stderr, "Se han encontrado %d grupos de posibles duplicados (%d archivos de %d revisados).\n",
+            group_count, file_count, visited_count);
+}
@@ -1,6 +1,8 @@
 /* GLOBAL.H - RSAREF types and constants
  */
 
+#include <stdint.h>
+
 /* PROTOTYPES should be set to one if and only if the compiler supports
   function argument prototyping.
   The following makes PROTOTYPES default to 0 if it has not already
@@ -17,8 +19,10 @@ typedef unsigned char *POINTER;
 /* UINT2 defines a two byte word */
 typedef unsigned short int UINT2;
 
-/* UINT4 defines a four byte word */
-typedef unsigned long int UINT4;
+/* UINT4 defines a four byte word. Debe ser exactamente de 32 bits:
+  unsigned long int ocupa 8 bytes en LP64 y el resultado deja de ser MD5.
+ */
+typedef uint32_t UINT4;
 
 /* PROTO_LIST is defined depending on how PROTOTYPES is defined above.
 If using PROTOTYPES, then PROTO_LIST returns the list, otherwise it
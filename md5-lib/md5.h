@@ -30,11 +30,11 @@ typedef struct {
   unsigned char buffer[64];                         /* input buffer */
 } MD5_CTX;
 
-//void MD5Init PROTO_LIST ((MD5_CTX *));
-//void MD5Update PROTO_LIST
-//  ((MD5_CTX *, unsigned char *, unsigned int));
-//void MD5Final PROTO_LIST ((unsigned char [16], MD5_CTX *));
-//int MDFile (char *, char [33]);
+void MD5Init PROTO_LIST ((MD5_CTX *));
+void MD5Update PROTO_LIST
+  ((MD5_CTX *, unsigned char *, unsigned int));
+void MD5Final PROTO_LIST ((unsigned char [16], MD5_CTX *));
+int MDFile (char *, char [33]);
 
 
 
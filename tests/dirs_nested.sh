@@ -0,0 +1,27 @@
+#!/bin/sh
+# Duplicados anidados dentro de un árbol duplicado (--dirs): A/x y A/z son
+# iguales y B es una copia de A. La copia B no explica que A/x == A/z, así
+# que ese par de directorios tiene que informarse.
+#
+# Uso: tests/dirs_nested.sh <ruta a dpl>
+DPL=${1:-./dpl}
+DIR=$(mktemp -d) || exit 1
+trap 'rm -rf "$DIR"' EXIT
+
+mkdir -p "$DIR/A/x" "$DIR/A/z"
+echo hello > "$DIR/A/x/f"
+echo hello > "$DIR/A/z/f"
+cp -r "$DIR/A" "$DIR/B"
+
+OUT=$("$DPL" -t 2 -d "$DIR" -m l --dirs) || { echo "FALLO: dpl terminó con error"; exit 1; }
+
+fail() {
+    echo "FALLO: $1"
+    echo "$OUT"
+    exit 1
+}
+echo "$OUT" | grep -q "^Se han encontrado 2 directorios duplicados.$" || fail "se esperaban 2 directorios duplicados"
+echo "$OUT" | grep -q "^El directorio $DIR/B es duplicado de $DIR/A " || fail "falta B duplicado de A"
+echo "$OUT" | grep -Eq "^El directorio $DIR/A/(x|z) es duplicado de $DIR/A/(x|z) " || fail "falta A/x duplicado de A/z"
+echo "$OUT" | grep -q "^Se han encontrado 0 archivos duplicados.$" || fail "los pares de archivos ya están explicados"
+echo "dirs_nested: ok"